@@ -16,13 +16,22 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 CONFIG += c++17
 
+# The atomic counters use QAtomicInteger::loadRelaxed()
+!versionAtLeast(QT_VERSION, 5.14.0): error("Hexed requires Qt 5.14 or newer")
+
 SOURCES += \
         baseconverter.cpp \
+        bitmap.cpp \
         bufferededitor.cpp \
         byteinputwidget.cpp \
         common.cpp \
+        editjournal.cpp \
         endianconverter.cpp \
         expressionvalidator.cpp \
+        fenwicktree.cpp \
+        filecopier.cpp \
+        filemover.cpp \
+        filesource.cpp \
         finder.cpp \
         findwidget.cpp \
         gotodialog.cpp \
@@ -30,22 +39,49 @@ SOURCES += \
         hexviewinternal.cpp \
         iconprovider.cpp \
         main.cpp \
-        mainwindow.cpp
+        mainwindow.cpp \
+        memorygovernor.cpp \
+        patchwriter.cpp \
+        piecetablebackend.cpp \
+        prefetcher.cpp \
+        sectionbackend.cpp \
+        snapshot.cpp \
+        sparsefile.cpp \
+        spillfile.cpp \
+        storagepolicy.cpp
 
 HEADERS += \
         baseconverter.h \
+        bitmap.h \
         bufferededitor.h \
         byteinputwidget.h \
         common.h \
+        editjournal.h \
+        editorbackend.h \
         endianconverter.h \
         expressionvalidator.h \
+        fenwicktree.h \
+        filecopier.h \
+        filemover.h \
+        filesource.h \
         finder.h \
         findwidget.h \
         gotodialog.h \
         hexview.h \
         hexviewinternal.h \
         iconprovider.h \
-        mainwindow.h
+        iocounters.h \
+        mainwindow.h \
+        memorygovernor.h \
+        patchwriter.h \
+        piecetablebackend.h \
+        prefetcher.h \
+        sectionbackend.h \
+        slabvector.h \
+        snapshot.h \
+        sparsefile.h \
+        spillfile.h \
+        storagepolicy.h
 
 RESOURCES += res/resources.qrc
 
@@ -0,0 +1,192 @@
+#include "bitmap.h"
+
+#include <QtAlgorithms>
+
+// A mask of the bits below `bit` in a word
+static inline quint64 lowMask(int bit)
+{
+	return bit == 0 ? 0 : ~quint64(0) >> (64 - bit);
+}
+
+Bitmap::Bitmap()
+	: m_size(0)
+	, m_count(0)
+{
+}
+
+Bitmap::Bitmap(int size, bool value)
+	: m_words((size + 63) / 64)
+	, m_size(size)
+	, m_count(0)
+{
+	fill(value);
+}
+
+void Bitmap::set(int index, bool value)
+{
+	Q_ASSERT(index >= 0 && index < m_size);
+	quint64 &word = m_words[index / 64];
+	quint64 bit = quint64(1) << (index % 64);
+	if (bool(word & bit) == value)
+		return;
+	if (value) {
+		word |= bit;
+		++m_count;
+	} else {
+		word &= ~bit;
+		--m_count;
+	}
+}
+
+void Bitmap::insert(int index, int count, bool value)
+{
+	Q_ASSERT(index >= 0 && index <= m_size && count >= 0);
+	int oldSize = m_size;
+	m_size += count;
+	m_words.resize((m_size + 63) / 64);
+
+	// Move the bits at and after `index` up by `count`
+	for (int i = oldSize - 1; i >= index; --i)
+		assign(i + count, test(i));
+
+	// Clear the gap without counting, so that fill() can count it
+	for (int i = index; i < qMin(index + count, oldSize); ++i)
+		assign(i, false);
+	fill(index, count, value);
+}
+
+void Bitmap::remove(int index, int count)
+{
+	Q_ASSERT(index >= 0 && count >= 0 && index + count <= m_size);
+	m_count -= rank(index + count) - rank(index);
+
+	// Move the bits after the removed ones down by `count`
+	for (int i = index + count; i < m_size; ++i)
+		assign(i - count, test(i));
+
+	// Keep the bits after the end cleared
+	m_size -= count;
+	m_words.resize((m_size + 63) / 64);
+	if (m_size % 64 != 0)
+		m_words.last() &= lowMask(m_size % 64);
+}
+
+void Bitmap::fill(bool value)
+{
+	for (quint64 &word : m_words)
+		word = value ? ~quint64(0) : 0;
+	// Keep the bits after the end cleared
+	if (value && m_size % 64 != 0)
+		m_words.last() = lowMask(m_size % 64);
+	m_count = value ? m_size : 0;
+}
+
+void Bitmap::fill(int index, int count, bool value)
+{
+	Q_ASSERT(index >= 0 && count >= 0 && index + count <= m_size);
+	int end = index + count;
+	int setBefore = rank(end) - rank(index);
+
+	// Whole words are filled at once, the partial ones at the edges bit by bit
+	int i = index;
+	for (; i < end && i % 64 != 0; ++i)
+		assign(i, value);
+	for (; i + 64 <= end; i += 64)
+		m_words[i / 64] = value ? ~quint64(0) : 0;
+	for (; i < end; ++i)
+		assign(i, value);
+
+	m_count += (value ? count : 0) - setBefore;
+}
+
+Bitmap Bitmap::mid(int index, int count) const
+{
+	Q_ASSERT(index >= 0 && count >= 0 && index + count <= m_size);
+	Bitmap bits(count, false);
+	for (int i = 0; i < count; ++i)
+		if (test(index + i))
+			bits.set(i, true);
+	return bits;
+}
+
+int Bitmap::rank(int index) const
+{
+	Q_ASSERT(index >= 0 && index <= m_size);
+	int rank = 0;
+	int w = index / 64;
+	for (int i = 0; i < w; ++i)
+		rank += qPopulationCount(m_words[i]);
+	if (index % 64 != 0)
+		rank += qPopulationCount(m_words[w] & lowMask(index % 64));
+	return rank;
+}
+
+int Bitmap::select(int rank) const
+{
+	if (rank < 0 || rank >= m_count)
+		return -1;
+
+	for (int i = 0; i < m_words.size(); ++i) {
+		quint64 word = m_words[i];
+		int count = qPopulationCount(word);
+		if (rank < count) {
+			// Clear the lower set bits until the needed one is the lowest
+			for (; rank > 0; --rank)
+				word &= word - 1;
+			return i * 64 + qCountTrailingZeroBits(word);
+		}
+		rank -= count;
+	}
+
+	Q_ASSERT(false);
+	return -1;
+}
+
+int Bitmap::nextSetBit(int index) const
+{
+	if (index >= m_size)
+		return -1;
+
+	int w = index / 64;
+	quint64 word = m_words[w] & ~lowMask(index % 64);
+	while (word == 0) {
+		if (++w == m_words.size())
+			return -1;
+		word = m_words[w];
+	}
+	return w * 64 + qCountTrailingZeroBits(word);
+}
+
+int Bitmap::nextClearBit(int index) const
+{
+	if (index >= m_size)
+		return -1;
+
+	int w = index / 64;
+	quint64 word = ~m_words[w] & ~lowMask(index % 64);
+	while (word == 0) {
+		if (++w == m_words.size())
+			return -1;
+		word = ~m_words[w];
+	}
+	// The bits after the end are always cleared
+	int bit = w * 64 + qCountTrailingZeroBits(word);
+	return bit < m_size ? bit : -1;
+}
+
+int Bitmap::previousSetBit(int index) const
+{
+	if (index <= 0)
+		return -1;
+
+	int w = (index - 1) / 64;
+	quint64 word = m_words[w];
+	if (index % 64 != 0)
+		word &= lowMask(index % 64);
+	while (word == 0) {
+		if (w-- == 0)
+			return -1;
+		word = m_words[w];
+	}
+	return w * 64 + 63 - qCountLeadingZeroBits(word);
+}
@@ -0,0 +1,66 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <QVector>
+#include <QtGlobal>
+
+// A resizable array of bits that keeps count of how many of them are set.
+// Ranking, selecting and searching work on whole 64-bit words at a time
+class Bitmap
+{
+public:
+	Bitmap();
+	Bitmap(int size, bool value);
+
+	int size() const
+	{
+		return m_size;
+	}
+
+	// The number of set bits
+	int count() const
+	{
+		return m_count;
+	}
+
+	bool test(int index) const
+	{
+		Q_ASSERT(index >= 0 && index < m_size);
+		return (m_words[index / 64] >> (index % 64)) & 1;
+	}
+
+	void set(int index, bool value);
+	void insert(int index, int count, bool value);
+	void remove(int index, int count);
+	void fill(bool value);
+	void fill(int index, int count, bool value);
+	Bitmap mid(int index, int count) const;
+
+	// The number of set bits before `index`
+	int rank(int index) const;
+	// The index of the set bit with the given rank, or -1 if there is no such bit
+	int select(int rank) const;
+	// The index of the first set bit at or after `index`, or -1 if there is no such bit
+	int nextSetBit(int index) const;
+	// The index of the first cleared bit at or after `index`, or -1 if there is no such bit
+	int nextClearBit(int index) const;
+	// The index of the last set bit before `index`, or -1 if there is no such bit
+	int previousSetBit(int index) const;
+
+private:
+	QVector<quint64> m_words;
+	int m_size;
+	int m_count;
+
+	// Sets a bit without keeping count
+	void assign(int index, bool value)
+	{
+		quint64 bit = quint64(1) << (index % 64);
+		if (value)
+			m_words[index / 64] |= bit;
+		else
+			m_words[index / 64] &= ~bit;
+	}
+};
+
+#endif // BITMAP_H
@@ -1,55 +1,173 @@
 #include "bufferededitor.h"
+#include "sectionbackend.h"
+#include "piecetablebackend.h"
+#include "filecopier.h"
 
+#include <QFile>
 #include <QFileDevice>
+#include <QFileInfo>
+#include <QTimer>
 
 #include <QDebug>
 
+#include <cstring>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 BufferedEditor::BufferedEditor(QFileDevice *device, QObject *parent)
+	: BufferedEditor(device, Backend::Sections, parent)
+{
+}
+
+BufferedEditor::BufferedEditor(QFileDevice *device, Backend backend, QObject *parent)
 	: QObject(parent)
 	, m_device(device)
-	, m_sectionIndex(-1)
-	, m_sectionLocalPosition(0)
-	, m_position(0)
-	, m_size(device->size())
-	, m_currentModificationIndex(0)
-	, m_modificationCount(0)
+	, m_backendType(backend)
+	, m_saveStrategy(SaveStrategy::Automatic)
+	, m_memoryBudget(defaultMemoryBudget)
+	, m_historyLimit(defaultHistoryLimit)
+	, m_storagePolicy(device)
+	, m_spillFile(device, &m_ioCounters)
+	, m_transactionDepth(0)
+	, m_transactionModified(false)
+	, m_transactionCouldRedo(false)
+	, m_transactionOldSize(0)
+	, m_loadTimer(new QTimer(this))
+	, m_saveTimer(new QTimer(this))
+	, m_saveDepth(0)
+	, m_saveJournalOffset(0)
+	, m_saveRedoDepth(0)
+	, m_version(0)
+	, m_fileGeneration(std::make_shared<QAtomicInteger<quint64>>(0))
+	, m_journaling(false)
+	, m_journalTimer(new QTimer(this))
+	, m_journalUndoDepth(0)
+	, m_journalRedoDepth(0)
+	, m_journalStale(false)
+	, m_journalPending(false)
 {
+	switch (backend) {
+	case Backend::Sections:
+		m_backend.reset(new SectionBackend(device, &m_spillFile, &m_ioCounters));
+		break;
+	case Backend::PieceTable:
+		m_backend.reset(new PieceTableBackend(device, &m_spillFile, &m_ioCounters));
+		break;
+	}
+	m_backend->setMemoryBudget(m_memoryBudget);
+	m_backend->setHistoryLimit(m_historyLimit);
+	m_backend->setStoragePolicy(m_storagePolicy);
+
+	m_loadTimer->setInterval(loadCheckInterval);
+	connect(m_loadTimer, &QTimer::timeout, this, &BufferedEditor::checkPendingLoads);
+
+	m_saveTimer->setInterval(saveCheckInterval);
+	connect(m_saveTimer, &QTimer::timeout, this, &BufferedEditor::checkSaving);
+
+	m_journalTimer->setInterval(journalCheckpointInterval);
+	connect(m_journalTimer, &QTimer::timeout, this, &BufferedEditor::checkpointJournal);
 }
 
-QString BufferedEditor::errorString() const
+BufferedEditor::~BufferedEditor()
 {
-	return m_device->errorString();
 }
 
-bool BufferedEditor::seek(qint64 position)
+// Runs a read at the cursor's state instead of the editor's, and keeps
+// where it ended up for the next one
+template<typename Result, typename Operation>
+Result BufferedEditor::readAt(Cursor::State &state, Operation operation)
 {
-	if (position == m_size) {
-		m_sectionIndex = -1;
-		m_sectionLocalPosition = 0;
-		m_position = m_size;
-		return true;
-	}
+	Cursor::State editorState = m_backend->cursorState();
+	m_backend->setCursorState(state);
+	Result result = operation();
+	state = m_backend->cursorState();
+	m_backend->setCursorState(editorState);
+	return result;
+}
 
-	m_sectionIndex = getSectionIndex(position);
-	if (m_sectionIndex == -1)
-		return false;
+BufferedEditor::Cursor::Cursor()
+	: m_editor(nullptr)
+{
+}
 
-	m_position = position;
+BufferedEditor::Cursor::Cursor(BufferedEditor *editor, qint64 position)
+	: m_editor(editor)
+{
+	m_state.position = position;
+}
 
-	const Section &s = m_sections[m_sectionIndex];
-	m_sectionLocalPosition = s.bytePosition(position);
+BufferedEditor *BufferedEditor::Cursor::editor() const
+{
+	return m_editor;
+}
 
-	return true;
+void BufferedEditor::Cursor::seek(qint64 position)
+{
+	// Reading on from where the cursor is doesn't need a lookup
+	if (position == m_state.position)
+		return;
+	m_state = State();
+	m_state.position = position;
+}
+
+qint64 BufferedEditor::Cursor::position() const
+{
+	return m_state.position;
+}
+
+bool BufferedEditor::Cursor::atEnd() const
+{
+	return m_state.position >= m_editor->size();
+}
+
+BufferedEditor::Byte BufferedEditor::Cursor::getByte()
+{
+	return m_editor->readAt<Byte>(m_state, [this]() { return m_editor->getByte(); });
+}
+
+BufferedEditor::Span BufferedEditor::Cursor::readSpan(qint64 maxLength)
+{
+	return m_editor->readAt<Span>(m_state, [&]() { return m_editor->readSpan(maxLength); });
+}
+
+qint64 BufferedEditor::Cursor::read(char *data, qint64 maxLength)
+{
+	return m_editor->readAt<qint64>(m_state, [&]() { return m_editor->read(data, maxLength); });
+}
+
+QByteArray BufferedEditor::Cursor::read(qint64 maxLength)
+{
+	return m_editor->readAt<QByteArray>(m_state, [&]() { return m_editor->read(maxLength); });
+}
+
+BufferedEditor::Backend BufferedEditor::backend() const
+{
+	return m_backendType;
+}
+
+QString BufferedEditor::errorString() const
+{
+	return m_errorString.isEmpty() ? m_device->errorString() : m_errorString;
+}
+
+bool BufferedEditor::seek(qint64 position)
+{
+	return m_backend->seek(position);
 }
 
 qint64 BufferedEditor::position() const
 {
-	return m_position;
+	return m_backend->position();
 }
 
 qint64 BufferedEditor::size() const
 {
-	return m_size;
+	return m_backend->size();
 }
 
 bool BufferedEditor::isEmpty() const
@@ -59,442 +177,604 @@ bool BufferedEditor::isEmpty() const
 
 bool BufferedEditor::atEnd() const
 {
-	return m_position == m_size;
+	return m_backend->position() == m_backend->size();
 }
 
 void BufferedEditor::moveForward()
 {
-	if (atEnd())
-		return;
+	m_backend->moveForward();
+}
 
-	const Section &s = m_sections[m_sectionIndex];
-	for (;;) {
-		++m_sectionLocalPosition;
-		if (m_sectionLocalPosition == s.data.size()) {
-			seek(m_position + 1); // TODO: optimize this somehow
-			return;
-		}
-		if (s.data[m_sectionLocalPosition].current)
+BufferedEditor::Byte BufferedEditor::getByte()
+{
+	return m_backend->getByte();
+}
+
+BufferedEditor::Span BufferedEditor::readSpan(qint64 maxLength)
+{
+	return m_backend->readSpan(maxLength);
+}
+
+bool BufferedEditor::isLoaded(qint64 position, qint64 length)
+{
+	return m_backend->isLoaded(position, length);
+}
+
+void BufferedEditor::load(qint64 position, qint64 length)
+{
+	QPair<qint64, qint64> range(position, length);
+	if (!m_pendingLoads.contains(range)) {
+		if (m_pendingLoads.size() == maximumPendingLoads)
+			m_pendingLoads.removeFirst();
+		m_pendingLoads.append(range);
+	}
+	m_backend->load(position, length);
+	if (!m_loadTimer->isActive())
+		m_loadTimer->start();
+}
+
+qint64 BufferedEditor::read(char *data, qint64 maxLength)
+{
+	qint64 bytesRead = 0;
+	while (bytesRead < maxLength && !atEnd()) {
+		Span span = m_backend->readSpan(maxLength - bytesRead);
+		if (span.length == 0)
 			break;
+		memcpy(data + bytesRead, span.data(), size_t(span.length));
+		bytesRead += span.length;
 	}
-	++m_position;
+	return bytesRead;
 }
 
-BufferedEditor::Byte BufferedEditor::getByte()
+QByteArray BufferedEditor::read(qint64 maxLength)
 {
-	auto byte = m_sections[m_sectionIndex].data[m_sectionLocalPosition];
-	Q_ASSERT(byte.current);
-	moveForward();
-	return byte;
+	QByteArray bytes(int(qMin(maxLength, size() - position())), Qt::Uninitialized);
+	bytes.resize(int(read(bytes.data(), bytes.size())));
+	return bytes;
 }
 
 void BufferedEditor::replaceByte(char byte)
 {
-	userDoModification(Modification(Modification::Type::Replace, byte, m_sectionIndex, m_sectionLocalPosition));
+	replaceRange(position(), QByteArray(1, byte));
 }
 
 void BufferedEditor::insertByte(char byte)
 {
-	userDoModification(Modification(Modification::Type::Insert, byte, m_sectionIndex, m_sectionLocalPosition));
+	insertBytes(position(), QByteArray(1, byte));
 }
 
 void BufferedEditor::deleteByte()
 {
-	userDoModification(Modification(Modification::Type::Delete, char(0), m_sectionIndex, m_sectionLocalPosition));
+	deleteRange(position(), 1);
 }
 
-bool BufferedEditor::writeChanges()
+void BufferedEditor::insertBytes(qint64 position, const QByteArray &bytes)
 {
-	// Needed for the dummy section
-	qint64 oldFileSize = m_device->size();
+	Q_ASSERT(position >= 0 && position <= size());
+	if (bytes.isEmpty())
+		return;
 
-	// Increase the file size if needed
-	if (m_device->size() < m_size)
-		if (!m_device->resize(m_size))
-			return false;
+	bool couldRedo = canRedo();
+	qint64 oldSize = size();
+	m_backend->insertBytes(position, bytes);
+	appendToJournal(EditJournal::Record(EditJournal::Operation::InsertBytes, position, bytes.size(), bytes));
+	onModification(couldRedo, oldSize);
+}
 
-	// The UnchangedSection objects are sections of the file that are
-	// not modified or loaded into memory, but have to be *moved*
-	// to a different position in the file because of insertions
-	// or deletions that have happened in some loaded sections
+void BufferedEditor::insertBytes(qint64 position, qint64 count, char value)
+{
+	insertPattern(position, count, QByteArray(1, value));
+}
 
-	// Those sections will be limited to a size of `sectionSize`
-	// to prevent high memory usage during the reallocation
+void BufferedEditor::insertPattern(qint64 position, qint64 length, const QByteArray &pattern)
+{
+	Q_ASSERT(position >= 0 && position <= size());
+	if (length <= 0 || pattern.isEmpty())
+		return;
 
-	struct UnchangedSection
-	{
-		qint64 oldPosition, newPosition;
-		int length;
-	};
+	bool couldRedo = canRedo();
+	qint64 oldSize = size();
+	m_backend->insertPattern(position, length, pattern);
+	appendToJournal(EditJournal::Record(EditJournal::Operation::InsertPattern, position, length, pattern));
+	onModification(couldRedo, oldSize);
+}
 
-	QVector<UnchangedSection> unchangedSections;
-
-	// Make a list of the UnchangedSections
-	Section dummySection(oldFileSize, m_size); // Dummy end section
-	Section &firstSection = m_sections.isEmpty() ? dummySection : m_sections.first();
-	qint64 savedPosition = firstSection.savedPosition, currentPosition = firstSection.currentPosition;
-	for (int i = 0; i <= m_sections.size(); ++i) {
-		const Section &section = i < m_sections.size() ? m_sections[i] : dummySection;
-		Q_ASSERT(savedPosition <= section.savedPosition);
-
-		if (savedPosition != section.savedPosition) {
-			// The length of the unchanged section shouldn't be changed
-			Q_ASSERT(section.savedPosition - savedPosition == section.currentPosition - currentPosition);
-
-			qint64 length = section.savedPosition - savedPosition;
-			if (savedPosition != currentPosition) {
-				qint64 index = 0;
-				while (index < length) {
-					UnchangedSection s;
-					s.oldPosition = savedPosition + index;
-					s.newPosition = currentPosition + index;
-					s.length = int(qMin(qint64(sectionSize), length - index));
-					unchangedSections.append(s);
-					index += s.length;
-				}
-			}
-
-			savedPosition += length;
-			currentPosition += length;
-		}
-		savedPosition += section.savedLength();
-		currentPosition += section.currentLength();
-	}
+void BufferedEditor::deleteRange(qint64 position, qint64 length)
+{
+	Q_ASSERT(position >= 0 && position <= size());
+	length = qMin(length, size() - position);
+	if (length <= 0)
+		return;
 
-	qDebug() << unchangedSections.size() << "unchanged sections have to be moved";
-
-	// Sort the sections in the order that they have to be written to the disk
-	QVector<UnchangedSection> sortedUnchangedSections;
-	while (!unchangedSections.isEmpty()) {
-		// Find a section s1 that won't be written over another section
-		int attemptCount = 0;
-		int j = 0;
-		UnchangedSection s1 = unchangedSections[j];
-		for (int i = 0; i < unchangedSections.size(); ++i) {
-			if (i != j) {
-				UnchangedSection s2 = unchangedSections[i];
-				// If s1 will be written over s2
-				if (s1.newPosition < s2.oldPosition + s2.length &&
-						s1.newPosition + s1.length > s2.oldPosition) {
-					// Restart the search
-					s1 = s2;
-					j = i;
-					i = 0;
-					++attemptCount;
-					Q_ASSERT(attemptCount <= unchangedSections.size());
-					if (attemptCount > unchangedSections.size())
-						return false;
-				}
-			}
-		}
-		unchangedSections.removeAt(j);
-		sortedUnchangedSections.append(s1);
-	}
+	bool couldRedo = canRedo();
+	qint64 oldSize = size();
+	m_backend->deleteRange(position, length);
+	appendToJournal(EditJournal::Record(EditJournal::Operation::DeleteRange, position, length));
+	onModification(couldRedo, oldSize);
+}
 
-	// Move those sections
-	for (int i = 0; i < sortedUnchangedSections.size(); ++i) {
-		UnchangedSection s = sortedUnchangedSections[i];
-		qDebug("Moving section %d/%d with a length of %d from %lld to %lld",
-			   i, sortedUnchangedSections.size() - 1,
-			   s.length, s.oldPosition, s.newPosition);
+void BufferedEditor::replaceRange(qint64 position, const QByteArray &bytes)
+{
+	Q_ASSERT(position >= 0 && position <= size());
+	qint64 length = qMin(qint64(bytes.size()), size() - position);
+	if (length <= 0)
+		return;
 
-		QVector<char> buffer(int(s.length));
+	bool couldRedo = canRedo();
+	qint64 oldSize = size();
+	QByteArray replacement = bytes.left(int(length));
+	m_backend->replaceRange(position, replacement);
+	appendToJournal(EditJournal::Record(EditJournal::Operation::ReplaceRange, position, length, replacement));
+	onModification(couldRedo, oldSize);
+}
 
-		if (!m_device->seek(s.oldPosition)) {
-			qCritical() << "BufferedEditor: Failed to seek in file:" << m_device->errorString();
-			return false;
-		}
-		qint64 bytesRead = m_device->read(buffer.data(), s.length);
-		if (bytesRead == -1) {
-			qCritical() << "Failed to read from file:" << m_device->errorString();
-			return false;
-		}
-		Q_ASSERT(bytesRead == s.length);
+void BufferedEditor::fillRange(qint64 position, qint64 length, char value)
+{
+	Q_ASSERT(position >= 0 && position <= size());
+	length = qMin(length, size() - position);
+	if (length <= 0)
+		return;
 
-		if (!m_device->seek(s.newPosition)) {
-			qCritical() << "BufferedEditor: Failed to seek in file:" << m_device->errorString();
-			return false;
-		}
-		qint64 bytesWritten = m_device->write(buffer.data(), s.length);
-		if (bytesWritten == -1) {
-			qCritical() << "Failed to write to file:" << m_device->errorString();
-			return false;
-		}
-		Q_ASSERT(bytesWritten == s.length);
+	bool couldRedo = canRedo();
+	qint64 oldSize = size();
+	m_backend->fillRange(position, length, value);
+	appendToJournal(EditJournal::Record(EditJournal::Operation::FillRange, position, length, QByteArray(1, value)));
+	onModification(couldRedo, oldSize);
+}
+
+bool BufferedEditor::writeChanges()
+{
+	if (isSaving() && !waitForSaving())
+		return false;
+	m_errorString.clear();
+	if (m_saveStrategy == SaveStrategy::NewFile && !isReplaceable()) {
+		m_errorString = "The file can't be replaced by a new one";
+		return false;
 	}
 
-	// Write the modified sections
-	for (int i = 0; i < m_sections.size(); ++i) {
-		Section &s = m_sections[i];
-		if (s.isModified() || s.savedPosition != s.currentPosition) {
-			qDebug("Writing section %d (%d)", i, m_sections.size());
-			QVector<char> buffer;
-			for (Byte b : s.data)
-				if (b.current)
-					buffer.append(*b.current);
-
-			if (!m_device->seek(s.currentPosition)) {
-				qCritical() << "BufferedEditor: Failed to seek in file:" << m_device->errorString();
-				return false;
-			}
+	bool success;
+	if (savesToNewFile()) {
+		success = writeNewFile();
+	} else {
+		m_fileGeneration->fetchAndAddOrdered(1);
+		success = m_backend->writeChanges();
+	}
+	// The journal starts over from the saved file
+	if (success && m_journaling)
+		restartJournal(-1, 0, 0);
+	return success;
+}
 
-			qint64 bytesWritten = m_device->write(buffer.data(), buffer.size());
-			if (bytesWritten == -1) {
-				qCritical() << "Failed to write to file:" << m_device->errorString();
-				return false;
-			}
-			Q_ASSERT(bytesWritten == buffer.size());
+bool BufferedEditor::startSaving()
+{
+	if (isSaving() || m_transactionDepth > 0 || !savesToNewFile())
+		return false;
+	m_errorString.clear();
+
+	bool couldUndo = canUndo();
+	m_copier.reset(new FileCopier(snapshot(), &m_ioCounters));
+	m_saveDepth = 0;
+	m_saveJournalOffset = m_journal ? m_journal->offset() : 0;
+	m_saveRedoDepth = 0;
+	// The edits made in the meantime are undone to get back to the saved
+	// contents in the end, so none of them may be forgotten until then
+	m_backend->setHistoryLimit(std::numeric_limits<qint64>::max());
+	m_copier->start();
+	m_saveTimer->start();
+
+	if (couldUndo)
+		emit canUndoChanged(false);
+	emit saveProgress(0, m_copier->totalLength());
+	return true;
+}
 
-			s.modificationCount = 0;
-			s.savedPosition = s.currentPosition;
-			for (Byte &b : s.data)
-				b.saved = b.current;
-		}
-	}
+bool BufferedEditor::isSaving() const
+{
+	return m_copier != nullptr;
+}
 
-	if (m_device->size() > m_size)
-		if (!m_device->resize(m_size))
-			return false;
+void BufferedEditor::cancelSaving()
+{
+	if (!isSaving())
+		return;
 
-	m_device->flush();
+	// The new file is removed and the old one was never touched
+	m_copier->requestInterruption();
+	m_copier->wait();
+	stopSaving();
+	emit saveFinished(false);
+}
 
-	m_modificationCount = 0;
+bool BufferedEditor::waitForSaving()
+{
+	if (!isSaving())
+		return true;
 
-	return true;
+	m_copier->wait();
+	return finishSaving();
+}
+
+BufferedEditor::SaveStrategy BufferedEditor::saveStrategy() const
+{
+	return m_saveStrategy;
+}
+
+void BufferedEditor::setSaveStrategy(SaveStrategy strategy)
+{
+	m_saveStrategy = strategy;
 }
 
 bool BufferedEditor::isModified() const
 {
-	return m_modificationCount != 0;
+	return m_backend->isModified();
 }
 
 bool BufferedEditor::canUndo() const
 {
-	return m_currentModificationIndex > 0;
+	// The saved contents have to stay reachable while they're being saved
+	return m_backend->canUndo() && (!isSaving() || m_saveDepth > 0);
 }
 
 bool BufferedEditor::canRedo() const
 {
-	return m_currentModificationIndex < m_modifications.size();
+	return m_backend->canRedo();
 }
 
-void BufferedEditor::undo()
+bool BufferedEditor::undo()
 {
+	Q_ASSERT(m_transactionDepth == 0);
 	if (!canUndo())
-		return;
+		return false;
 
-	undoModification(m_modifications[m_currentModificationIndex - 1]);
+	qint64 oldSize = size();
+	m_errorString.clear();
+	if (!m_backend->undo()) {
+		m_errorString = "Failed to read the bytes the edit is undone in";
+		return false;
+	}
+	++m_version;
+	if (isSaving()) {
+		--m_saveDepth;
+		if (m_saveRedoDepth != -1)
+			++m_saveRedoDepth;
+	}
 
-	--m_modificationCount;
-	--m_currentModificationIndex;
+	// The journal can't undo what it doesn't have, so it starts over
+	if (m_journalUndoDepth == 0) {
+		if ((m_journal || m_journalPending) && !compactJournal())
+			failJournal();
+	} else {
+		--m_journalUndoDepth;
+		++m_journalRedoDepth;
+		appendToJournal(EditJournal::Record(EditJournal::Operation::Undo));
+	}
+
+	if (size() != oldSize)
+		emit sizeChanged(size());
 
 	emit canRedoChanged(true);
 
 	if (!canUndo())
 		emit canUndoChanged(false);
+	return true;
 }
 
-void BufferedEditor::redo()
+bool BufferedEditor::redo()
 {
+	Q_ASSERT(m_transactionDepth == 0);
 	if (!canRedo())
-		return;
+		return false;
 
-	doModification(m_modifications[m_currentModificationIndex]);
+	qint64 oldSize = size();
+	m_errorString.clear();
+	if (!m_backend->redo()) {
+		m_errorString = "Failed to read the bytes the edit is redone in";
+		return false;
+	}
+	++m_version;
+	if (isSaving()) {
+		++m_saveDepth;
+		m_saveRedoDepth = m_saveRedoDepth > 0 ? m_saveRedoDepth - 1 : -1;
+	}
 
-	++m_modificationCount;
-	++m_currentModificationIndex;
+	if (m_journalRedoDepth == 0) {
+		if ((m_journal || m_journalPending) && !compactJournal())
+			failJournal();
+	} else {
+		--m_journalRedoDepth;
+		++m_journalUndoDepth;
+		appendToJournal(EditJournal::Record(EditJournal::Operation::Redo));
+	}
+
+	if (size() != oldSize)
+		emit sizeChanged(size());
 
 	emit canUndoChanged(true);
 
 	if (!canRedo())
 		emit canRedoChanged(false);
+	return true;
 }
 
+void BufferedEditor::beginTransaction()
+{
+	if (m_transactionDepth++ > 0)
+		return;
 
-int BufferedEditor::getSectionIndex(qint64 position)
+	m_transactionModified = false;
+	m_transactionCouldRedo = canRedo();
+	m_transactionOldSize = size();
+	m_backend->beginTransaction();
+	appendToJournal(EditJournal::Record(EditJournal::Operation::BeginTransaction));
+}
+
+void BufferedEditor::endTransaction()
 {
-	// The index of the section
-	int index = -1;
-	// The index of the next/previous section if such is loaded and the section was not found
-	int nextIndex = -1, prevIndex = -1;
+	Q_ASSERT(m_transactionDepth > 0);
+	if (--m_transactionDepth > 0)
+		return;
 
-	// Find the needed section
-	// TODO: Maybe use binary search or at least optimize for sequential access
-	for (int i = 0; i < m_sections.size(); ++i) {
-		const Section &section = m_sections[i];
-		if (section.currentPosition > position) {
-			nextIndex = i;
-			break;
-		}
-		if (position >= section.currentPosition &&
-				position < section.currentPosition + section.currentLength()) {
-			index = i;
-			break;
-		}
-		prevIndex = i;
-	}
+	m_backend->endTransaction();
+	appendToJournal(EditJournal::Record(EditJournal::Operation::EndTransaction));
+	if (m_transactionModified)
+		onModification(m_transactionCouldRedo, m_transactionOldSize);
+	if (m_journalStale && !compactJournal())
+		failJournal();
 
-	if (index == -1) {
-		// Section is not loaded in memory
-		qDebug() << "BufferedEditor: Loading section for byte" << position;
-
-		// The location of `position` in the actual, unedited file
-		qint64 realPosition = position;
-		qint64 prevSectionSavedEnd = 0;
-		if (prevIndex != -1) {
-			prevSectionSavedEnd = m_sections[prevIndex].savedPosition + m_sections[prevIndex].savedLength();
-			qint64 prevSectionCurrentEnd = m_sections[prevIndex].currentPosition + m_sections[prevIndex].currentLength();
-			realPosition = prevSectionSavedEnd + position - prevSectionCurrentEnd;
-		}
+	// A save that finished during the transaction waited for its end
+	if (isSaving() && m_copier->isFinished())
+		finishSaving();
+}
 
-		// The maximum allowed 'end' of the section that is to be loaded
-		qint64 newSectionMaxEnd;
-		if (nextIndex != -1) {
-			// Don't overlap with the next section
-			newSectionMaxEnd = m_sections[nextIndex].savedPosition;
-		} else {
-			// Don't try to read after the end of the file
-			newSectionMaxEnd = m_device->size();
-		}
+qint64 BufferedEditor::historyLimit() const
+{
+	return m_historyLimit;
+}
 
-		// Calculate the new section start/end positions
-		qint64 newSectionStart = realPosition;
-		qint64 newSectionEnd = newSectionMaxEnd;
-		if (newSectionMaxEnd - realPosition < sectionSize)
-			newSectionStart = qMax(newSectionMaxEnd - sectionSize, prevSectionSavedEnd);
-		else
-			newSectionEnd = newSectionStart + sectionSize;
-		int newSectionLength = int(newSectionEnd - newSectionStart);
-
-		// Create the section object
-		Section section(newSectionStart, newSectionStart + position - realPosition);
-		section.data.resize(newSectionLength);
-
-		// Seek the file to the required position
-		if (!m_device->seek(newSectionStart)) {
-			qCritical() << "BufferedEditor: Failed to seek in file:" << m_device->errorString();
-			return -1;
-		}
+void BufferedEditor::setHistoryLimit(qint64 bytes)
+{
+	m_historyLimit = bytes;
+	if (!isSaving())
+		m_backend->setHistoryLimit(bytes);
+}
 
-		// Read the data from the file
-		QVector<char> buffer(newSectionLength);
-		qint64 bytesRead = m_device->read(buffer.data(), newSectionLength);
-		if (bytesRead == -1) {
-			qCritical() << "BufferedEditor: Failed to write to file:" << m_device->errorString();
-			return -1;
-		}
-		Q_ASSERT(bytesRead == newSectionLength);
-		for (int i = 0; i < newSectionLength; ++i) {
-			char b = buffer[i];
-			section.data[i] = Byte(b, b);
-		}
+qint64 BufferedEditor::memoryBudget() const
+{
+	return m_memoryBudget;
+}
 
-		// Add the new section to the list of loaded sections
-		index = nextIndex == -1 ? m_sections.size() : nextIndex;
-		m_sections.insert(index, std::move(section));
+void BufferedEditor::setMemoryBudget(qint64 bytes)
+{
+	m_memoryBudget = bytes;
+	m_backend->setMemoryBudget(bytes);
+}
 
-		// Update the undo events section indices
-		for (Modification &m : m_modifications)
-			if (m.sectionIndex >= index)
-				++m.sectionIndex;
-	}
+StoragePolicy BufferedEditor::storagePolicy() const
+{
+	return m_storagePolicy;
+}
 
-	return index;
+void BufferedEditor::setStoragePolicy(const StoragePolicy &policy)
+{
+	m_storagePolicy = policy;
+	m_backend->setStoragePolicy(policy);
 }
 
-void BufferedEditor::doModification(Modification &modification)
+Snapshot BufferedEditor::snapshot() const
 {
-	qint64 oldSize = m_size;
-	Section &section = m_sections[modification.sectionIndex];
+	return Snapshot(m_device->fileName(), m_backend->contents(), m_version, m_fileGeneration, m_spillFile.fileName());
+}
 
-	switch (modification.type) {
-	case Modification::Type::Replace:
-	{
-		Byte &byte = section.data[modification.byteIndex];
-		char oldByte = *byte.current;
-		byte.current = modification.byte;
-		modification.byte = oldByte;
-		break;
-	}
+quint64 BufferedEditor::version() const
+{
+	return m_version;
+}
 
-	case Modification::Type::Insert:
-	{
-		Byte byte(std::optional<char>(), modification.byte);
-		section.data.insert(modification.byteIndex, byte);
-		++m_size;
-		updateSectionsPosition(modification.sectionIndex + 1);
-		break;
-	}
+BufferedEditor::Statistics BufferedEditor::statistics() const
+{
+	Statistics statistics = m_backend->statistics();
+	statistics.bytesRead = m_ioCounters.bytesRead.loadRelaxed();
+	statistics.readCount = m_ioCounters.readCount.loadRelaxed();
+	statistics.bytesWritten = m_ioCounters.bytesWritten.loadRelaxed();
+	statistics.writeCount = m_ioCounters.writeCount.loadRelaxed();
+	return statistics;
+}
 
-	case Modification::Type::Delete:
-	{
-		auto &byte = section.data[modification.byteIndex].current;
-		modification.byte = *byte;
-		byte.reset();
-		--m_size;
-		updateSectionsPosition(modification.sectionIndex + 1);
-		break;
+bool BufferedEditor::isJournaling() const
+{
+	return m_journaling;
+}
+
+void BufferedEditor::setJournaling(bool enabled)
+{
+	if (enabled == m_journaling || m_device->fileName().isEmpty())
+		return;
+	m_journaling = enabled;
+	if (!enabled) {
+		dropJournal();
+		return;
 	}
+	if (!isModified() && !isSaving())
+		restartJournal(-1, 0, 0);
+}
+
+bool BufferedEditor::hasJournal() const
+{
+	return !m_device->fileName().isEmpty() && EditJournal::exists(m_device->fileName());
+}
+
+int BufferedEditor::restoreJournal()
+{
+	Q_ASSERT(!m_journal && m_transactionDepth == 0 && !isSaving());
+	std::unique_ptr<EditJournal> journal(new EditJournal(m_device->fileName()));
+	if (m_device->fileName().isEmpty() || !journal->open())
+		return -1;
+
+	// Nothing is written to the journal while it's replayed. The records
+	// from the first one that doesn't fit on are dropped
+	m_journalPending = false;
+	m_journalUndoDepth = 0;
+	m_journalRedoDepth = 0;
+	int count = 0;
+	qint64 end = journal->offset();
+	EditJournal::Record record;
+	while (journal->readRecord(record) && replayRecord(record)) {
+		++count;
+		end = journal->offset();
 	}
+	qDebug() << "BufferedEditor: Restored" << count << "records from the journal";
+	if (!journal->resume(end))
+		return -1;
+
+	m_journaling = true;
+	m_journal = std::move(journal);
+	m_journalTimer->start();
+	// A transaction cut short by the crash ends here
+	while (m_transactionDepth > 0)
+		endTransaction();
+	return count;
+}
+
+bool BufferedEditor::savesToNewFile()
+{
+	if (m_saveStrategy == SaveStrategy::InPlace || !isReplaceable())
+		return false;
+	if (m_saveStrategy == SaveStrategy::NewFile)
+		return true;
 
-	if (m_size != oldSize)
-		emit sizeChanged(m_size);
+	// Copying the whole file is worth it when most of it moves anyway
+	qint64 volume = m_backend->shiftVolume();
+	return volume >= newFileSaveThreshold && volume * 2 >= size();
+}
 
-	++section.modificationCount;
-	++m_modificationCount;
+// Only a plain regular file with a single name stays what it was when a new
+// file is renamed over it. Symbolic links are followed
+bool BufferedEditor::isReplaceable() const
+{
+	// A temporary file keeps the replaced file open when it's reopened
+	QString fileName = m_device->fileName();
+	if (fileName.isEmpty() || m_device->inherits("QTemporaryFile") || !QFileInfo(fileName).isFile())
+		return false;
+#ifdef Q_OS_UNIX
+	struct stat status;
+	if (::stat(QFile::encodeName(fileName).constData(), &status) != 0 || status.st_nlink > 1)
+		return false;
+#endif
+	return true;
 }
 
-void BufferedEditor::undoModification(Modification &modification)
+// Writes the contents to a new file in the same directory and renames it
+// over the old one, so a failure at any point leaves the old file intact
+bool BufferedEditor::writeNewFile()
 {
-	qint64 oldSize = m_size;
-	Section &section = m_sections[modification.sectionIndex];
+	FileCopier copier(snapshot(), &m_ioCounters);
+	if (!copier.copy()) {
+		m_errorString = copier.errorString();
+		return false;
+	}
+	return replaceFile(copier);
+}
 
-	switch (modification.type) {
-	case Modification::Type::Replace:
-	{
-		Byte &byte = section.data[modification.byteIndex];
-		char oldByte = *byte.current;
-		byte.current = modification.byte;
-		modification.byte = oldByte;
-		break;
+bool BufferedEditor::replaceFile(FileCopier &copier)
+{
+	m_fileGeneration->fetchAndAddOrdered(1);
+	if (!m_backend->releaseFile())
+		return false;
+	if (!copier.commit()) {
+		m_errorString = copier.errorString();
+		return false;
 	}
 
-	case Modification::Type::Insert:
-	{
-		Q_ASSERT(!section.data[modification.byteIndex].saved);
-		section.data.removeAt(modification.byteIndex);
-		--m_size;
-		updateSectionsPosition(modification.sectionIndex + 1);
-		break;
+	QString fileName = m_device->fileName();
+#ifdef Q_OS_UNIX
+	// The rename is only durable once the directory is synced too
+	int directory = ::open(QFile::encodeName(QFileInfo(fileName).absolutePath()).constData(), O_RDONLY);
+	if (directory != -1) {
+		fsync(directory);
+		::close(directory);
 	}
+#endif
 
-	case Modification::Type::Delete:
-	{
-		std::optional<char> &byte = section.data[modification.byteIndex].current;
-		Q_ASSERT(!byte);
-		byte = modification.byte;
-		++m_size;
-		updateSectionsPosition(modification.sectionIndex + 1);
-		break;
+	QIODevice::OpenMode mode = m_device->openMode() & ~QIODevice::Truncate;
+	m_device->close();
+	if (!m_device->open(mode)) {
+		qCritical() << "BufferedEditor: Failed to reopen file" << fileName << ":" << m_device->errorString();
+		return false;
 	}
+
+	m_backend->setSaved();
+	return true;
+}
+
+bool BufferedEditor::finishSaving()
+{
+	bool success = m_copier->succeeded();
+	if (success) {
+		// The edits made in the meantime are taken off while the file is
+		// replaced and then put back on top of it
+		qint64 position = m_backend->position();
+		int undone = 0;
+		while (undone < m_saveDepth && m_backend->undo())
+			++undone;
+		if (undone < m_saveDepth) {
+			m_errorString = "Failed to read the bytes of the edits made while saving";
+			success = false;
+		} else {
+			success = replaceFile(*m_copier);
+		}
+		for (int i = 0; i < undone; ++i)
+			m_backend->redo();
+		m_backend->seek(position);
+
+		// The edits made in the meantime stay in the journal, on top of
+		// the saved file now. It's compacted if they redo older edits
+		if (success && m_journaling) {
+			if (m_journal && m_saveRedoDepth != -1)
+				restartJournal(m_saveJournalOffset, m_saveDepth, m_saveRedoDepth);
+			else if (m_saveDepth == 0)
+				restartJournal(-1, 0, 0);
+			else if (!compactJournal())
+				failJournal();
+		}
+	} else {
+		m_errorString = m_copier->errorString();
 	}
 
-	--m_modificationCount;
-	if (m_size != oldSize)
-		emit sizeChanged(m_size);
+	stopSaving();
+	emit saveFinished(success);
+	return success;
 }
 
-void BufferedEditor::userDoModification(Modification m)
+void BufferedEditor::stopSaving()
 {
-	bool couldRedo = canRedo();
-	if (couldRedo) {
-		m_modifications.remove(m_currentModificationIndex, m_modifications.size() - m_currentModificationIndex);
-		Q_ASSERT(!canRedo());
+	bool couldUndo = canUndo();
+	m_saveTimer->stop();
+	m_copier.reset();
+	m_backend->setHistoryLimit(m_historyLimit);
+	if (canUndo() != couldUndo)
+		emit canUndoChanged(canUndo());
+}
+
+void BufferedEditor::onModification(bool couldRedo, qint64 oldSize)
+{
+	++m_version;
+
+	// The signals wait for the end of the transaction
+	if (m_transactionDepth > 0) {
+		m_transactionModified = true;
+		return;
 	}
 
-	doModification(m);
-	m_modifications.append(m);
-	m_currentModificationIndex = m_modifications.size();
+	if (isSaving()) {
+		++m_saveDepth;
+		if (m_saveRedoDepth != -1)
+			m_saveRedoDepth = 0;
+	}
+	++m_journalUndoDepth;
+	m_journalRedoDepth = 0;
+
+	if (size() != oldSize)
+		emit sizeChanged(size());
 
 	Q_ASSERT(canUndo());
 	emit canUndoChanged(true);
@@ -503,28 +783,281 @@ void BufferedEditor::userDoModification(Modification m)
 		emit canRedoChanged(false);
 }
 
-void BufferedEditor::updateSectionsPosition(int firstSectionIndex)
+// A record that can't be appended leaves the journal behind the edits, so
+// it starts over from the contents as they are
+void BufferedEditor::appendToJournal(const EditJournal::Record &record)
 {
-	qint64 savedPosition;
-	qint64 currentPosition;
-	if (firstSectionIndex > 0) {
-		Section &s = m_sections[firstSectionIndex - 1];
-		savedPosition = s.savedPosition;
-		currentPosition = s.currentPosition;
-		savedPosition += s.savedLength();
-		currentPosition += s.currentLength();
-	} else {
-		savedPosition = 0;
-		currentPosition = 0;
+	// An empty journal is only written with its first record
+	if (m_journalPending) {
+		m_journalPending = false;
+		m_device->flush();
+		m_journal.reset(new EditJournal(m_device->fileName()));
+		if (!m_journal->start()) {
+			failJournal();
+			return;
+		}
+		if (isSaving())
+			m_saveJournalOffset = m_journal->offset();
+		m_journalTimer->start();
 	}
+	if (m_journal && !m_journalStale && !m_journal->append(record) && !compactJournal())
+		failJournal();
+}
+
+bool BufferedEditor::replayRecord(const EditJournal::Record &record)
+{
+	typedef EditJournal::Operation Operation;
+	if (record.position < 0 || record.length < 0)
+		return false;
+	bool inserting = record.operation == Operation::InsertBytes || record.operation == Operation::InsertPattern;
+	if (record.position > size() || (!inserting && record.length > 0 && record.position == size()))
+		return false;
 
-	for (int i = firstSectionIndex; i < m_sections.size(); ++i) {
-		Section &s = m_sections[i];
-		qint64 offset = s.savedPosition - savedPosition;
-		savedPosition += offset;
-		currentPosition += offset;
-		s.currentPosition = currentPosition;
-		savedPosition += s.savedLength();
-		currentPosition += s.currentLength();
+	switch (record.operation) {
+	case Operation::InsertBytes:
+		insertBytes(record.position, record.bytes);
+		break;
+	case Operation::InsertPattern:
+		if (record.bytes.isEmpty())
+			return false;
+		insertPattern(record.position, record.length, record.bytes);
+		break;
+	case Operation::DeleteRange:
+		deleteRange(record.position, record.length);
+		break;
+	case Operation::ReplaceRange:
+		replaceRange(record.position, record.bytes);
+		break;
+	case Operation::FillRange:
+		if (record.bytes.size() != 1)
+			return false;
+		fillRange(record.position, record.length, record.bytes[0]);
+		break;
+	case Operation::Undo:
+		if (m_transactionDepth > 0 || !undo())
+			return false;
+		break;
+	case Operation::Redo:
+		if (m_transactionDepth > 0 || !redo())
+			return false;
+		break;
+	case Operation::BeginTransaction:
+		beginTransaction();
+		break;
+	case Operation::EndTransaction:
+		if (m_transactionDepth == 0)
+			return false;
+		endTransaction();
+		break;
+	}
+	return true;
+}
+
+// Starts the journal over from the saved file, keeping the records from
+// `keepFrom` on, which the undo and redo depths are counted over. Without
+// any records, the journal waits for the next one
+void BufferedEditor::restartJournal(qint64 keepFrom, int undoDepth, int redoDepth)
+{
+	// A transaction would be cut in two
+	if (m_transactionDepth > 0) {
+		m_journalStale = true;
+		return;
+	}
+	if (keepFrom == -1) {
+		dropJournal();
+		// Including one that was left behind
+		QFile::remove(EditJournal::journalFileName(m_device->fileName()));
+		m_journalPending = true;
+		m_journalUndoDepth = undoDepth;
+		m_journalRedoDepth = redoDepth;
+		return;
 	}
+	// The journal is tied to the file as it is on the disk
+	m_device->flush();
+	if (!m_journal)
+		m_journal.reset(new EditJournal(m_device->fileName()));
+	if (!m_journal->start(keepFrom)) {
+		failJournal();
+		return;
+	}
+	m_journalUndoDepth = undoDepth;
+	m_journalRedoDepth = redoDepth;
+	m_journalTimer->start();
+}
+
+// Starts the journal over with the edits that lead from the saved file to
+// the contents as they are now, made in one transaction. Replaying it takes
+// time proportional to how much the contents differ from the file, not to
+// how many edits, undos and redos it took to get there. The old journal
+// stays in place until the new one is complete
+bool BufferedEditor::compactJournal()
+{
+	// A transaction would be cut in two
+	if (m_transactionDepth > 0) {
+		m_journalStale = true;
+		return true;
+	}
+	m_device->flush();
+	if (!m_journal)
+		m_journal.reset(new EditJournal(m_device->fileName()));
+	if (!m_journal->rewrite())
+		return false;
+	if (!writeCompactedJournal()) {
+		m_journal->abort();
+		return false;
+	}
+	if (!m_journal->commit())
+		return false;
+
+	// None of the edits can be undone or redone from the journal
+	m_journalUndoDepth = 0;
+	m_journalRedoDepth = 0;
+	m_journalStale = false;
+	m_journalPending = false;
+	// and the ones made since a save started can't be told apart anymore
+	if (isSaving())
+		m_saveRedoDepth = -1;
+	m_journalTimer->start();
+	return true;
+}
+
+bool BufferedEditor::writeCompactedJournal()
+{
+	typedef EditJournal::Operation Operation;
+	typedef EditJournal::Record Record;
+	typedef Snapshot::Part Part;
+
+	bool empty = true;
+	auto append = [&](const Record &record) {
+		if (empty && !m_journal->append(Record(Operation::BeginTransaction)))
+			return false;
+		empty = false;
+		return m_journal->append(record);
+	};
+
+	// The parts held in memory are inserted together, in chunks
+	Snapshot contents = snapshot();
+	qint64 bytesPosition = 0;
+	qint64 bytesLength = 0;
+	auto insertBytes = [&]() {
+		for (qint64 offset = 0; offset < bytesLength;) {
+			QByteArray bytes = contents.read(bytesPosition + offset, qMin(bytesLength - offset, qint64(journalChunkSize)));
+			if (bytes.isEmpty() || !append(Record(Operation::InsertBytes, bytesPosition + offset, bytes.size(), bytes)))
+				return false;
+			offset += bytes.size();
+		}
+		bytesLength = 0;
+		return true;
+	};
+
+	// The saved file from `savedPosition` on follows the contents up to `position`
+	qint64 position = 0;
+	qint64 savedPosition = 0;
+	for (const Part &part : contents.parts()) {
+		bool inPlace = part.source == Part::Source::File && part.offset >= savedPosition;
+		bool pattern = part.source == Part::Source::Pattern && part.patternSize <= journalChunkSize &&
+				part.length > part.patternSize;
+		if (!inPlace && !pattern) {
+			if (bytesLength == 0)
+				bytesPosition = position;
+			bytesLength += part.length;
+			position += part.length;
+			continue;
+		}
+
+		if (!insertBytes())
+			return false;
+		if (inPlace) {
+			if (part.offset > savedPosition && !append(Record(Operation::DeleteRange, position, part.offset - savedPosition)))
+				return false;
+			savedPosition = part.offset + part.length;
+		} else {
+			QByteArray bytes = contents.read(position, part.patternSize);
+			if (bytes.size() != part.patternSize || !append(Record(Operation::InsertPattern, position, part.length, bytes)))
+				return false;
+		}
+		position += part.length;
+	}
+	if (!insertBytes())
+		return false;
+	if (savedPosition < m_device->size() &&
+			!append(Record(Operation::DeleteRange, position, m_device->size() - savedPosition)))
+		return false;
+	return empty || m_journal->append(Record(Operation::EndTransaction));
+}
+
+// Ends the journal when it isn't needed
+void BufferedEditor::dropJournal()
+{
+	m_journalStale = false;
+	m_journalPending = false;
+	if (!m_journal)
+		return;
+	m_journal->remove();
+	m_journal.reset();
+	m_journalTimer->stop();
+}
+
+// Ends the journal when it can't follow the edits anymore
+void BufferedEditor::failJournal()
+{
+	bool hadJournal = m_journal != nullptr;
+	dropJournal();
+	if (!hadJournal)
+		return;
+	qWarning() << "BufferedEditor: The journal can't make the edits again, it starts over once the file is saved";
+	emit journalFailed();
+}
+
+// Compacts the journal when replaying it would mostly make edits that were
+// undone or made over again
+void BufferedEditor::checkpointJournal()
+{
+	if (!m_journal || m_journalStale)
+		return;
+
+	if (m_transactionDepth == 0 && !isSaving() && m_journal->offset() > journalCompactionThreshold) {
+		// Every part that isn't left in place takes a record
+		qint64 compactedSize = 0;
+		for (const Snapshot::Part &part : m_backend->contents()) {
+			compactedSize += journalRecordSize;
+			if (part.source == Snapshot::Part::Source::Pattern)
+				compactedSize += qMin(part.length, qint64(part.patternSize));
+			else if (part.source != Snapshot::Part::Source::File)
+				compactedSize += part.length;
+		}
+		// A compacted journal is durable already
+		if (m_journal->offset() > 2 * compactedSize && compactJournal())
+			return;
+	}
+
+	if (!m_journal->checkpoint())
+		failJournal();
+}
+
+void BufferedEditor::checkPendingLoads()
+{
+	for (int i = 0; i < m_pendingLoads.size();) {
+		QPair<qint64, qint64> range = m_pendingLoads[i];
+		if (!isLoaded(range.first, range.second)) {
+			// Ask again, in case an edit or a save dropped what was read
+			m_backend->load(range.first, range.second);
+			++i;
+			continue;
+		}
+		m_pendingLoads.remove(i);
+		emit loaded(range.first, range.second);
+	}
+
+	if (m_pendingLoads.isEmpty())
+		m_loadTimer->stop();
+}
+
+void BufferedEditor::checkSaving()
+{
+	emit saveProgress(m_copier->bytesWritten(), m_copier->totalLength());
+	// The edits of an open transaction can't be undone to get back to
+	// the saved contents, so the save is finished when it ends
+	if (m_copier->isFinished() && m_transactionDepth == 0)
+		finishSaving();
 }
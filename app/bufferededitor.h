@@ -1,13 +1,25 @@
 #ifndef BUFFEREDEDITOR_H
 #define BUFFEREDEDITOR_H
 
+#include "editjournal.h"
+#include "iocounters.h"
+#include "snapshot.h"
+#include "spillfile.h"
+#include "storagepolicy.h"
+
 #include <QObject>
 #include <QVector>
+#include <QByteArray>
+#include <QPair>
 
 #include <variant>
 #include <optional>
+#include <memory>
 
 class QFileDevice;
+class QTimer;
+class EditorBackend;
+class FileCopier;
 
 class BufferedEditor : public QObject
 {
@@ -29,7 +41,107 @@ public:
 			: saved(saved), current(current) {}
 	};
 
+	// A run of consecutive bytes that are either all modified or all
+	// unmodified. The span keeps the memory holding the bytes alive,
+	// except for the bytes served from the mapped file, which are only
+	// valid until the file is saved. A snapshot has no such limit
+	struct Span
+	{
+		QByteArray block;
+		int offset;
+		int length;
+		bool modified;
+		// The bytes repeat every `patternSize` bytes, 0 if they don't
+		int patternSize;
+
+		const char *data() const
+		{
+			return block.constData() + offset;
+		}
+
+		Span() : offset(0), length(0), modified(false), patternSize(0) {}
+	};
+
+	// A read position of its own over the editor. Reading through a cursor
+	// leaves the editor's position and every other cursor alone, and a
+	// cursor remembers where it is in the backend, so reading on from
+	// there doesn't have to look the position up again. Cursors are only
+	// used on the editor's thread, a snapshot is read on the others
+	class Cursor
+	{
+	public:
+		// Where a cursor is in the backend. `layout` tells whether `index`
+		// and `offset` still point there or have to be looked up again
+		struct State
+		{
+			qint64 position;
+			qint64 index;
+			qint64 offset;
+			quint64 layout;
+
+			State() : position(0), index(-1), offset(0), layout(0) {}
+		};
+
+		Cursor();
+		explicit Cursor(BufferedEditor *editor, qint64 position = 0);
+		BufferedEditor *editor() const;
+		void seek(qint64 position);
+		qint64 position() const;
+		bool atEnd() const;
+		Byte getByte();
+		Span readSpan(qint64 maxLength);
+		qint64 read(char *data, qint64 maxLength);
+		QByteArray read(qint64 maxLength);
+
+	private:
+		BufferedEditor *m_editor;
+		State m_state;
+	};
+
+	// What the editor holds in memory and how much it has read and
+	// written. Cheap to take, so it can be polled
+	struct Statistics
+	{
+		// The loaded parts of the file and the bytes held for them
+		qint64 residentSections;
+		qint64 residentBytes;
+		qint64 bytesRead;
+		qint64 readCount;
+		qint64 bytesWritten;
+		qint64 writeCount;
+		qint64 undoEntries;
+		qint64 undoMemory;
+
+		Statistics()
+			: residentSections(0), residentBytes(0), bytesRead(0), readCount(0)
+			, bytesWritten(0), writeCount(0), undoEntries(0), undoMemory(0) {}
+	};
+
+	enum class Backend
+	{
+		Sections, PieceTable
+	};
+
+	// In place, the changed parts of the file are written over it. The
+	// new file is written in one pass next to the old one and replaces it,
+	// so the old file stays intact until then. Automatic uses a new file
+	// when much of the file would have to be moved around otherwise.
+	// Devices and files with other hard links would lose what they are
+	// when replaced, so they're always saved in place and NewFile fails
+	enum class SaveStrategy
+	{
+		Automatic, InPlace, NewFile
+	};
+
+	static const qint64 defaultMemoryBudget = 256 * 1024 * 1024;
+	static const qint64 defaultHistoryLimit = 64 * 1024 * 1024;
+	// Saving moves fewer bytes than this in place
+	static const qint64 newFileSaveThreshold = 64 * 1024 * 1024;
+
 	BufferedEditor(QFileDevice *device, QObject *parent = nullptr);
+	BufferedEditor(QFileDevice *device, Backend backend, QObject *parent = nullptr);
+	~BufferedEditor() override;
+	Backend backend() const;
 	QString errorString() const;
 	bool seek(qint64 position);
 	qint64 position() const;
@@ -38,109 +150,184 @@ public:
 	bool atEnd() const;
 	void moveForward();
 	Byte getByte();
+	// Read up to `maxLength` bytes starting at the current position
+	// and move past them. A span is empty only at the end of the file
+	// or if the data couldn't be read
+	Span readSpan(qint64 maxLength);
+	qint64 read(char *data, qint64 maxLength);
+	QByteArray read(qint64 maxLength);
+	// Whether the bytes in the range can be read without waiting for the
+	// disk. If they can't, load() reads them in the background and
+	// loaded() is emitted once they can
+	bool isLoaded(qint64 position, qint64 length);
+	void load(qint64 position, qint64 length);
 	void replaceByte(char byte);
 	void insertByte(char byte);
 	void deleteByte();
+	// Each of these is a single edit, undone in one step. The position
+	// stays the same, so it ends up at the start of the range
+	void insertBytes(qint64 position, const QByteArray &bytes);
+	void insertBytes(qint64 position, qint64 count, char value);
+	// Inserts `length` bytes that repeat `pattern`. Long runs aren't
+	// stored anywhere until they are written to the file
+	void insertPattern(qint64 position, qint64 length, const QByteArray &pattern);
+	void deleteRange(qint64 position, qint64 length);
+	void replaceRange(qint64 position, const QByteArray &bytes);
+	void fillRange(qint64 position, qint64 length, char value);
 	bool writeChanges();
+	// Saves the contents as they are now on a worker thread, when the
+	// save strategy calls for a new file that replaces the old one once
+	// it's complete. Editing goes on in the meantime, the edits stay on
+	// top of the saved contents but can't be undone past them. Returns
+	// false when the file is saved in place, writeChanges() does that
+	bool startSaving();
+	bool isSaving() const;
+	// Stops saving and leaves the file as it was
+	void cancelSaving();
+	// Blocks until the save in progress is done
+	bool waitForSaving();
+	SaveStrategy saveStrategy() const;
+	void setSaveStrategy(SaveStrategy strategy);
 	bool isModified() const;
 	bool canUndo() const;
 	bool canRedo() const;
-	void undo();
-	void redo();
+	// Return false if there's nothing to undo or redo, or if the bytes the
+	// edit is in couldn't be read, errorString() tells why then
+	bool undo();
+	bool redo();
+	// The edits made until the matching endTransaction() are a single undo
+	// step. Neighbouring edits of the same kind are merged into one record,
+	// and the signals are only emitted at the end. Transactions can nest
+	void beginTransaction();
+	void endTransaction();
+	// An approximate limit for the memory used by the undo history.
+	// The oldest edits are forgotten to stay below it
+	qint64 historyLimit() const;
+	void setHistoryLimit(qint64 bytes);
+	// An approximate limit for the memory used by the unmodified parts of
+	// the file that are kept loaded. Modified parts are never unloaded
+	qint64 memoryBudget() const;
+	void setMemoryBudget(qint64 bytes);
+	// How much of the file is read at once. By default the sections adapt
+	// to how the file is read and are aligned to the file system's blocks
+	StoragePolicy storagePolicy() const;
+	void setStoragePolicy(const StoragePolicy &policy);
+	// The contents as they are now. Later edits don't change the snapshot
+	Snapshot snapshot() const;
+	// Changes with every edit, undo and redo
+	quint64 version() const;
+	// The reads and writes include the ones made in the background
+	Statistics statistics() const;
+	// Writes the edits to a journal next to the file as they are made, so
+	// that the unsaved ones can be restored after a crash. The journal
+	// starts from the saved file, so with unsaved edits it only starts
+	// once they're saved, and it's only written with the first edit after
+	// that. Turning it off removes the journal
+	bool isJournaling() const;
+	void setJournaling(bool enabled);
+	// Whether a journal of unsaved edits was left behind for the file
+	bool hasJournal() const;
+	// Makes the edits of the journal left behind again and goes on writing
+	// to it. Takes time proportional to the number of the edits, not to the
+	// size of the file. The journal is compacted to the changes made to the
+	// file when it's mostly edits that were undone or made over again.
+	// Returns how many records were replayed, or -1
+	int restoreJournal();
 
 signals:
 	void canUndoChanged(bool canUndo);
 	void canRedoChanged(bool canRedo);
 	void sizeChanged(qint64 size);
+	void loaded(qint64 position, qint64 length);
+	void saveProgress(qint64 bytesWritten, qint64 totalBytes);
+	void saveFinished(bool success);
+	// The journal couldn't be written, the edits can't be restored after a
+	// crash until the file is saved
+	void journalFailed();
 
 private:
-	static const int sectionSize = 16 * 1024;
-
-	struct Section
-	{
-		qint64 savedPosition;
-		qint64 currentPosition;
-		QVector<Byte> data;
-		int modificationCount;
-
-		bool isModified() const
-		{
-			return modificationCount != 0;
-		}
-
-		int savedLength() const
-		{
-			int l = 0;
-			for (Byte b : data)
-				l += b.saved.has_value();
-			return l;
-		}
-
-		int currentLength() const
-		{
-			int l = 0;
-			for (Byte b : data)
-				l += b.current.has_value();
-			return l;
-		}
-
-		int bytePosition(qint64 position) const
-		{
-			qint64 p = currentPosition;
-			int i = 0;
-			if (p > position)
-				return -1;
-			for (Byte b : data) {
-				if (p == position && b.current.has_value())
-					break;
-				p += b.current.has_value();
-				++i;
-			}
-			if (i == data.size())
-				return -1;
-			return i;
-		}
-
-		Section() : savedPosition(-1), currentPosition(-1), modificationCount(0) {}
-		Section(qint64 savedPosition, qint64 currentPosition)
-			: savedPosition(savedPosition), currentPosition(currentPosition), modificationCount(0) {}
-	};
-
-	struct Modification
-	{
-		enum class Type
-		{
-			Replace, Insert, Delete
-		};
-
-		Type type;
-		char byte;
-		int sectionIndex, byteIndex;
-
-		Modification(Type type, char byte, int sectionIndex, int byteIndex)
-			: type(type)
-			, byte(byte)
-			, sectionIndex(sectionIndex)
-			, byteIndex(byteIndex)
-		{
-		}
-	};
+	// How often the background loads are checked for, in milliseconds
+	static const int loadCheckInterval = 10;
+	// Older requests are dropped, whoever made them has moved on by then
+	static const int maximumPendingLoads = 16;
+	// How often a save in the background is checked on, in milliseconds
+	static const int saveCheckInterval = 50;
+	// How often the journal is made durable, in milliseconds
+	static const int journalCheckpointInterval = 2000;
+	// A checkpoint compacts the journal once it's larger than this and
+	// than twice what it would take compacted
+	static const qint64 journalCompactionThreshold = 1024 * 1024;
+	// The most bytes put in one record of a compacted journal
+	static const int journalChunkSize = 1024 * 1024;
+	// About what a record takes in the journal besides its bytes
+	static const int journalRecordSize = 32;
 
 	QFileDevice *m_device;
-	QVector<Section> m_sections;
-	int m_sectionIndex;
-	int m_sectionLocalPosition;
-	qint64 m_position;
-	qint64 m_size;
-	QVector<Modification> m_modifications;
-	int m_currentModificationIndex;
-	int m_modificationCount;
-
-	int getSectionIndex(qint64 position);
-	void doModification(Modification &modification);
-	void undoModification(Modification &modification);
-	void userDoModification(Modification m);
-	void updateSectionsPosition(int firstSectionIndex);
+	Backend m_backendType;
+	SaveStrategy m_saveStrategy;
+	qint64 m_memoryBudget;
+	qint64 m_historyLimit;
+	StoragePolicy m_storagePolicy;
+	// Shared with the backend and the workers, so it outlives them
+	IoCounters m_ioCounters;
+	// Where the backend keeps the bytes that the history refers to once
+	// the file is written over
+	SpillFile m_spillFile;
+	std::unique_ptr<EditorBackend> m_backend;
+	// The state before the outermost transaction, for emitting the signals
+	int m_transactionDepth;
+	bool m_transactionModified;
+	bool m_transactionCouldRedo;
+	qint64 m_transactionOldSize;
+	// The loads are done on another thread and checked for periodically
+	QTimer *m_loadTimer;
+	QVector<QPair<qint64, qint64>> m_pendingLoads;
+	// The save in the background, and how many undo steps the edits made
+	// since it started take
+	std::unique_ptr<FileCopier> m_copier;
+	QTimer *m_saveTimer;
+	int m_saveDepth;
+	// Where the edits made since the save started begin in the journal, and
+	// how many undone steps they can redo, or -1 if they redo older ones
+	qint64 m_saveJournalOffset;
+	int m_saveRedoDepth;
+	QString m_errorString;
+	quint64 m_version;
+	// Counts the writes over the file, which the snapshots can't read past
+	std::shared_ptr<QAtomicInteger<quint64>> m_fileGeneration;
+	bool m_journaling;
+	std::unique_ptr<EditJournal> m_journal;
+	QTimer *m_journalTimer;
+	// How many of the undo and redo steps the journal can make again.
+	// Undoing past the start of the journal compacts it
+	int m_journalUndoDepth;
+	int m_journalRedoDepth;
+	// The journal is compacted at the end of the transaction, and nothing
+	// is appended to it until then
+	bool m_journalStale;
+	// The journal is empty, so it's only written with the first record.
+	// Files that are only looked at don't get one
+	bool m_journalPending;
+
+	template<typename Result, typename Operation>
+	Result readAt(Cursor::State &state, Operation operation);
+	bool savesToNewFile();
+	bool isReplaceable() const;
+	bool writeNewFile();
+	bool replaceFile(FileCopier &copier);
+	bool finishSaving();
+	void stopSaving();
+	void onModification(bool couldRedo, qint64 oldSize);
+	void appendToJournal(const EditJournal::Record &record);
+	bool replayRecord(const EditJournal::Record &record);
+	void restartJournal(qint64 keepFrom, int undoDepth, int redoDepth);
+	bool compactJournal();
+	bool writeCompactedJournal();
+	void dropJournal();
+	void failJournal();
+	void checkpointJournal();
+	void checkPendingLoads();
+	void checkSaving();
 };
 
 #endif // BUFFEREDEDITOR_H
@@ -0,0 +1,235 @@
+#include "editjournal.h"
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+const char EditJournal::magic[8] = {'h', 'e', 'x', 'e', 'd', 'j', 'n', 'l'};
+
+template<typename T>
+static void appendValue(QByteArray &data, T value)
+{
+	value = qToLittleEndian(value);
+	data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+QString EditJournal::journalFileName(const QString &fileName)
+{
+	QFileInfo info(fileName);
+	return info.absolutePath() + "/." + info.fileName() + ".hexed-journal";
+}
+
+bool EditJournal::exists(const QString &fileName)
+{
+	QFile file(journalFileName(fileName));
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	return file.size() > headerSize && file.read(headerSize) == header(fileName);
+}
+
+EditJournal::EditJournal(const QString &fileName)
+	: m_fileName(fileName)
+	, m_file(journalFileName(fileName))
+	, m_offset(0)
+	, m_dirty(false)
+{
+}
+
+EditJournal::~EditJournal()
+{
+	checkpoint();
+}
+
+bool EditJournal::open()
+{
+	if (!m_file.open(QIODevice::ReadWrite))
+		return false;
+	if (m_file.read(headerSize) != header(m_fileName)) {
+		m_file.close();
+		return false;
+	}
+	m_offset = headerSize;
+	return true;
+}
+
+bool EditJournal::readRecord(Record &record)
+{
+	QByteArray data = m_file.read(recordHeaderSize);
+	if (data.size() != recordHeaderSize)
+		return false;
+	const char *p = data.constData();
+	quint32 size = qFromLittleEndian<quint32>(p);
+	// A size that doesn't fit in the rest of the journal was torn
+	if (qint64(size) + 4 > m_file.size() - m_file.pos())
+		return false;
+	data.append(m_file.read(size));
+	quint32 sum = 0;
+	if (m_file.read(reinterpret_cast<char *>(&sum), 4) != 4 ||
+			qFromLittleEndian(sum) != checksum(data.constData(), data.size()))
+		return false;
+
+	p = data.constData();
+	record.operation = Operation(quint8(p[4]));
+	record.position = qFromLittleEndian<qint64>(p + 5);
+	record.length = qFromLittleEndian<qint64>(p + 13);
+	record.bytes = data.mid(recordHeaderSize);
+	if (record.operation > Operation::EndTransaction)
+		return false;
+	m_offset = m_file.pos();
+	return true;
+}
+
+bool EditJournal::resume(qint64 offset)
+{
+	if (!m_file.resize(offset) || !m_file.seek(offset)) {
+		qCritical() << "EditJournal: Failed to truncate journal:" << m_file.errorString();
+		return false;
+	}
+	m_offset = offset;
+	return true;
+}
+
+bool EditJournal::start(qint64 keepFrom)
+{
+	QByteArray kept;
+	if (keepFrom != -1) {
+		Q_ASSERT(m_file.isOpen() && keepFrom <= m_offset);
+		if (!m_file.flush() || !m_file.seek(keepFrom))
+			return false;
+		kept = m_file.read(m_offset - keepFrom);
+	}
+
+	if (!rewrite())
+		return false;
+	if (!write(kept)) {
+		abort();
+		return false;
+	}
+	return commit();
+}
+
+// Written next to the old journal and renamed over it, so that there is
+// a whole journal in place at all times
+bool EditJournal::rewrite()
+{
+	Q_ASSERT(!m_rewrite);
+	m_rewrite.reset(new QSaveFile(m_file.fileName()));
+	if (!m_rewrite->open(QIODevice::WriteOnly) || m_rewrite->write(header(m_fileName)) != headerSize) {
+		qCritical() << "EditJournal: Failed to write journal" << m_rewrite->fileName() << ":" << m_rewrite->errorString();
+		abort();
+		return false;
+	}
+	m_offset = headerSize;
+	return true;
+}
+
+bool EditJournal::commit()
+{
+	Q_ASSERT(m_rewrite);
+	std::unique_ptr<QSaveFile> file = std::move(m_rewrite);
+	// Closed while it's replaced, the old one is reopened if that fails
+	m_file.close();
+	bool committed = file->commit();
+	if (!committed)
+		qCritical() << "EditJournal: Failed to write journal" << file->fileName() << ":" << file->errorString();
+
+	if (!m_file.open(QIODevice::ReadWrite) || !m_file.seek(m_file.size())) {
+		qCritical() << "EditJournal: Failed to open journal" << m_file.fileName() << ":" << m_file.errorString();
+		return false;
+	}
+	m_offset = m_file.pos();
+	m_dirty = !committed;
+	return committed;
+}
+
+void EditJournal::abort()
+{
+	m_rewrite.reset();
+	m_offset = m_file.isOpen() ? m_file.pos() : 0;
+}
+
+bool EditJournal::append(const Record &record)
+{
+	Q_ASSERT(m_file.isOpen() || m_rewrite);
+	QByteArray data;
+	data.reserve(recordHeaderSize + record.bytes.size() + 4);
+	appendValue(data, quint32(record.bytes.size()));
+	data.append(char(record.operation));
+	appendValue(data, record.position);
+	appendValue(data, record.length);
+	data.append(record.bytes);
+	appendValue(data, checksum(data.constData(), data.size()));
+	return write(data);
+}
+
+qint64 EditJournal::offset() const
+{
+	return m_offset;
+}
+
+bool EditJournal::checkpoint()
+{
+	if (!m_dirty)
+		return true;
+	m_dirty = false;
+#ifdef Q_OS_UNIX
+	if (fsync(m_file.handle()) != 0) {
+		qCritical() << "EditJournal: Failed to sync journal" << m_file.fileName();
+		return false;
+	}
+#endif
+	return true;
+}
+
+void EditJournal::remove()
+{
+	m_rewrite.reset();
+	m_file.close();
+	m_dirty = false;
+	m_file.remove();
+}
+
+bool EditJournal::write(const QByteArray &data)
+{
+	QFileDevice *file = m_rewrite ? static_cast<QFileDevice *>(m_rewrite.get()) : &m_file;
+	// Flushed right away, so that only the system has to stay up. The
+	// rewritten journal is made durable when it's committed
+	if (file->write(data) != data.size() || !file->flush()) {
+		qCritical() << "EditJournal: Failed to write to journal" << file->fileName() << ":" << file->errorString();
+		return false;
+	}
+	m_offset += data.size();
+	if (!m_rewrite)
+		m_dirty = true;
+	return true;
+}
+
+// Identifies the file as it's saved now, so that a journal isn't
+// replayed on top of a file that changed since it was written
+QByteArray EditJournal::header(const QString &fileName)
+{
+	QFileInfo info(fileName);
+	QByteArray data(magic, sizeof(magic));
+	appendValue(data, version);
+	appendValue(data, info.size());
+	appendValue(data, info.lastModified().toMSecsSinceEpoch());
+	return data;
+}
+
+// FNV-1a, enough to tell a record that was cut off or never finished
+quint32 EditJournal::checksum(const char *data, int length)
+{
+	quint32 hash = 2166136261u;
+	for (int i = 0; i < length; ++i) {
+		hash ^= quint8(data[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
@@ -0,0 +1,90 @@
+#ifndef EDITJOURNAL_H
+#define EDITJOURNAL_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include <memory>
+
+class QSaveFile;
+
+// Records the edits made to a file in a journal next to it as they're
+// made, so that the ones that weren't saved can be made again after a
+// crash. The journal belongs to the file as it was saved when the journal
+// was started and is ignored once the file has changed. Every record is
+// handed to the system right away, which keeps it if hexed dies, and is
+// made durable against the system going down at the next checkpoint
+class EditJournal
+{
+public:
+	enum class Operation : quint8
+	{
+		InsertBytes, InsertPattern, DeleteRange, ReplaceRange, FillRange,
+		Undo, Redo, BeginTransaction, EndTransaction
+	};
+
+	struct Record
+	{
+		Operation operation;
+		qint64 position;
+		qint64 length;
+		// The inserted or replacing bytes, the pattern or the fill value
+		QByteArray bytes;
+
+		Record() : Record(Operation::Undo) {}
+		explicit Record(Operation operation, qint64 position = 0, qint64 length = 0,
+						const QByteArray &bytes = QByteArray())
+			: operation(operation), position(position), length(length), bytes(bytes) {}
+	};
+
+	static QString journalFileName(const QString &fileName);
+	// Whether a journal with edits in it was left behind for the file as it's saved now
+	static bool exists(const QString &fileName);
+
+	explicit EditJournal(const QString &fileName);
+	~EditJournal();
+
+	// Opens the journal left behind to read its records
+	bool open();
+	// Reads the next record. Returns false at the end of the journal and
+	// at a record that wasn't written completely, which ends it too
+	bool readRecord(Record &record);
+	// Goes on appending after `offset`, dropping the records from there on
+	bool resume(qint64 offset);
+	// Starts the journal over for the file as it's saved now. The records
+	// from `keepFrom` on are kept, unless it's -1
+	bool start(qint64 keepFrom = -1);
+	// Starts the journal over like start(), with the records appended until
+	// commit() in place of the old ones. The old journal stays as it is
+	// until then, and after abort()
+	bool rewrite();
+	bool commit();
+	void abort();
+	bool append(const Record &record);
+	// Where the records read or written so far end
+	qint64 offset() const;
+	// Makes the records appended since the last checkpoint durable
+	bool checkpoint();
+	void remove();
+
+private:
+	static const char magic[8];
+	static const quint32 version = 1;
+	static const int headerSize = 8 + 4 + 8 + 8;
+	// The operation, the position and the length, after the record's size
+	static const int recordHeaderSize = 4 + 1 + 8 + 8;
+
+	QString m_fileName;
+	QFile m_file;
+	// The journal being rewritten, which replaces m_file once it's committed
+	std::unique_ptr<QSaveFile> m_rewrite;
+	qint64 m_offset;
+	bool m_dirty;
+
+	bool write(const QByteArray &data);
+	static QByteArray header(const QString &fileName);
+	static quint32 checksum(const char *data, int length);
+};
+
+#endif // EDITJOURNAL_H
@@ -0,0 +1,75 @@
+#ifndef EDITORBACKEND_H
+#define EDITORBACKEND_H
+
+#include "bufferededitor.h"
+#include "snapshot.h"
+#include "storagepolicy.h"
+
+// The storage engine behind a BufferedEditor. The editor forwards all
+// reads and modifications to its backend and emits the signals itself,
+// so a backend only has to keep track of the data and its undo history
+class EditorBackend
+{
+public:
+	typedef BufferedEditor::Byte Byte;
+	typedef BufferedEditor::Span Span;
+	typedef BufferedEditor::Cursor::State CursorState;
+	typedef BufferedEditor::Statistics Statistics;
+
+	virtual ~EditorBackend() {}
+
+	virtual bool seek(qint64 position) = 0;
+	virtual qint64 position() const = 0;
+	virtual qint64 size() const = 0;
+	virtual void moveForward() = 0;
+	virtual Byte getByte() = 0;
+	virtual Span readSpan(qint64 maxLength) = 0;
+	// The position along with where it is in the backend. A state that
+	// was taken before the backend changed is still valid, its position
+	// is looked up again then
+	virtual CursorState cursorState() const = 0;
+	virtual void setCursorState(const CursorState &state) = 0;
+	// Whether reading the range won't have to wait for the file
+	virtual bool isLoaded(qint64 position, qint64 length) = 0;
+	// Starts reading what the range needs from the file in the background
+	virtual void load(qint64 position, qint64 length) = 0;
+	virtual void insertBytes(qint64 position, const QByteArray &bytes) = 0;
+	virtual void insertPattern(qint64 position, qint64 length, const QByteArray &pattern) = 0;
+	virtual void deleteRange(qint64 position, qint64 length) = 0;
+	virtual void replaceRange(qint64 position, const QByteArray &bytes) = 0;
+	virtual void fillRange(qint64 position, qint64 length, char value) = 0;
+	virtual bool writeChanges() = 0;
+	// How many bytes writeChanges() would have to copy from one place in
+	// the file to another
+	virtual qint64 shiftVolume() = 0;
+	// The current contents, for a snapshot of them. The parts stay the
+	// same when the contents change later
+	virtual QVector<Snapshot::Part> contents() = 0;
+	// The copy is about to replace the file, so nothing may refer to the
+	// old one anymore
+	virtual bool releaseFile() = 0;
+	// The copy has replaced the file and the device has been reopened on it
+	virtual void setSaved() = 0;
+	virtual bool isModified() const = 0;
+	virtual bool canUndo() const = 0;
+	virtual bool canRedo() const = 0;
+	// Return false if the edit couldn't be undone or redone because the
+	// bytes it applies to couldn't be read. It's left as it was then
+	virtual bool undo() = 0;
+	virtual bool redo() = 0;
+	// The edits made between these calls are undone and redone as one.
+	// Transactions don't nest here, the editor takes care of that
+	virtual void beginTransaction() = 0;
+	virtual void endTransaction() = 0;
+	// How much memory the undo history may use
+	virtual void setHistoryLimit(qint64 bytes) = 0;
+	// How much memory the backend may use for caching the file
+	virtual void setMemoryBudget(qint64 bytes) = 0;
+	// How much of the file the backend reads at once
+	virtual void setStoragePolicy(const StoragePolicy &policy) = 0;
+	// What is held in memory and by the undo history. The editor counts
+	// the reads and writes itself
+	virtual Statistics statistics() const = 0;
+};
+
+#endif // EDITORBACKEND_H
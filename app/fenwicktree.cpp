@@ -0,0 +1,61 @@
+#include "fenwicktree.h"
+
+static inline int lowBit(int i)
+{
+	return i & -i;
+}
+
+void FenwickTree::clear()
+{
+	m_tree.clear();
+}
+
+void FenwickTree::build(const QVector<qint64> &values)
+{
+	m_tree = values;
+	int n = m_tree.size();
+	for (int i = 1; i <= n; ++i) {
+		int parent = i + lowBit(i);
+		if (parent <= n)
+			m_tree[parent - 1] += m_tree[i - 1];
+	}
+}
+
+void FenwickTree::append(qint64 value)
+{
+	int i = m_tree.size() + 1;
+	m_tree.append(value + prefixSum(i - 1) - prefixSum(i - lowBit(i)));
+}
+
+void FenwickTree::add(int index, qint64 delta)
+{
+	Q_ASSERT(index >= 0 && index < m_tree.size());
+	for (int i = index + 1; i <= m_tree.size(); i += lowBit(i))
+		m_tree[i - 1] += delta;
+}
+
+qint64 FenwickTree::prefixSum(int count) const
+{
+	Q_ASSERT(count >= 0 && count <= m_tree.size());
+	qint64 sum = 0;
+	for (int i = count; i > 0; i -= lowBit(i))
+		sum += m_tree[i - 1];
+	return sum;
+}
+
+int FenwickTree::upperBound(qint64 sum) const
+{
+	int n = m_tree.size();
+	int step = 1;
+	while (step * 2 <= n)
+		step *= 2;
+
+	int count = 0;
+	for (; step > 0; step /= 2) {
+		if (count + step <= n && m_tree[count + step - 1] <= sum) {
+			count += step;
+			sum -= m_tree[count - 1];
+		}
+	}
+	return count;
+}
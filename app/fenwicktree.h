@@ -0,0 +1,33 @@
+#ifndef FENWICKTREE_H
+#define FENWICKTREE_H
+
+#include <QVector>
+#include <QtGlobal>
+
+// A sequence of non-negative values that supports changing a value,
+// summing a prefix and finding the longest prefix under a given sum,
+// all in O(log n) time
+class FenwickTree
+{
+public:
+	int size() const
+	{
+		return m_tree.size();
+	}
+
+	void clear();
+	void build(const QVector<qint64> &values);
+	void append(qint64 value);
+	void add(int index, qint64 delta);
+
+	// The sum of the first `count` values
+	qint64 prefixSum(int count) const;
+	// The largest count for which prefixSum(count) <= sum
+	int upperBound(qint64 sum) const;
+
+private:
+	// m_tree[i - 1] holds the sum of the values in (i - lowBit(i), i]
+	QVector<qint64> m_tree;
+};
+
+#endif // FENWICKTREE_H
@@ -0,0 +1,194 @@
+#include "filecopier.h"
+#include "iocounters.h"
+#include "sparsefile.h"
+
+#include <QFile>
+#include <QSaveFile>
+
+#include <QDebug>
+
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+FileCopier::FileCopier(const Snapshot &snapshot, IoCounters *counters)
+	: m_fileName(snapshot.fileName())
+	, m_spillFileName(snapshot.spillFileName())
+	, m_parts(snapshot.parts())
+	, m_totalLength(snapshot.size())
+	, m_counters(counters)
+	, m_bytesWritten(0)
+	, m_succeeded(false)
+{
+}
+
+FileCopier::~FileCopier()
+{
+	requestInterruption();
+	wait();
+}
+
+qint64 FileCopier::totalLength() const
+{
+	return m_totalLength;
+}
+
+qint64 FileCopier::bytesWritten() const
+{
+	return m_bytesWritten.loadRelaxed();
+}
+
+bool FileCopier::copy()
+{
+	m_file.reset(new QSaveFile(m_fileName));
+	if (!m_file->open(QIODevice::WriteOnly)) {
+		m_errorString = m_file->errorString();
+		qCritical() << "FileCopier: Failed to create file next to" << m_fileName << ":" << m_errorString;
+		return false;
+	}
+
+	// The old file is read separately, the editor's device is left alone
+	QFile source(m_fileName);
+	QFile spill(m_spillFileName);
+	// Where the next bytes go. Zeros are skipped, which leaves holes
+	qint64 position = 0;
+	for (const Snapshot::Part &part : m_parts) {
+		if (part.source == Snapshot::Part::Source::File && !source.isOpen() && !source.open(QIODevice::ReadOnly)) {
+			m_errorString = source.errorString();
+			qCritical() << "FileCopier: Failed to open file" << m_fileName << ":" << m_errorString;
+			return false;
+		}
+		if (part.source == Snapshot::Part::Source::Spill && !spill.isOpen() && !spill.open(QIODevice::ReadOnly)) {
+			m_errorString = spill.errorString();
+			qCritical() << "FileCopier: Failed to open spill file" << m_spillFileName << ":" << m_errorString;
+			return false;
+		}
+
+		// The holes of the old file stay holes, and so do the patterns of zeros
+		bool zero = part.source == Snapshot::Part::Source::Pattern && isZero(part.data.constData(), part.patternSize);
+		qint64 holeStart = -1, holeEnd = -1;
+
+		QByteArray buffer;
+		for (qint64 index = 0; index < part.length;) {
+			if (isInterruptionRequested())
+				return false;
+
+			bool skip = zero;
+			if (part.source == Snapshot::Part::Source::File) {
+				if (part.offset + index >= holeEnd && !findHole(&source, part.offset + index, holeStart, holeEnd))
+					holeStart = holeEnd = std::numeric_limits<qint64>::max();
+				skip = part.offset + index >= holeStart;
+			}
+			if (skip) {
+				qint64 length = zero ? part.length - index : qMin(part.length - index, holeEnd - (part.offset + index));
+				index += length;
+				position += length;
+				m_bytesWritten.fetchAndAddRelaxed(length);
+				continue;
+			}
+
+			const char *data;
+			int length;
+			if (part.source == Snapshot::Part::Source::File) {
+				length = int(qMin(qMin(part.length - index, holeStart - (part.offset + index)), qint64(copyBufferSize)));
+				buffer.resize(length);
+				if (!source.seek(part.offset + index) || source.read(buffer.data(), length) != length) {
+					m_errorString = source.errorString();
+					qCritical() << "FileCopier: Failed to read from file:" << m_errorString;
+					return false;
+				}
+				if (m_counters)
+					m_counters->addRead(length);
+				data = buffer.constData();
+			} else if (part.source == Snapshot::Part::Source::Spill) {
+				length = int(qMin(part.length - index, qint64(copyBufferSize)));
+				buffer.resize(length);
+				if (!spill.seek(part.offset + index) || spill.read(buffer.data(), length) != length) {
+					m_errorString = spill.errorString();
+					qCritical() << "FileCopier: Failed to read from spill file:" << m_errorString;
+					return false;
+				}
+				data = buffer.constData();
+			} else if (part.source == Snapshot::Part::Source::Memory) {
+				length = int(qMin(part.length - index, qint64(copyBufferSize)));
+				data = part.data.constData() + part.offset + index;
+			} else {
+				// Any position in the pattern is followed by the rest of the block
+				length = int(qMin(part.length - index, qint64(part.data.size() - part.patternSize)));
+				data = part.data.constData() + (part.offset + index) % part.patternSize;
+			}
+
+			if (!write(position, data, length))
+				return false;
+			index += length;
+			position += length;
+			m_bytesWritten.fetchAndAddRelaxed(length);
+		}
+	}
+
+	// The file may end with a hole
+	if (m_file->size() < position && !m_file->resize(position)) {
+		m_errorString = m_file->errorString();
+		qCritical() << "FileCopier: Failed to resize file:" << m_errorString;
+		return false;
+	}
+
+	if (!m_file->flush()) {
+		m_errorString = m_file->errorString();
+		return false;
+	}
+#ifdef Q_OS_UNIX
+	// Syncing here leaves little for commit() to wait for
+	fsync(m_file->handle());
+#endif
+	return true;
+}
+
+bool FileCopier::succeeded() const
+{
+	return m_succeeded;
+}
+
+bool FileCopier::commit()
+{
+	Q_ASSERT(m_file);
+	if (!m_file->commit()) {
+		m_errorString = m_file->errorString();
+		qCritical() << "FileCopier: Failed to replace file" << m_fileName << ":" << m_errorString;
+		return false;
+	}
+	m_file.reset();
+	return true;
+}
+
+QString FileCopier::errorString() const
+{
+	return m_errorString;
+}
+
+void FileCopier::run()
+{
+	m_succeeded = copy();
+}
+
+bool FileCopier::write(qint64 position, const char *data, int length)
+{
+	if (m_file->pos() != position && !m_file->seek(position)) {
+		m_errorString = m_file->errorString();
+		qCritical() << "FileCopier: Failed to seek in file:" << m_errorString;
+		return false;
+	}
+
+	qint64 bytesWritten = m_file->write(data, length);
+	if (bytesWritten == -1) {
+		m_errorString = m_file->errorString();
+		qCritical() << "FileCopier: Failed to write to file:" << m_errorString;
+		return false;
+	}
+	Q_ASSERT(bytesWritten == length);
+	if (m_counters)
+		m_counters->addWrite(bytesWritten);
+	return true;
+}
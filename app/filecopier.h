@@ -0,0 +1,59 @@
+#ifndef FILECOPIER_H
+#define FILECOPIER_H
+
+#include "snapshot.h"
+
+#include <QAtomicInteger>
+#include <QString>
+#include <QThread>
+
+#include <memory>
+
+class QSaveFile;
+struct IoCounters;
+
+// Writes new contents for a file next to it and then replaces the file
+// with them, so that the old file stays intact until the very end. The
+// contents come from a snapshot of the editor, which lets the copy be
+// written on a worker thread. The holes of the old file and the patterns
+// of zeros are left as holes
+class FileCopier : public QThread
+{
+public:
+	// The most bytes that are written at once. An interruption is
+	// checked for between the writes
+	static const int copyBufferSize = 1024 * 1024;
+
+	explicit FileCopier(const Snapshot &snapshot, IoCounters *counters = nullptr);
+	~FileCopier() override;
+
+	qint64 totalLength() const;
+	qint64 bytesWritten() const;
+	// Writes the new contents on the calling thread. start() does the same
+	// on a worker thread, and requestInterruption() stops it
+	bool copy();
+	// Whether the copy on the worker thread was written in full
+	bool succeeded() const;
+	// Replaces the old file with the copy. Anything that refers to the
+	// old file has to let go of it first
+	bool commit();
+	QString errorString() const;
+
+protected:
+	void run() override;
+
+private:
+	QString m_fileName;
+	QString m_spillFileName;
+	QVector<Snapshot::Part> m_parts;
+	qint64 m_totalLength;
+	IoCounters *m_counters;
+	QAtomicInteger<qint64> m_bytesWritten;
+	bool m_succeeded;
+	std::unique_ptr<QSaveFile> m_file;
+	QString m_errorString;
+
+	bool write(qint64 position, const char *data, int length);
+};
+
+#endif // FILECOPIER_H
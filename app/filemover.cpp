@@ -0,0 +1,383 @@
+#include "filemover.h"
+#include "iocounters.h"
+#include "sparsefile.h"
+
+#include <QElapsedTimer>
+#include <QFileDevice>
+
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <linux/falloc.h>
+#include <sys/vfs.h>
+#endif
+
+FileMover::FileMover(QFileDevice *device, IoCounters *counters)
+	: m_device(device)
+	, m_counters(counters)
+	, m_copyRangeFailed(false)
+{
+}
+
+void FileMover::addMove(qint64 from, qint64 to, qint64 length)
+{
+	if (length <= 0)
+		return;
+
+	if (!m_moves.isEmpty()) {
+		Move &last = m_moves.last();
+		Q_ASSERT(from >= last.from + last.length && to >= last.to + last.length);
+		if (last.from + last.length == from && last.to + last.length == to) {
+			last.length += length;
+			return;
+		}
+	}
+	m_moves.append({from, to, length});
+}
+
+int FileMover::moveCount() const
+{
+	int count = 0;
+	for (const Move &m : m_moves)
+		if (m.from != m.to)
+			++count;
+	return count;
+}
+
+bool FileMover::run()
+{
+	if (moveCount() == 0)
+		return true;
+
+	// Whatever the device buffered has to reach the file first
+	if (!m_device->flush())
+		return false;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	if (!shiftRange())
+		return false;
+
+	qint64 bytesMoved = 0;
+	for (const Move &m : m_moves) {
+		if (m.to < m.from) {
+			if (!move(m))
+				return false;
+			bytesMoved += m.length;
+		}
+	}
+	for (int i = m_moves.size() - 1; i >= 0; --i) {
+		if (m_moves[i].to > m_moves[i].from) {
+			if (!move(m_moves[i]))
+				return false;
+			bytesMoved += m_moves[i].length;
+		}
+	}
+
+	for (const AsideBytes &aside : m_asideBytes) {
+		if (!writeAt(aside.position, aside.bytes.constData(), aside.bytes.size()))
+			return false;
+		bytesMoved += aside.bytes.size();
+	}
+
+	qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+	qDebug("Moved %lld bytes in %d ranges in %lld ms (%.1f MiB/s)",
+		   bytesMoved, moveCount(), elapsed, bytesMoved / 1048.576 / elapsed);
+
+	m_moves.clear();
+	m_asideBytes.clear();
+	m_buffer.clear();
+	return true;
+}
+
+qint64 FileMover::copyLength() const
+{
+	qint64 length = 0;
+	for (const Move &m : m_moves)
+		if (m.from != m.to)
+			length += m.length;
+
+	// Assume that the file system can shift the blocks when they line up
+	Shift shift;
+	if (planShift(shift))
+		for (int i = shift.first; i < m_moves.size(); ++i)
+			length -= m_moves[i].length;
+	return length;
+}
+
+// Finds the range that the file system would have to insert or remove,
+// when the end of the file moves by whole blocks
+bool FileMover::planShift(Shift &shift) const
+{
+#ifdef Q_OS_LINUX
+	int fd = m_device->handle();
+	if (fd == -1 || m_moves.isEmpty())
+		return false;
+
+	shift.distance = m_moves.last().to - m_moves.last().from;
+	struct statfs fileSystem;
+	if (shift.distance == 0 || fstatfs(fd, &fileSystem) != 0 || fileSystem.f_bsize <= 0 ||
+			shift.distance % qint64(fileSystem.f_bsize) != 0)
+		return false;
+	qint64 blockSize = fileSystem.f_bsize;
+
+	// The moves at the end of the file that share the same distance
+	shift.first = m_moves.size() - 1;
+	while (shift.first > 0 && m_moves[shift.first - 1].to - m_moves[shift.first - 1].from == shift.distance)
+		--shift.first;
+	qint64 start = m_moves[shift.first].from;
+
+	if (shift.distance > 0) {
+		// Everything from the offset on is shifted, what lies between
+		// it and the start is copied back afterwards
+		shift.offset = start / blockSize * blockSize;
+		return true;
+	}
+
+	// The removed blocks may only start with bytes that are still needed
+	const Move &previous = m_moves[qMax(shift.first - 1, 0)];
+	qint64 unused = shift.first > 0 ? previous.from + previous.length : 0;
+	shift.offset = unused / blockSize * blockSize;
+	return shift.offset - shift.distance <= start;
+#else
+	Q_UNUSED(shift)
+	return false;
+#endif
+}
+
+// Lets the file system shift the blocks instead of copying the bytes.
+// Only the bytes at the unaligned edge of the shift have to be copied
+// afterwards. Does nothing when the file system can't do that
+bool FileMover::shiftRange()
+{
+#ifdef Q_OS_LINUX
+	Shift shift;
+	if (!planShift(shift))
+		return true;
+
+	int fd = m_device->handle();
+	qint64 offset = shift.offset;
+	qint64 length = qAbs(shift.distance);
+	int mode = shift.distance > 0 ? FALLOC_FL_INSERT_RANGE : FALLOC_FL_COLLAPSE_RANGE;
+
+	// The needed bytes in the removed blocks are put aside and written
+	// when all else is moved
+	for (int i = shift.first - 1; shift.distance < 0 && i >= 0 && m_moves[i].from + m_moves[i].length > offset; --i) {
+		const Move &m = m_moves[i];
+		qint64 begin = qMax(m.from, offset);
+		QByteArray bytes(int(m.from + m.length - begin), Qt::Uninitialized);
+		if (!readAt(begin, bytes.data(), bytes.size()))
+			return false;
+		m_asideBytes.prepend({m.to + (begin - m.from), bytes});
+	}
+
+	if (fallocate(fd, mode, offset, length) != 0) {
+		// Not supported by the file system or the kernel, so the bytes
+		// are copied. Running out of space is a real failure though
+		if (errno == ENOSPC || errno == EIO) {
+			qCritical() << "FileMover: Failed to shift a range of the file:" << strerror(errno);
+			return false;
+		}
+		m_asideBytes.clear();
+		return true;
+	}
+
+	if (shift.distance > 0)
+		insertRange(offset, length);
+	else
+		collapseRange(offset, length);
+	qDebug("Shifted the file from %lld by %lld bytes", offset, shift.distance);
+#endif
+	return true;
+}
+
+// Updates the moves after `length` bytes were inserted at `offset`
+void FileMover::insertRange(qint64 offset, qint64 length)
+{
+	for (int i = 0; i < m_moves.size(); ++i) {
+		Move &m = m_moves[i];
+		if (m.from >= offset) {
+			m.from += length;
+		} else if (m.from + m.length > offset) {
+			// Half of the move was shifted
+			Move tail = {offset + length, m.to + (offset - m.from), m.length - (offset - m.from)};
+			m.length = offset - m.from;
+			m_moves.insert(i + 1, tail);
+			++i;
+		}
+	}
+}
+
+// Updates the moves after `length` bytes were removed at `offset`. The
+// bytes of the moves that were removed along with them were put aside
+void FileMover::collapseRange(qint64 offset, qint64 length)
+{
+	for (int i = 0; i < m_moves.size(); ++i) {
+		Move &m = m_moves[i];
+		Q_ASSERT(m.from + m.length <= offset + length || m.from >= offset + length);
+		if (m.from >= offset + length) {
+			m.from -= length;
+		} else if (m.from >= offset) {
+			m_moves.remove(i--);
+		} else if (m.from + m.length > offset) {
+			m.length = offset - m.from;
+		}
+	}
+}
+
+bool FileMover::move(const Move &move)
+{
+	qint64 index = 0;
+	while (index < move.length) {
+		int chunkLength;
+		qint64 chunkOffset;
+		if (move.to < move.from) {
+			qint64 to = move.to + index;
+			chunkLength = int(qMin(move.length - index, copyBufferSize - to % copyBufferSize));
+			chunkOffset = index;
+		} else {
+			// Copy back to front when moving towards the end of the file
+			qint64 end = move.to + move.length - index;
+			qint64 aligned = end % copyBufferSize;
+			chunkLength = int(qMin(move.length - index, aligned == 0 ? qint64(copyBufferSize) : aligned));
+			chunkOffset = move.length - index - chunkLength;
+		}
+
+		if (!copyChunk(move.from + chunkOffset, move.to + chunkOffset, chunkLength))
+			return false;
+		index += chunkLength;
+	}
+	return true;
+}
+
+bool FileMover::copyChunk(qint64 from, qint64 to, int length)
+{
+	// A hole is moved by making one at the destination
+	if (holeLength(m_device, from, length) == length && punchHole(m_device, to, length))
+		return true;
+
+	// The kernel can copy ranges that don't overlap without passing
+	// them through memory, or even share the blocks on disk
+	if (!copyRange(from, to, length))
+		return false;
+	if (length == 0)
+		return true;
+
+	m_buffer.resize(length);
+	return readAt(from, m_buffer.data(), length) && writeAt(to, m_buffer.constData(), length);
+}
+
+bool FileMover::readAt(qint64 position, char *data, int length)
+{
+#ifdef Q_OS_UNIX
+	int fd = m_device->handle();
+	if (fd != -1) {
+		for (int index = 0; index < length;) {
+			ssize_t bytesRead = pread(fd, data + index, size_t(length - index), position + index);
+			if (bytesRead <= 0) {
+				qCritical() << "FileMover: Failed to read from file:" << strerror(bytesRead == 0 ? EIO : errno);
+				return false;
+			}
+			index += int(bytesRead);
+			if (m_counters)
+				m_counters->addRead(bytesRead);
+		}
+		return true;
+	}
+#endif
+
+	if (!m_device->seek(position)) {
+		qCritical() << "FileMover: Failed to seek in file:" << m_device->errorString();
+		return false;
+	}
+	qint64 bytesRead = m_device->read(data, length);
+	if (bytesRead == -1) {
+		qCritical() << "FileMover: Failed to read from file:" << m_device->errorString();
+		return false;
+	}
+	Q_ASSERT(bytesRead == length);
+	if (m_counters)
+		m_counters->addRead(bytesRead);
+	return true;
+}
+
+bool FileMover::writeAt(qint64 position, const char *data, int length)
+{
+#ifdef Q_OS_UNIX
+	int fd = m_device->handle();
+	if (fd != -1) {
+		for (int index = 0; index < length;) {
+			ssize_t bytesWritten = pwrite(fd, data + index, size_t(length - index), position + index);
+			if (bytesWritten < 0) {
+				qCritical() << "FileMover: Failed to write to file:" << strerror(errno);
+				return false;
+			}
+			index += int(bytesWritten);
+			if (m_counters)
+				m_counters->addWrite(bytesWritten);
+		}
+		return true;
+	}
+#endif
+
+	if (!m_device->seek(position)) {
+		qCritical() << "FileMover: Failed to seek in file:" << m_device->errorString();
+		return false;
+	}
+	qint64 bytesWritten = m_device->write(data, length);
+	if (bytesWritten == -1) {
+		qCritical() << "FileMover: Failed to write to file:" << m_device->errorString();
+		return false;
+	}
+	Q_ASSERT(bytesWritten == length);
+	if (m_counters)
+		m_counters->addWrite(bytesWritten);
+	return true;
+}
+
+// Copies as much of the chunk as the kernel allows and leaves the rest,
+// if any, in the arguments. Fails only when the file can't be written
+bool FileMover::copyRange(qint64 &from, qint64 &to, int &length)
+{
+#ifdef Q_OS_LINUX
+	int fd = m_device->handle();
+	if (m_copyRangeFailed || fd == -1 || qAbs(to - from) < length)
+		return true;
+
+	while (length > 0) {
+		loff_t in = from, out = to;
+		ssize_t bytesCopied = copy_file_range(fd, &in, fd, &out, size_t(length), 0);
+		if (bytesCopied <= 0) {
+			// Not supported by the kernel or the file system, so don't
+			// try again. Running out of space is a real failure though
+			if (bytesCopied < 0 && (errno == ENOSPC || errno == EIO)) {
+				qCritical() << "FileMover: Failed to copy in file:" << strerror(errno);
+				return false;
+			}
+			m_copyRangeFailed = true;
+			return true;
+		}
+		// The kernel reads and writes the bytes without copying them out
+		if (m_counters) {
+			m_counters->addRead(bytesCopied);
+			m_counters->addWrite(bytesCopied);
+		}
+		from += bytesCopied;
+		to += bytesCopied;
+		length -= int(bytesCopied);
+	}
+#else
+	Q_UNUSED(from)
+	Q_UNUSED(to)
+	Q_UNUSED(length)
+#endif
+	return true;
+}
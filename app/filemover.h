@@ -0,0 +1,77 @@
+#ifndef FILEMOVER_H
+#define FILEMOVER_H
+
+#include <QByteArray>
+#include <QVector>
+#include <QtGlobal>
+
+class QFileDevice;
+struct IoCounters;
+
+// Moves ranges of a file to new positions within the same file. The
+// ranges never change their order, only their position, so the ones
+// that move towards the beginning of the file are copied front to back
+// and the ones that move towards the end are copied back to front,
+// without ever overwriting data that hasn't been moved yet
+class FileMover
+{
+public:
+	explicit FileMover(QFileDevice *device, IoCounters *counters = nullptr);
+
+	// Queues a move. The moves have to be added in the order of their
+	// positions in the file. A move that continues the previous one by
+	// the same distance is merged into it. The bytes that stay where
+	// they are have to be added too, so that they are kept in place
+	// when the file system shifts a part of the file
+	void addMove(qint64 from, qint64 to, qint64 length);
+	// The number of moves that actually change the position of bytes
+	int moveCount() const;
+	// How many bytes run() would have to copy
+	qint64 copyLength() const;
+	// Carries out all of the queued moves
+	bool run();
+
+private:
+	// The most bytes that are copied at once. The copies are aligned to
+	// it in the destination, so the writes start at round offsets
+	static const int copyBufferSize = 1024 * 1024;
+
+	struct Move
+	{
+		qint64 from, to, length;
+	};
+
+	// The moves from `first` on all move by `distance`, which is done by
+	// inserting or removing blocks of the file at `offset`
+	struct Shift
+	{
+		int first;
+		qint64 offset, distance;
+	};
+
+	// Bytes that are written to `position` once everything is moved
+	struct AsideBytes
+	{
+		qint64 position;
+		QByteArray bytes;
+	};
+
+	QFileDevice *m_device;
+	IoCounters *m_counters;
+	QVector<Move> m_moves;
+	QVector<AsideBytes> m_asideBytes;
+	QByteArray m_buffer;
+	bool m_copyRangeFailed;
+
+	bool planShift(Shift &shift) const;
+	bool shiftRange();
+	void insertRange(qint64 offset, qint64 length);
+	void collapseRange(qint64 offset, qint64 length);
+	bool move(const Move &move);
+	bool copyChunk(qint64 from, qint64 to, int length);
+	bool readAt(qint64 position, char *data, int length);
+	bool writeAt(qint64 position, const char *data, int length);
+	bool copyRange(qint64 &from, qint64 &to, int &length);
+};
+
+#endif // FILEMOVER_H
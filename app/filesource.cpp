@@ -0,0 +1,197 @@
+#include "filesource.h"
+#include "iocounters.h"
+#include "prefetcher.h"
+#include "sparsefile.h"
+
+#include <QFileDevice>
+
+#include <QDebug>
+
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+FileSource::FileSource(QFileDevice *device, IoCounters *counters)
+	: m_device(device)
+	, m_counters(counters)
+	, m_map(nullptr)
+	, m_mapSize(0)
+	, m_mapFailed(false)
+	, m_lastReadStart(-1)
+	, m_lastReadEnd(-1)
+	, m_accessPattern(AccessPattern::Normal)
+	, m_dataStart(0)
+	, m_holeStart(0)
+	, m_holeEnd(0)
+{
+	// The worker needs a file of its own to read from
+	if (!device->fileName().isEmpty())
+		m_prefetcher.reset(new Prefetcher(device->fileName(), counters));
+}
+
+FileSource::~FileSource()
+{
+	unmap();
+}
+
+bool FileSource::read(qint64 position, int length, QByteArray &data)
+{
+	Q_ASSERT(position >= 0 && length >= 0);
+
+	bool forward = position == m_lastReadEnd;
+	bool backward = position + length == m_lastReadStart;
+	m_lastReadStart = position;
+	m_lastReadEnd = position + length;
+
+	// Keep reading ahead in the direction the file is being read in
+	if (m_prefetcher) {
+		if (forward) {
+			m_prefetcher->prefetch(position + length, prefetchLength);
+		} else if (backward) {
+			qint64 start = qMax(position - prefetchLength, qint64(0));
+			m_prefetcher->prefetch(start, position - start);
+		}
+		if (m_prefetcher->read(position, length, data))
+			return true;
+	}
+
+	if (m_map || map()) {
+		if (position + length <= m_mapSize) {
+			// Let the kernel read ahead while the file is being scanned
+			// and stop it from doing so when jumping around
+			advise(forward || backward ? AccessPattern::Sequential : AccessPattern::Random);
+
+			data = QByteArray::fromRawData(reinterpret_cast<const char *>(m_map + position), length);
+			// Counted like a read, the page faults read the same bytes
+			if (m_counters)
+				m_counters->addRead(length);
+			return true;
+		}
+	}
+
+	if (!m_device->seek(position)) {
+		qCritical() << "FileSource: Failed to seek in file:" << m_device->errorString();
+		return false;
+	}
+
+	data = QByteArray(length, Qt::Uninitialized);
+	qint64 bytesRead = m_device->read(data.data(), length);
+	if (bytesRead == -1) {
+		qCritical() << "FileSource: Failed to read from file:" << m_device->errorString();
+		data.clear();
+		return false;
+	}
+	Q_ASSERT(bytesRead == length);
+	if (m_counters)
+		m_counters->addRead(bytesRead);
+
+	return true;
+}
+
+bool FileSource::isResident(qint64 position, qint64 length)
+{
+	if (!m_prefetcher || length <= 0 || m_prefetcher->isStaged(position, length))
+		return true;
+	if (holeLength(position, length) == length)
+		return true;
+
+#ifdef Q_OS_UNIX
+	// The pages of the mapping that are in the page cache are as good
+	if ((m_map || map()) && position + length <= m_mapSize) {
+		qint64 pageSize = sysconf(_SC_PAGESIZE);
+		qint64 begin = position / pageSize * pageSize;
+		qint64 end = position + length;
+		QByteArray pages(int((end - begin + pageSize - 1) / pageSize), Qt::Uninitialized);
+		if (mincore(m_map + begin, size_t(end - begin), reinterpret_cast<unsigned char *>(pages.data())) == 0) {
+			for (char page : pages)
+				if (!(page & 1))
+					return false;
+			return true;
+		}
+	}
+#endif
+
+	return false;
+}
+
+void FileSource::prefetch(qint64 position, qint64 length)
+{
+	if (m_prefetcher && holeLength(position, length) < length)
+		m_prefetcher->prefetch(position, length);
+}
+
+qint64 FileSource::holeLength(qint64 position, qint64 length)
+{
+	findHole(position);
+	if (position < m_holeStart)
+		return 0;
+	return qMin(m_holeEnd - position, length);
+}
+
+qint64 FileSource::dataLength(qint64 position, qint64 length)
+{
+	findHole(position);
+	if (position >= m_holeStart)
+		return 0;
+	return qMin(m_holeStart - position, length);
+}
+
+void FileSource::unmap()
+{
+	if (m_map)
+		m_device->unmap(m_map);
+	m_map = nullptr;
+	m_mapSize = 0;
+	m_mapFailed = false;
+	m_lastReadStart = -1;
+	m_lastReadEnd = -1;
+	m_accessPattern = AccessPattern::Normal;
+	m_dataStart = m_holeStart = m_holeEnd = 0;
+	if (m_prefetcher)
+		m_prefetcher->clear();
+}
+
+bool FileSource::map()
+{
+	if (m_mapFailed)
+		return false;
+
+	// Empty files can't be mapped and a failure isn't worth retrying
+	// until the file changes
+	qint64 size = m_device->size();
+	m_map = size > 0 ? m_device->map(0, size) : nullptr;
+	if (!m_map) {
+		m_mapFailed = true;
+		return false;
+	}
+	m_mapSize = size;
+	return true;
+}
+
+// Finds the hole at or after `position`, unless it's already known
+void FileSource::findHole(qint64 position)
+{
+	if (position >= m_dataStart && position < m_holeEnd)
+		return;
+
+	m_dataStart = position;
+	if (!::findHole(m_device, position, m_holeStart, m_holeEnd)) {
+		// Without holes the rest of the file is all data
+		m_holeStart = m_holeEnd = std::numeric_limits<qint64>::max();
+	}
+}
+
+void FileSource::advise(AccessPattern pattern)
+{
+	if (pattern == m_accessPattern)
+		return;
+	m_accessPattern = pattern;
+
+#ifdef Q_OS_UNIX
+	int advice = pattern == AccessPattern::Sequential ? MADV_SEQUENTIAL : MADV_RANDOM;
+	madvise(m_map, size_t(m_mapSize), advice);
+#endif
+}
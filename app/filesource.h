@@ -0,0 +1,71 @@
+#ifndef FILESOURCE_H
+#define FILESOURCE_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+#include <memory>
+
+class QFileDevice;
+class Prefetcher;
+struct IoCounters;
+
+// Reads ranges of the saved file. When the device can be mapped into
+// memory the data is served straight out of the mapping without being
+// copied, otherwise it is read through the device. While the file is
+// read in one direction, the data ahead is read on a worker thread
+class FileSource
+{
+public:
+	explicit FileSource(QFileDevice *device, IoCounters *counters = nullptr);
+	~FileSource();
+
+	// Sets `data` to the bytes in [position, position + length). The
+	// returned array may refer to the mapped file, so it has to be
+	// detached or dropped before unmap() is called
+	bool read(qint64 position, int length, QByteArray &data);
+	// Whether the range can be read without waiting for the disk. It's
+	// always true when nothing can be read in the background
+	bool isResident(qint64 position, qint64 length);
+	// Starts reading the range in the background
+	void prefetch(qint64 position, qint64 length);
+	// The length of the hole in the file at `position`, at most `length`.
+	// The bytes of a hole are zeros that never have to be read
+	qint64 holeLength(qint64 position, qint64 length);
+	// How many bytes from `position` on come before the next hole, at most `length`
+	qint64 dataLength(qint64 position, qint64 length);
+
+	// Releases the mapping. Has to be called before the file is modified,
+	// the file is mapped again on the next read
+	void unmap();
+
+private:
+	// How much is read ahead of a sequential read
+	static const int prefetchLength = 512 * 1024;
+
+	enum class AccessPattern
+	{
+		Normal, Sequential, Random
+	};
+
+	QFileDevice *m_device;
+	IoCounters *m_counters;
+	uchar *m_map;
+	qint64 m_mapSize;
+	bool m_mapFailed;
+	qint64 m_lastReadStart;
+	qint64 m_lastReadEnd;
+	AccessPattern m_accessPattern;
+	// The range last looked up: data from m_dataStart up to the hole
+	// in [m_holeStart, m_holeEnd). Empty until the first look up
+	qint64 m_dataStart;
+	qint64 m_holeStart;
+	qint64 m_holeEnd;
+	std::unique_ptr<Prefetcher> m_prefetcher;
+
+	bool map();
+	void advise(AccessPattern pattern);
+	void findHole(qint64 position);
+};
+
+#endif // FILESOURCE_H
@@ -1,9 +1,9 @@
 #include "finder.h"
-#include "bufferededitor.h"
 
 Finder::Finder(BufferedEditor *editor, QObject *parent)
 	: QObject(parent)
 	, m_editor(editor)
+	, m_cursor(editor)
 	, m_position(-1)
 	, m_searchResultPosition(-1)
 {
@@ -40,11 +40,24 @@ void Finder::findNext()
 {
 	if (m_automataState == m_searchData.size())
 		m_automataState = 0;
-	m_editor->seek(m_position);
+	// Searching on from the last match reads on from where the cursor is
+	m_cursor.seek(m_position);
 	while (m_position < m_editor->size() && m_automataState < m_searchData.size()) {
-		auto byte = m_editor->getByte();
-		m_automataState = m_automata[m_automataState * 256 + (unsigned char)*byte.current];
-		++m_position;
+		BufferedEditor::Span span = m_cursor.readSpan(m_editor->size() - m_position);
+		if (span.length == 0)
+			break;
+		const char *data = span.data();
+		for (int i = 0; i < span.length && m_automataState < m_searchData.size(); ++i) {
+			int state = m_automata[m_automataState * 256 + (unsigned char)data[i]];
+			// A byte that leaves the state as it is does so again and
+			// again, so the rest of a span of the same byte is skipped
+			if (state == m_automataState && span.patternSize == 1) {
+				m_position += span.length - i;
+				break;
+			}
+			m_automataState = state;
+			++m_position;
+		}
 	}
 	m_searchResultPosition = m_automataState == m_searchData.size() ? m_position - m_searchData.size() : -1;
 	emit searchFinished(m_searchResultPosition);
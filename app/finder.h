@@ -1,9 +1,9 @@
 #ifndef FINDER_H
 #define FINDER_H
 
-#include <QObject>
+#include "bufferededitor.h"
 
-class BufferedEditor;
+#include <QObject>
 
 class Finder : public QObject
 {
@@ -23,6 +23,7 @@ public slots:
 
 private:
 	BufferedEditor *m_editor;
+	BufferedEditor::Cursor m_cursor;
 	qint64 m_position;
 	QByteArray m_searchData;
 	QVector<int> m_automata;
@@ -7,8 +7,11 @@
 #include <QHBoxLayout>
 #include <QVBoxLayout>
 #include <QLabel>
+#include <QProgressBar>
 #include <QScrollBar>
 #include <QStatusBar>
+#include <QTimer>
+#include <QToolButton>
 
 // TODO: Optionally don't scroll in real time while the scrollbar is being dragged
 
@@ -19,8 +22,24 @@ HexView::HexView(QWidget *parent)
 	, m_statusBar(new QStatusBar)
 	, m_fileSizeLabel(new QLabel)
 	, m_selectionLabel(new QLabel)
+	, m_saveProgressBar(new QProgressBar)
+	, m_cancelSaveButton(new QToolButton)
+	, m_statisticsLabel(new QLabel)
+	, m_statisticsTimer(new QTimer(this))
 {
+	m_saveProgressBar->setFormat("Saving %p%");
+	m_saveProgressBar->setMaximumWidth(200);
+	m_saveProgressBar->hide();
+	m_cancelSaveButton->setText("Cancel");
+	m_cancelSaveButton->hide();
+	m_statisticsLabel->hide();
+	// The counters change without any signal, so they are polled
+	m_statisticsTimer->setInterval(statisticsUpdateInterval);
+
 	m_statusBar->addPermanentWidget(m_selectionLabel, 1);
+	m_statusBar->addPermanentWidget(m_saveProgressBar);
+	m_statusBar->addPermanentWidget(m_cancelSaveButton);
+	m_statusBar->addPermanentWidget(m_statisticsLabel);
 	m_statusBar->addPermanentWidget(m_fileSizeLabel);
 
 	QHBoxLayout *hbox = new QHBoxLayout;
@@ -42,6 +61,8 @@ HexView::HexView(QWidget *parent)
 	connect(m_hexViewInternal, &HexViewInternal::scrollMaximumChanged, this, &HexView::updateScrollMaximum);
 	connect(m_hexViewInternal, &HexViewInternal::selectionChanged, this, &HexView::selectionChanged);
 	connect(m_verticalScrollBar, &QScrollBar::valueChanged, this, &HexView::onScrollBarChanged);
+	connect(m_cancelSaveButton, &QToolButton::clicked, m_hexViewInternal, &HexViewInternal::cancelSaving);
+	connect(m_statisticsTimer, &QTimer::timeout, this, &HexView::updateStatistics);
 }
 
 std::optional<ByteSelection> HexView::selection() const
@@ -49,6 +70,11 @@ std::optional<ByteSelection> HexView::selection() const
 	return m_hexViewInternal->selection();
 }
 
+bool HexView::isStatisticsVisible() const
+{
+	return !m_statisticsLabel->isHidden();
+}
+
 void HexView::updateScrollMaximum()
 {
 	qint64 scrollMaximum = m_hexViewInternal->scrollMaximum();
@@ -88,11 +114,8 @@ void HexView::updateStatusBar()
 
 		QByteArray bytes;
 		auto editor = m_hexViewInternal->editor();
-		if (sel.count <= 4 && sel.begin != editor->size()) {
-			editor->seek(sel.begin);
-			for (int i = 0; i < sel.count; ++i)
-				bytes.append(quint8(*(editor->getByte().current)));
-		}
+		if (sel.count <= 4 && sel.begin != editor->size())
+			bytes = BufferedEditor::Cursor(editor, sel.begin).read(sel.count);
 
 		if (sel.begin == editor->size()) {
 			selectionText = QString("Selected 0x%1")
@@ -120,6 +143,35 @@ void HexView::updateStatusBar()
 	m_selectionLabel->setText(selectionText);
 }
 
+void HexView::updateSaveProgress(qint64 bytesWritten, qint64 totalBytes)
+{
+	// The range of a progress bar is limited to an int
+	m_saveProgressBar->setRange(0, 1000);
+	m_saveProgressBar->setValue(totalBytes > 0 ? int(bytesWritten * 1000 / totalBytes) : 0);
+	m_saveProgressBar->show();
+	m_cancelSaveButton->show();
+}
+
+void HexView::hideSaveProgress()
+{
+	m_saveProgressBar->hide();
+	m_cancelSaveButton->hide();
+}
+
+void HexView::updateStatistics()
+{
+	BufferedEditor *editor = m_hexViewInternal->editor();
+	if (!editor)
+		return;
+
+	BufferedEditor::Statistics statistics = editor->statistics();
+	m_statisticsLabel->setText(QString("Loaded: %1 in %2 | Read: %3 in %4 | Written: %5 in %6 | Undo: %7 in %8")
+			.arg(prettySize(statistics.residentBytes)).arg(statistics.residentSections)
+			.arg(prettySize(statistics.bytesRead)).arg(statistics.readCount)
+			.arg(prettySize(statistics.bytesWritten)).arg(statistics.writeCount)
+			.arg(prettySize(statistics.undoMemory)).arg(statistics.undoEntries));
+}
+
 int HexView::scrollStep(qint64 rowCount) const
 {
 	const qint64 maxScrollValue = 2100000000;
@@ -149,6 +201,8 @@ bool HexView::openFile(const QString &path)
 	bool result = m_hexViewInternal->openFile(path);
 	BufferedEditor *editor = m_hexViewInternal->editor();
 	connect(editor, &BufferedEditor::sizeChanged, this, &HexView::updateStatusBar);
+	connect(editor, &BufferedEditor::saveProgress, this, &HexView::updateSaveProgress);
+	connect(editor, &BufferedEditor::saveFinished, this, &HexView::hideSaveProgress);
 	connect(m_hexViewInternal, &HexViewInternal::selectionChanged, this, &HexView::updateStatusBar);
 	updateStatusBar();
 	return result;
@@ -207,3 +261,14 @@ void HexView::openFindDialog()
 {
 	m_hexViewInternal->openFindDialog();
 }
+
+void HexView::setStatisticsVisible(bool visible)
+{
+	m_statisticsLabel->setVisible(visible);
+	if (visible) {
+		updateStatistics();
+		m_statisticsTimer->start();
+	} else {
+		m_statisticsTimer->stop();
+	}
+}
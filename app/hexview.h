@@ -11,6 +11,9 @@ class BufferedEditor;
 class QScrollBar;
 class QStatusBar;
 class QLabel;
+class QProgressBar;
+class QToolButton;
+class QTimer;
 
 class HexView : public QWidget
 {
@@ -19,6 +22,7 @@ public:
 	explicit HexView(QWidget *parent = nullptr);
 
 	std::optional<ByteSelection> selection() const;
+	bool isStatisticsVisible() const;
 
 public slots:
 	bool canUndo() const;
@@ -36,6 +40,9 @@ public slots:
 	void copyHex();
 	void openGotoDialog();
 	void openFindDialog();
+	// Shows what the editor holds in memory and how much it has read
+	// and written in the status bar
+	void setStatisticsVisible(bool visible);
 
 signals:
 	void canUndoChanged(bool canUndo);
@@ -47,15 +54,25 @@ private slots:
 	void setTopRow(qint64 topRow);
 	void onScrollBarChanged(int value);
 	void updateStatusBar();
+	void updateSaveProgress(qint64 bytesWritten, qint64 totalBytes);
+	void hideSaveProgress();
+	void updateStatistics();
 
 	int scrollStep(qint64 rowCount) const;
 
 private:
+	// How often the statistics are updated while shown, in milliseconds
+	static const int statisticsUpdateInterval = 1000;
+
 	HexViewInternal *m_hexViewInternal;
 	QScrollBar *m_verticalScrollBar;
 	QStatusBar *m_statusBar;
 	QLabel *m_fileSizeLabel;
 	QLabel *m_selectionLabel;
+	QProgressBar *m_saveProgressBar;
+	QToolButton *m_cancelSaveButton;
+	QLabel *m_statisticsLabel;
+	QTimer *m_statisticsTimer;
 };
 
 #endif // HEXVIEW_H
@@ -104,6 +104,7 @@ HexViewInternal::HexViewInternal(QWidget *parent)
 	, m_selectingRows(false)
 	, m_selecting(false)
 	, m_editor(nullptr)
+	, m_saveCancelled(false)
 	, m_topRow(0)
 	, m_mouseScrollBuffer(0.0)
 	, m_editingCell(false)
@@ -140,16 +141,26 @@ QString HexViewInternal::toPlainText()
 		return s;
 
 	QString byte = "FF ";
-	m_editor->seek(0);
-	while (!m_editor->atEnd()) {
-		for (int x = 0; !m_editor->atEnd() && x < m_bytesPerLine; ++x) {
-			unsigned char b = static_cast<unsigned char>(*m_editor->getByte().current);
+	BufferedEditor::Cursor cursor(m_editor);
+	int x = 0;
+	while (!cursor.atEnd()) {
+		BufferedEditor::Span span = cursor.readSpan(m_editor->size() - cursor.position());
+		if (span.length == 0)
+			break;
+		const char *data = span.data();
+		for (int i = 0; i < span.length; ++i) {
+			unsigned char b = static_cast<unsigned char>(data[i]);
 			byte[0] = hexTable[(b >> 4) & 0xF];
 			byte[1] = hexTable[(b >> 0) & 0xF];
 			s.append(byte);
+			if (++x == m_bytesPerLine) {
+				s[s.size() - 1] = '\n';
+				x = 0;
+			}
 		}
-		s[s.size() - 1] = '\n';
 	}
+	if (x != 0)
+		s[s.size() - 1] = '\n';
 	return s;
 }
 
@@ -279,22 +290,27 @@ void HexViewInternal::copy(ByteSelection selection)
 {
 	QClipboard *clipboard = QGuiApplication::clipboard();
 	QString s;
-	m_editor->seek(selection.begin);
-	if (selection.type == ByteSelection::Type::Text) {
-		while (m_editor->position() < selection.begin + selection.count) {
-			char b = *m_editor->getByte().current;
-			s.append((b >= 32 && b <= 126) ? b : '.');
-		}
-	} else {
-		QString cell = "00 ";
-		while (m_editor->position() < selection.begin + selection.count) {
-			unsigned char byte = static_cast<unsigned char>(*m_editor->getByte().current);
-			cell[0] = hexTable[(byte >> 4) & 0xF];
-			cell[1] = hexTable[(byte >> 0) & 0xF];
-			s.append(cell);
+	BufferedEditor::Cursor cursor(m_editor, selection.begin);
+	QString cell = "00 ";
+	while (cursor.position() < selection.begin + selection.count) {
+		BufferedEditor::Span span = cursor.readSpan(selection.begin + selection.count - cursor.position());
+		if (span.length == 0)
+			break;
+		const char *data = span.data();
+		for (int i = 0; i < span.length; ++i) {
+			if (selection.type == ByteSelection::Type::Text) {
+				char b = data[i];
+				s.append((b >= 32 && b <= 126) ? b : '.');
+			} else {
+				unsigned char byte = static_cast<unsigned char>(data[i]);
+				cell[0] = hexTable[(byte >> 4) & 0xF];
+				cell[1] = hexTable[(byte >> 0) & 0xF];
+				s.append(cell);
+			}
 		}
-		s.remove(s.size() - 1, 1);
 	}
+	if (selection.type != ByteSelection::Type::Text)
+		s.remove(s.size() - 1, 1);
 	clipboard->setText(s);
 }
 
@@ -330,6 +346,7 @@ bool HexViewInternal::openFile(const QString &path)
 	}
 
 	m_editor = new BufferedEditor(&m_file, this);
+	m_cursor = BufferedEditor::Cursor(m_editor);
 	m_findWidget = new FindWidget(this, this);
 	m_findWidget->hide();
 	connect(m_findWidget, &FindWidget::closed, [this]() { update(); });
@@ -341,6 +358,17 @@ bool HexViewInternal::openFile(const QString &path)
 
 	connect(m_editor, &BufferedEditor::canUndoChanged, this, &HexViewInternal::canUndoChanged);
 	connect(m_editor, &BufferedEditor::canRedoChanged, this, &HexViewInternal::canRedoChanged);
+	connect(m_editor, &BufferedEditor::loaded, this, &HexViewInternal::updateRows);
+	connect(m_editor, &BufferedEditor::saveFinished, this, &HexViewInternal::onSaveFinished);
+
+	// Offer the edits that weren't saved the last time the file was open
+	if (m_editor->hasJournal()) {
+		auto button = QMessageBox::question(this, "",
+											QString("%1 has unsaved changes from a previous session. Restore them?").arg(path));
+		if (button == QMessageBox::Yes && m_editor->restoreJournal() == -1)
+			QMessageBox::critical(this, "", QString("Failed to restore the changes to %1").arg(path));
+	}
+	m_editor->setJournaling(true);
 
 	emit rowCountChanged();
 
@@ -350,6 +378,34 @@ bool HexViewInternal::openFile(const QString &path)
 
 bool HexViewInternal::saveChanges()
 {
+	// A long save goes on in the background, the rest is done right away
+	if (!m_editor->isSaving() && m_editor->startSaving()) {
+		m_saveCancelled = false;
+		return true;
+	}
+	return writeChanges();
+}
+
+void HexViewInternal::cancelSaving()
+{
+	m_saveCancelled = true;
+	m_editor->cancelSaving();
+}
+
+void HexViewInternal::onSaveFinished(bool success)
+{
+	if (!success && !m_saveCancelled)
+		QMessageBox::critical(this, "",
+							  QString("Failed to save file %1: %2").arg(m_file.fileName()).arg(m_editor->errorString()));
+	update();
+}
+
+bool HexViewInternal::writeChanges()
+{
+	// A failed save in the background is reported when it finishes
+	if (m_editor->isSaving() && !m_editor->waitForSaving())
+		return false;
+
 	bool ok = m_editor->writeChanges();
 	if (!ok)
 		QMessageBox::critical(this, "",
@@ -360,31 +416,40 @@ bool HexViewInternal::saveChanges()
 
 bool HexViewInternal::quit()
 {
-	if (!m_editor->isModified())
-		return true;
+	// Let the save in progress finish before deciding on the rest
+	if (m_editor->isSaving() && !m_editor->waitForSaving())
+		return false;
 
-	auto button = QMessageBox::question(this, "",
-										QString("Save changes to %1?").arg(m_file.fileName()),
-										QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel);
-	if (button == QMessageBox::Yes) {
-		if (!saveChanges())
+	if (m_editor->isModified()) {
+		auto button = QMessageBox::question(this, "",
+											QString("Save changes to %1?").arg(m_file.fileName()),
+											QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel);
+		if (button == QMessageBox::Yes) {
+			if (!writeChanges())
+				return false;
+		} else if (button == QMessageBox::Cancel) {
 			return false;
-	} else if (button == QMessageBox::Cancel) {
-		return false;
+		}
 	}
 
+	// The changes are saved or given up, nothing is left to restore
+	m_editor->setJournaling(false);
 	return true;
 }
 
 void HexViewInternal::undo()
 {
-	m_editor->undo();
+	if (m_editor->canUndo() && !m_editor->undo())
+		QMessageBox::critical(this, "",
+							  QString("Failed to undo in file %1: %2").arg(m_file.fileName()).arg(m_editor->errorString()));
 	update();
 }
 
 void HexViewInternal::redo()
 {
-	m_editor->redo();
+	if (m_editor->canRedo() && !m_editor->redo())
+		QMessageBox::critical(this, "",
+							  QString("Failed to redo in file %1: %2").arg(m_file.fileName()).arg(m_editor->errorString()));
 	update();
 }
 
@@ -410,6 +475,18 @@ void HexViewInternal::openFindDialog()
 	m_findWidget->setFocus();
 }
 
+void HexViewInternal::updateRows(qint64 position, qint64 length)
+{
+	const int cellHeight = m_cellSize + m_cellPadding;
+	qint64 firstRow = qMax(position / m_bytesPerLine - m_topRow, qint64(0));
+	qint64 lastRow = qMin((position + length - 1) / m_bytesPerLine - m_topRow, qint64(height() / cellHeight + 1));
+	if (firstRow > lastRow)
+		return;
+
+	// The text of a row reaches a bit into the next one
+	update(0, int(firstRow * cellHeight), width(), int((lastRow - firstRow + 2) * cellHeight));
+}
+
 void HexViewInternal::updateFindDialogPosition()
 {
 	m_findWidget->setFixedWidth(width());
@@ -442,11 +519,35 @@ void HexViewInternal::paintEvent(QPaintEvent *event)
 	qint64 i = startY * m_bytesPerLine;
 	if (i >= m_editor->size())
 		return;
-	m_editor->seek(i);
-	for (qint64 y = startY, yCoord = m_cellSize; i <= m_editor->size() && y < endY; ++y, yCoord += cellHeight) {
+	// The visible bytes are read a span at a time. The rows that would
+	// have to wait for the disk are drawn empty and loaded in the
+	// background, they are repainted once they can be read
+	qint64 readEnd = qMin(m_editor->size(), endY * m_bytesPerLine);
+	BufferedEditor::Span span;
+	int spanIndex = 0;
+	bool needsSeek = true;
+	bool loadRequested = false;
+	for (qint64 y = startY, yCoord = m_cellSize + (startY - m_topRow) * cellHeight;
+		 i <= m_editor->size() && y < endY; ++y, yCoord += cellHeight) {
+		bool rowLoaded = true;
+		if (i < m_editor->size()) {
+			qint64 rowLength = qMin(readEnd, i + m_bytesPerLine) - i;
+			rowLoaded = m_editor->isLoaded(i, rowLength);
+			if (!rowLoaded) {
+				if (!loadRequested)
+					m_editor->load(i, readEnd - i);
+				loadRequested = true;
+				needsSeek = true;
+			} else if (needsSeek) {
+				m_cursor.seek(i);
+				span = BufferedEditor::Span();
+				spanIndex = 0;
+				needsSeek = false;
+			}
+		}
 
 		bool rowIsHovered = m_hoveredIndex == -1 ? false : m_hoveredIndex / 16 == y;
-		qint64 rowDisplayAddress = rowIsHovered ? m_hoveredIndex : m_editor->position();
+		qint64 rowDisplayAddress = rowIsHovered ? m_hoveredIndex : i;
 
 		painter.setPen(rowIsHovered ? textColor : alternateBackgroundColor);
 		painter.setBrush(y % 2 == 0 ? backgroundColor : alternateBackgroundColor);
@@ -493,13 +594,22 @@ void HexViewInternal::paintEvent(QPaintEvent *event)
 			}
 
 			bool editingLast = m_editingCell && selectionStart == m_editor->size();
-			if (!m_editor->atEnd() || editingLast) {
+			if (i < m_editor->size() || editingLast) {
 				bool isModified = false;
 				unsigned char byte;
-				if (!m_editor->atEnd()) {
-					BufferedEditor::Byte b = m_editor->getByte();
-					isModified = b.saved != b.current;
-					byte = static_cast<unsigned char>(*b.current);
+				if (i < m_editor->size() && !rowLoaded) {
+					cellText[0] = ' ';
+					cellText[1] = ' ';
+					ch[0] = ' ';
+				} else if (i < m_editor->size()) {
+					if (spanIndex == span.length) {
+						span = m_cursor.readSpan(readEnd - i);
+						spanIndex = 0;
+						if (span.length == 0)
+							break;
+					}
+					isModified = span.modified;
+					byte = static_cast<unsigned char>(span.data()[spanIndex++]);
 					cellText[0] = hexTable[(byte >> 4) & 0xF];
 					cellText[1] = hexTable[(byte >> 0) & 0xF];
 					ch[0] = (byte >= 32 && byte <= 126) ? char(byte) : '.';
@@ -637,21 +747,15 @@ void HexViewInternal::mousePressEvent(QMouseEvent *event)
 		} else if (a == &selectNoneAction) {
 			selectNone();
 		} else if (a == &insertBeforeAction) {
-			int count;
+			int insertCount;
 			quint8 value;
-			if (runGetNumberOfBytesToInsertDialog(this, count, value)) {
-				m_editor->seek(begin);
-				for (int i = 0; i < count; ++i)
-					m_editor->insertByte(value);
-			}
+			if (runGetNumberOfBytesToInsertDialog(this, insertCount, value))
+				m_editor->insertBytes(begin, insertCount, char(value));
 		} else if (a == &insertAfterAction) {
-			int count;
+			int insertCount;
 			quint8 value;
-			if (runGetNumberOfBytesToInsertDialog(this, count, value)) {
-				m_editor->seek(begin + count);
-				for (int i = 0; i < count; ++i)
-					m_editor->insertByte(value);
-			}
+			if (runGetNumberOfBytesToInsertDialog(this, insertCount, value))
+				m_editor->insertBytes(begin + count, insertCount, char(value));
 		}
 	} else {
 		m_selection.reset();
@@ -735,11 +839,7 @@ void HexViewInternal::keyPressEvent(QKeyEvent *event)
 				emit rowCountChanged();
 		} else {
 			ByteSelection normalizedSelection = *selection();
-			qint64 end = normalizedSelection.begin + normalizedSelection.count;
-			while (m_editor->position() < end) {
-				m_editor->replaceByte(m_editingCellByte);
-				m_editor->moveForward();
-			}
+			m_editor->fillRange(normalizedSelection.begin, normalizedSelection.count, m_editingCellByte);
 		}
 		m_editingCell = false;
 	};
@@ -789,11 +889,7 @@ void HexViewInternal::keyPressEvent(QKeyEvent *event)
 						emit rowCountChanged();
 				} else {
 					ByteSelection normalizedSelection = *selection();
-					qint64 end = normalizedSelection.begin + normalizedSelection.count;
-					while (m_editor->position() < end) {
-						m_editor->replaceByte(byte);
-						m_editor->moveForward();
-					}
+					m_editor->fillRange(normalizedSelection.begin, normalizedSelection.count, byte);
 				}
 				if (m_selection->count == 1) {
 					ByteSelection newSelection = *m_selection;
@@ -831,13 +927,10 @@ void HexViewInternal::keyPressEvent(QKeyEvent *event)
 		qint64 count = sel.count;
 		if (sel.begin + count == m_editor->size())
 			--count;
-		for (qint64 i = 0; i < count; ++i) {
-			qint64 prevRowCount = rowCount();
-			m_editor->seek(sel.begin);
-			m_editor->deleteByte();
-			if (prevRowCount != rowCount())
-				emit rowCountChanged();
-		}
+		qint64 prevRowCount = rowCount();
+		m_editor->deleteRange(sel.begin, count);
+		if (prevRowCount != rowCount())
+			emit rowCountChanged();
 		selectNone();
 		return;
 	}
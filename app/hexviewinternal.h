@@ -1,6 +1,7 @@
 #ifndef HEXVIEWINTERNAL_H
 #define HEXVIEWINTERNAL_H
 
+#include "bufferededitor.h"
 #include "common.h"
 
 #include <QWidget>
@@ -13,7 +14,6 @@
 
 #include <optional>
 
-class BufferedEditor;
 class GotoDialog;
 class FindWidget;
 
@@ -58,15 +58,19 @@ private slots:
 	void setTopRow(qint64 topRow);
 	bool openFile(const QString &path);
 	bool saveChanges();
+	void cancelSaving();
+	void onSaveFinished(bool success);
 	bool quit();
 	void undo();
 	void redo();
 	void openGotoDialog();
 	void openFindDialog();
 	void updateFindDialogPosition();
+	void updateRows(qint64 position, qint64 length);
 
 private:
 	void setSelection(ByteSelection selection);
+	bool writeChanges();
 
 protected:
 	void paintEvent(QPaintEvent *) override;
@@ -93,6 +97,9 @@ private:
 
 	QFile m_file;
 	BufferedEditor *m_editor;
+	// Where painting reads, so that scrolling on doesn't look it up again
+	BufferedEditor::Cursor m_cursor;
+	bool m_saveCancelled;
 	qint64 m_topRow;
 	double m_mouseScrollBuffer;
 	bool m_editingCell;
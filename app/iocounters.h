@@ -0,0 +1,32 @@
+#ifndef IOCOUNTERS_H
+#define IOCOUNTERS_H
+
+#include <QAtomicInteger>
+#include <QtGlobal>
+
+// Counts the reads and writes done on an open file. The workers that read
+// ahead or save in the background count into the same counters, so they
+// are atomic, and cheap enough to be updated on every call
+struct IoCounters
+{
+	QAtomicInteger<qint64> bytesRead;
+	QAtomicInteger<qint64> readCount;
+	QAtomicInteger<qint64> bytesWritten;
+	QAtomicInteger<qint64> writeCount;
+
+	IoCounters() : bytesRead(0), readCount(0), bytesWritten(0), writeCount(0) {}
+
+	void addRead(qint64 bytes)
+	{
+		bytesRead.fetchAndAddRelaxed(bytes);
+		readCount.fetchAndAddRelaxed(1);
+	}
+
+	void addWrite(qint64 bytes)
+	{
+		bytesWritten.fetchAndAddRelaxed(bytes);
+		writeCount.fetchAndAddRelaxed(1);
+	}
+};
+
+#endif // IOCOUNTERS_H
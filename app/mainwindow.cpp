@@ -2,6 +2,8 @@
 #include "hexview.h"
 #include "baseconverter.h"
 #include "bufferededitor.h"
+#include "common.h"
+#include "memorygovernor.h"
 
 #include <QMessageBox>
 #include <QMenuBar>
@@ -29,15 +31,24 @@ MainWindow::MainWindow(QWidget *parent)
 	, m_gotoAction(new QAction("&Go to"))
 	, m_findAction(new QAction("&Find"))
 	, m_baseConverterAction(new QAction("Base &Converter"))
+	, m_statisticsAction(new QAction("Show &Statistics"))
 	, m_baseConverter(new BaseConverter(this))
+	, m_memoryGovernor(new MemoryGovernor(MemoryGovernor::defaultBudget, this))
+	, m_memoryWarning(new QMessageBox(QMessageBox::Warning, "", "", QMessageBox::Ok, this))
+	, m_memoryWarningShown(false)
+	, m_journalWarning(new QMessageBox(QMessageBox::Warning, "", "", QMessageBox::Ok, this))
 {
 	setCentralWidget(m_tabWidget);
 	resize(640, 480);
 
 	m_baseConverter->hide();
+	m_memoryWarning->setModal(false);
+	m_journalWarning->setModal(false);
 
 	m_tabWidget->setTabsClosable(true);
 	connect(m_tabWidget, &QTabWidget::tabCloseRequested, this, &MainWindow::closeTab);
+	connect(m_tabWidget, &QTabWidget::currentChanged, this, &MainWindow::onCurrentTabChanged);
+	connect(m_memoryGovernor, &MemoryGovernor::pressureChanged, this, &MainWindow::onMemoryPressureChanged);
 
 	m_openAction->setShortcut(QKeySequence::Open);
 	m_saveAction->setShortcut(QKeySequence::Save);
@@ -46,6 +57,7 @@ MainWindow::MainWindow(QWidget *parent)
 	m_redoAction->setShortcut(QKeySequence::Redo);
 	m_gotoAction->setShortcut(QKeySequence(Qt::CTRL + Qt::Key_G));
 	m_findAction->setShortcut(QKeySequence::Find);
+	m_statisticsAction->setCheckable(true);
 
 	m_fileMenu->addAction(m_openAction);
 	m_fileMenu->addAction(m_saveAction);
@@ -64,6 +76,7 @@ MainWindow::MainWindow(QWidget *parent)
 	m_editMenu->addAction(m_findAction);
 
 	m_toolsMenu->addAction(m_baseConverterAction);
+	m_toolsMenu->addAction(m_statisticsAction);
 
 	menuBar()->addMenu(m_fileMenu);
 	menuBar()->addMenu(m_editMenu);
@@ -83,6 +96,7 @@ MainWindow::MainWindow(QWidget *parent)
 	connect(m_findAction, &QAction::triggered, this, &MainWindow::openFindDialog);
 
 	connect(m_baseConverterAction, &QAction::triggered, this, &MainWindow::openBaseConverter);
+	connect(m_statisticsAction, &QAction::toggled, this, &MainWindow::setStatisticsVisible);
 
 	onTabCountChanged();
 }
@@ -92,10 +106,18 @@ bool MainWindow::openFile(const QString &path)
 	HexView *tab = new HexView;
 	bool ok = tab->openFile(path);
 	if (ok) {
+		m_memoryGovernor->addEditor(tab->editor());
 		m_tabWidget->insertTab(m_tabWidget->count(), tab, path);
 		connect(tab, &HexView::canUndoChanged, this, &MainWindow::onCanUndoChanged);
 		connect(tab, &HexView::canRedoChanged, this, &MainWindow::onCanRedoChanged);
 		connect(tab, &HexView::selectionChanged, this, &MainWindow::onSelectionChanged);
+		// The journal fails again with every save, it's only told once
+		connect(tab->editor(), &BufferedEditor::journalFailed, this, [this, path, warned = false]() mutable {
+			if (!warned)
+				onJournalFailed(path);
+			warned = true;
+		});
+		tab->setStatisticsVisible(m_statisticsAction->isChecked());
 		m_tabWidget->setCurrentWidget(tab);
 		onTabCountChanged();
 	}
@@ -130,6 +152,7 @@ bool MainWindow::closeTab(int index)
 	if (!tab->quit())
 		return false;
 
+	m_memoryGovernor->removeEditor(tab->editor());
 	m_tabWidget->removeTab(index);
 	onTabCountChanged();
 	return true;
@@ -206,6 +229,15 @@ void MainWindow::openBaseConverter()
 	m_baseConverter->raise();
 }
 
+void MainWindow::setStatisticsVisible(bool visible)
+{
+	for (int i = 0; i < m_tabWidget->count(); ++i) {
+		HexView *tab = qobject_cast<HexView *>(m_tabWidget->widget(i));
+		Q_ASSERT(tab);
+		tab->setStatisticsVisible(visible);
+	}
+}
+
 
 void MainWindow::onTabCountChanged()
 {
@@ -219,6 +251,41 @@ void MainWindow::onTabCountChanged()
 	onSelectionChanged();
 }
 
+void MainWindow::onCurrentTabChanged()
+{
+	HexView *tab = qobject_cast<HexView *>(m_tabWidget->currentWidget());
+	// Only the tabs with an open file are managed
+	if (tab && m_memoryGovernor->editors().contains(tab->editor()))
+		m_memoryGovernor->setForeground(tab->editor());
+}
+
+// Warns once until the pressure is back to normal, without waiting for
+// the warning to be closed, since this is called in the middle of a rebalance
+void MainWindow::onMemoryPressureChanged(MemoryGovernor::Pressure pressure)
+{
+	if (pressure != MemoryGovernor::Pressure::Critical) {
+		m_memoryWarning->hide();
+		if (pressure == MemoryGovernor::Pressure::Normal)
+			m_memoryWarningShown = false;
+		return;
+	}
+	if (m_memoryWarningShown)
+		return;
+
+	m_memoryWarningShown = true;
+	m_memoryWarning->setText(QString("The open files use more than %1 of memory, mostly for unsaved changes. "
+									 "Saving or closing some of them frees it up.").arg(prettySize(m_memoryGovernor->budget())));
+	m_memoryWarning->show();
+}
+
+// Doesn't wait for the warning to be closed, the editing goes on
+void MainWindow::onJournalFailed(const QString &path)
+{
+	m_journalWarning->setText(QString("The changes to %1 can't be written to the journal, so they can't be "
+									  "restored after a crash.").arg(path));
+	m_journalWarning->show();
+}
+
 void MainWindow::onCanUndoChanged()
 {
 	if (m_tabWidget->count() == 0) {
@@ -252,10 +319,7 @@ void MainWindow::onSelectionChanged()
 		auto selection = tab->selection();
 		auto editor = tab->editor();
 		if (selection && selection->count <= 8 && selection->begin != editor->size()) {
-			editor->seek(selection->begin);
-			QByteArray bytes;
-			for (int i = 0; i < selection->count; ++i)
-				bytes.append(quint8(*(editor->getByte().current)));
+			QByteArray bytes = BufferedEditor::Cursor(editor, selection->begin).read(selection->count);
 			m_baseConverter->setFromBytes(bytes);
 		}
 	}
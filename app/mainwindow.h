@@ -1,9 +1,12 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include "memorygovernor.h"
+
 #include <QMainWindow>
 
 class BaseConverter;
+class QMessageBox;
 
 class QTabWidget;
 class QMenu;
@@ -31,9 +34,13 @@ public slots:
 	void openGotoDialog();
 	void openFindDialog();
 	void openBaseConverter();
+	void setStatisticsVisible(bool visible);
 
 private slots:
 	void onTabCountChanged();
+	void onCurrentTabChanged();
+	void onMemoryPressureChanged(MemoryGovernor::Pressure pressure);
+	void onJournalFailed(const QString &path);
 	void onCanUndoChanged();
 	void onCanRedoChanged();
 	void onSelectionChanged();
@@ -59,8 +66,14 @@ private:
 	QAction *m_findAction;
 
 	QAction *m_baseConverterAction;
+	QAction *m_statisticsAction;
 
 	BaseConverter *m_baseConverter;
+	// Shares one memory budget between the editors of all tabs
+	MemoryGovernor *m_memoryGovernor;
+	QMessageBox *m_memoryWarning;
+	bool m_memoryWarningShown;
+	QMessageBox *m_journalWarning;
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,121 @@
+#include "memorygovernor.h"
+#include "bufferededitor.h"
+
+#include <QTimer>
+
+MemoryGovernor::MemoryGovernor(qint64 budget, QObject *parent)
+	: QObject(parent)
+	, m_budget(budget)
+	, m_usage(0)
+	, m_pressure(Pressure::Normal)
+	, m_timer(new QTimer(this))
+{
+	m_timer->setInterval(rebalanceInterval);
+	connect(m_timer, &QTimer::timeout, this, &MemoryGovernor::rebalance);
+}
+
+qint64 MemoryGovernor::budget() const
+{
+	return m_budget;
+}
+
+void MemoryGovernor::setBudget(qint64 bytes)
+{
+	m_budget = bytes;
+	rebalance();
+}
+
+void MemoryGovernor::addEditor(BufferedEditor *editor)
+{
+	Q_ASSERT(!m_editors.contains(editor));
+	// A new editor is opened to be worked on
+	m_editors.append(editor);
+	if (!m_timer->isActive())
+		m_timer->start();
+	rebalance();
+}
+
+void MemoryGovernor::removeEditor(BufferedEditor *editor)
+{
+	m_editors.removeOne(editor);
+	if (m_editors.isEmpty())
+		m_timer->stop();
+	rebalance();
+}
+
+QVector<BufferedEditor *> MemoryGovernor::editors() const
+{
+	return m_editors;
+}
+
+BufferedEditor *MemoryGovernor::foreground() const
+{
+	return m_editors.isEmpty() ? nullptr : m_editors.last();
+}
+
+void MemoryGovernor::setForeground(BufferedEditor *editor)
+{
+	int index = m_editors.indexOf(editor);
+	Q_ASSERT(index != -1);
+	if (index == m_editors.size() - 1)
+		return;
+	m_editors.append(m_editors.takeAt(index));
+	rebalance();
+}
+
+qint64 MemoryGovernor::usage() const
+{
+	return m_usage;
+}
+
+MemoryGovernor::Pressure MemoryGovernor::pressure() const
+{
+	return m_pressure;
+}
+
+void MemoryGovernor::rebalance()
+{
+	Pressure pressure = Pressure::Normal;
+	int backgroundCount = m_editors.size() - 1;
+	QVector<qint64> usages(m_editors.size());
+
+	// The editors in the background keep what they have, but don't get more
+	qint64 backgroundBudget = 0;
+	for (int i = 0; i < backgroundCount; ++i) {
+		usages[i] = m_editors[i]->statistics().residentBytes;
+		backgroundBudget += qMax(usages[i], qint64(minimumEditorBudget));
+	}
+
+	// Until the one in front has half of the budget to itself. Giving up
+	// memory leaves an editor with its modified sections only
+	for (int i = 0; i < backgroundCount && m_budget - backgroundBudget < m_budget / 2; ++i) {
+		if (usages[i] <= minimumEditorBudget)
+			continue;
+		m_editors[i]->setMemoryBudget(minimumEditorBudget);
+		backgroundBudget -= usages[i];
+		usages[i] = m_editors[i]->statistics().residentBytes;
+		backgroundBudget += qMax(usages[i], qint64(minimumEditorBudget));
+	}
+	if (m_budget - backgroundBudget < m_budget / 2)
+		pressure = Pressure::High;
+	for (int i = 0; i < backgroundCount; ++i)
+		m_editors[i]->setMemoryBudget(qMax(usages[i], qint64(minimumEditorBudget)));
+
+	// The one in front gets the rest
+	if (!m_editors.isEmpty()) {
+		BufferedEditor *editor = m_editors.last();
+		editor->setMemoryBudget(qMax(m_budget - backgroundBudget, qint64(minimumEditorBudget)));
+		usages.last() = editor->statistics().residentBytes;
+	}
+
+	m_usage = 0;
+	for (qint64 usage : usages)
+		m_usage += usage;
+	if (m_usage > m_budget)
+		pressure = Pressure::Critical;
+
+	if (pressure != m_pressure) {
+		m_pressure = pressure;
+		emit pressureChanged(pressure);
+	}
+}
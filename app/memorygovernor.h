@@ -0,0 +1,69 @@
+#ifndef MEMORYGOVERNOR_H
+#define MEMORYGOVERNOR_H
+
+#include <QObject>
+#include <QVector>
+
+class BufferedEditor;
+class QTimer;
+
+// Shares one memory budget between all of the open editors. The editor in
+// front gets what the others don't use. When that's less than half of the
+// budget, the editors in the background give up their unmodified sections,
+// the one that was in front longest ago first. Modified bytes can't be
+// given up, so the editors can still use more than the budget together,
+// which is reported as pressure
+class MemoryGovernor : public QObject
+{
+	Q_OBJECT
+public:
+	enum class Pressure
+	{
+		Normal,
+		// The editors in the background hold more than half of the
+		// budget, even with only their modified sections loaded
+		High,
+		// The editors use more than the budget together
+		Critical
+	};
+
+	static const qint64 defaultBudget = 1024 * 1024 * 1024;
+	// Every editor keeps at least this much, so that it can still be read
+	static const qint64 minimumEditorBudget = 4 * 1024 * 1024;
+
+	explicit MemoryGovernor(qint64 budget = defaultBudget, QObject *parent = nullptr);
+	qint64 budget() const;
+	void setBudget(qint64 bytes);
+	// The governor sets the memory budget of the editors it manages.
+	// An editor has to be removed before it is destroyed
+	void addEditor(BufferedEditor *editor);
+	void removeEditor(BufferedEditor *editor);
+	QVector<BufferedEditor *> editors() const;
+	// The editor being worked on, the last one to give up memory
+	BufferedEditor *foreground() const;
+	void setForeground(BufferedEditor *editor);
+	// The memory used by all of the editors when they were last balanced
+	qint64 usage() const;
+	Pressure pressure() const;
+
+public slots:
+	// Hands out the budget again. Done on every change and periodically,
+	// since the editors load and modify bytes in the meantime
+	void rebalance();
+
+signals:
+	void pressureChanged(MemoryGovernor::Pressure pressure);
+
+private:
+	// How often the budget is handed out again, in milliseconds
+	static const int rebalanceInterval = 1000;
+
+	qint64 m_budget;
+	// Ordered by when they were last in front, the foreground is the last
+	QVector<BufferedEditor *> m_editors;
+	qint64 m_usage;
+	Pressure m_pressure;
+	QTimer *m_timer;
+};
+
+#endif // MEMORYGOVERNOR_H
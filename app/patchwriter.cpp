@@ -0,0 +1,118 @@
+#include "patchwriter.h"
+#include "iocounters.h"
+
+#include <QFileDevice>
+
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+#endif
+
+PatchWriter::PatchWriter(QFileDevice *device, IoCounters *counters)
+	: m_device(device)
+	, m_counters(counters)
+{
+}
+
+void PatchWriter::addPatch(qint64 position, const QByteArray &bytes)
+{
+	if (bytes.isEmpty())
+		return;
+	Q_ASSERT(m_patches.isEmpty() ||
+			 position >= m_patches.last().position + m_patches.last().bytes.size());
+	m_patches.append({position, bytes});
+}
+
+int PatchWriter::patchCount() const
+{
+	return m_patches.size();
+}
+
+bool PatchWriter::run()
+{
+	if (m_patches.isEmpty())
+		return true;
+
+	// Whatever the device buffered has to reach the file first
+	if (!m_device->flush())
+		return false;
+
+	int first = 0;
+	qint64 end = m_patches.first().position;
+	for (int i = 0; i < m_patches.size(); ++i) {
+		const Patch &patch = m_patches[i];
+		if (patch.position != end || i - first == maximumBatchSize) {
+			if (!write(first, i - first))
+				return false;
+			first = i;
+		}
+		end = patch.position + patch.bytes.size();
+	}
+	if (!write(first, m_patches.size() - first))
+		return false;
+
+	m_patches.clear();
+	return true;
+}
+
+// Writes `count` patches that follow each other in the file
+bool PatchWriter::write(int first, int count)
+{
+	qint64 position = m_patches[first].position;
+
+#ifdef Q_OS_UNIX
+	int fd = m_device->handle();
+	if (fd != -1) {
+		QVector<iovec> vectors(count);
+		for (int i = 0; i < count; ++i) {
+			const QByteArray &bytes = m_patches[first + i].bytes;
+			vectors[i].iov_base = const_cast<char *>(bytes.constData());
+			vectors[i].iov_len = size_t(bytes.size());
+		}
+
+		iovec *vector = vectors.data();
+		while (count > 0) {
+			ssize_t bytesWritten = pwritev(fd, vector, count, position);
+			if (bytesWritten < 0) {
+				qCritical() << "PatchWriter: Failed to write to file:" << strerror(errno);
+				return false;
+			}
+			position += bytesWritten;
+			if (m_counters)
+				m_counters->addWrite(bytesWritten);
+
+			// Continue after a short write where it stopped
+			while (count > 0 && size_t(bytesWritten) >= vector->iov_len) {
+				bytesWritten -= ssize_t(vector->iov_len);
+				++vector;
+				--count;
+			}
+			if (count > 0) {
+				vector->iov_base = static_cast<char *>(vector->iov_base) + bytesWritten;
+				vector->iov_len -= size_t(bytesWritten);
+			}
+		}
+		return true;
+	}
+#endif
+
+	if (!m_device->seek(position)) {
+		qCritical() << "PatchWriter: Failed to seek in file:" << m_device->errorString();
+		return false;
+	}
+	for (int i = first; i < first + count; ++i) {
+		const QByteArray &bytes = m_patches[i].bytes;
+		qint64 bytesWritten = m_device->write(bytes.constData(), bytes.size());
+		if (bytesWritten == -1) {
+			qCritical() << "PatchWriter: Failed to write to file:" << m_device->errorString();
+			return false;
+		}
+		Q_ASSERT(bytesWritten == bytes.size());
+		if (m_counters)
+			m_counters->addWrite(bytesWritten);
+	}
+	return true;
+}
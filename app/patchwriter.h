@@ -0,0 +1,42 @@
+#ifndef PATCHWRITER_H
+#define PATCHWRITER_H
+
+#include <QByteArray>
+#include <QVector>
+#include <QtGlobal>
+
+class QFileDevice;
+struct IoCounters;
+
+// Writes many short ranges of a file at once. The patches that follow
+// each other in the file are written with a single vectored write
+class PatchWriter
+{
+public:
+	explicit PatchWriter(QFileDevice *device, IoCounters *counters = nullptr);
+
+	// Queues `bytes` to be written at `position`. The patches have to be
+	// added in the order of their positions and must not overlap
+	void addPatch(qint64 position, const QByteArray &bytes);
+	int patchCount() const;
+	// Writes all of the queued patches
+	bool run();
+
+private:
+	// The most patches that are written by a single call
+	static const int maximumBatchSize = 1024;
+
+	struct Patch
+	{
+		qint64 position;
+		QByteArray bytes;
+	};
+
+	QFileDevice *m_device;
+	IoCounters *m_counters;
+	QVector<Patch> m_patches;
+
+	bool write(int first, int count);
+};
+
+#endif // PATCHWRITER_H
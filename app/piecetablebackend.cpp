@@ -0,0 +1,981 @@
+#include "piecetablebackend.h"
+#include "filemover.h"
+#include "iocounters.h"
+#include "patchwriter.h"
+#include "sparsefile.h"
+#include "spillfile.h"
+
+#include <QFileDevice>
+
+#include <QDebug>
+
+PieceTableBackend::PieceTableBackend(QFileDevice *device, SpillFile *spill, IoCounters *counters)
+	: m_device(device)
+	, m_spill(spill)
+	, m_counters(counters)
+	, m_source(device, counters)
+	, m_root(-1)
+	, m_seed(2463534242u)
+	, m_addSize(0)
+	, m_originalSize(0)
+	, m_cacheSource(Piece::Source::Original)
+	, m_cachePosition(0)
+	, m_position(0)
+	, m_size(device->size())
+	, m_node(-1)
+	, m_nodePosition(0)
+	, m_layout(1)
+	, m_currentModificationIndex(0)
+	, m_modificationCount(0)
+	, m_transactionLength(-1)
+	, m_historyMemoryUsage(0)
+	, m_historyLimit(0)
+{
+	reset();
+}
+
+bool PieceTableBackend::seek(qint64 position)
+{
+	if (position < 0 || position > m_size)
+		return false;
+
+	m_position = position;
+	m_node = -1;
+	if (position == m_size)
+		return true;
+
+	m_node = findNode(position, m_nodePosition);
+	Q_ASSERT(m_node != -1);
+
+	// Make sure that the byte can actually be read
+	const Piece &piece = m_nodes[m_node].piece;
+	char byte;
+	if (piece.source == Piece::Source::Original || piece.source == Piece::Source::Spill)
+		return readStored(piece.source, piece.offset + position - m_nodePosition, byte);
+
+	return true;
+}
+
+qint64 PieceTableBackend::position() const
+{
+	return m_position;
+}
+
+qint64 PieceTableBackend::size() const
+{
+	return m_size;
+}
+
+void PieceTableBackend::moveForward()
+{
+	if (m_position == m_size)
+		return;
+
+	++m_position;
+	if (m_node != -1 && m_position >= m_nodePosition + m_nodes[m_node].piece.length)
+		m_node = -1;
+}
+
+PieceTableBackend::Byte PieceTableBackend::getByte()
+{
+	Q_ASSERT(m_position < m_size);
+	if (m_node == -1)
+		m_node = findNode(m_position, m_nodePosition);
+
+	const Piece &piece = m_nodes[m_node].piece;
+	char byte = pieceByte(piece, m_position - m_nodePosition);
+	bool original = piece.source == Piece::Source::Original;
+	moveForward();
+
+	return original ? Byte(byte, byte) : Byte(std::optional<char>(), byte);
+}
+
+PieceTableBackend::Span PieceTableBackend::readSpan(qint64 maxLength)
+{
+	Span span;
+	if (m_position == m_size || maxLength <= 0)
+		return span;
+
+	if (m_node == -1)
+		m_node = findNode(m_position, m_nodePosition);
+
+	const Piece &piece = m_nodes[m_node].piece;
+	qint64 index = m_position - m_nodePosition;
+	qint64 length = qMin(piece.length - index, maxLength);
+	if (piece.source == Piece::Source::Added) {
+		// A span doesn't reach past the end of its block
+		qint64 offset = piece.offset + index;
+		span.block = m_addBlocks[int(offset / addBlockSize)];
+		span.offset = int(offset % addBlockSize);
+		span.modified = true;
+		length = qMin(length, qint64(addBlockSize - span.offset));
+	} else if (piece.source == Piece::Source::Pattern) {
+		const Pattern &pattern = m_patterns[piece.pattern];
+		span.block = pattern.block;
+		span.offset = pattern.blockOffset(piece.offset + index);
+		span.modified = true;
+		span.patternSize = pattern.size;
+		length = qMin(length, qint64(patternBlockSize));
+	} else {
+		qint64 offset = piece.offset + index;
+		qint64 hole = piece.source == Piece::Source::Original ? m_source.holeLength(offset, length) : 0;
+		if (hole > 0) {
+			// The zeros of a hole don't have to be read
+			if (m_zeroBlock.isEmpty())
+				m_zeroBlock = QByteArray(patternBlockSize, char(0));
+			span.block = m_zeroBlock;
+			span.offset = 0;
+			span.patternSize = 1;
+			length = qMin(hole, qint64(patternBlockSize));
+		} else {
+			// Original and spilled bytes can only be served from the read cache
+			char byte;
+			if (!readStored(piece.source, offset, byte))
+				return span;
+			span.block = m_cache;
+			span.offset = int(offset - m_cachePosition);
+			span.modified = piece.source == Piece::Source::Spill;
+			length = qMin(length, m_cachePosition + m_cache.size() - offset);
+		}
+	}
+	span.length = int(length);
+
+	m_position += length;
+	if (m_position >= m_nodePosition + piece.length)
+		m_node = -1;
+
+	return span;
+}
+
+PieceTableBackend::CursorState PieceTableBackend::cursorState() const
+{
+	CursorState state;
+	state.position = m_position;
+	state.index = m_node;
+	state.offset = m_nodePosition;
+	state.layout = m_layout;
+	return state;
+}
+
+void PieceTableBackend::setCursorState(const CursorState &state)
+{
+	if (state.layout == m_layout) {
+		m_position = state.position;
+		m_node = int(state.index);
+		m_nodePosition = state.offset;
+		return;
+	}
+
+	// The node is looked up again when the cursor reads
+	m_position = qMin(state.position, m_size);
+	m_node = -1;
+}
+
+bool PieceTableBackend::isLoaded(qint64 position, qint64 length)
+{
+	for (const auto &range : originalRanges(position, length))
+		if (!m_source.isResident(range.first, range.second))
+			return false;
+	return true;
+}
+
+void PieceTableBackend::load(qint64 position, qint64 length)
+{
+	for (const auto &range : originalRanges(position, length))
+		m_source.prefetch(range.first, range.second);
+}
+
+void PieceTableBackend::insertBytes(qint64 position, const QByteArray &bytes)
+{
+	replacePieces(position, 0, {addBytes(bytes)});
+}
+
+void PieceTableBackend::insertPattern(qint64 position, qint64 length, const QByteArray &pattern)
+{
+	replacePieces(position, 0, {patternPiece(pattern, length)});
+}
+
+void PieceTableBackend::deleteRange(qint64 position, qint64 length)
+{
+	replacePieces(position, length, {});
+}
+
+void PieceTableBackend::replaceRange(qint64 position, const QByteArray &bytes)
+{
+	replacePieces(position, bytes.size(), {addBytes(bytes)});
+}
+
+void PieceTableBackend::fillRange(qint64 position, qint64 length, char value)
+{
+	replacePieces(position, length, {patternPiece(QByteArray(1, value), length)});
+}
+
+bool PieceTableBackend::writeChanges()
+{
+	QVector<Piece> pieces;
+	collectPieces(m_root, pieces);
+
+	// The undo history may refer to parts of the file that are about
+	// to be overwritten, so they're copied to the spill file first
+	for (Modification &m : m_modifications) {
+		m_historyMemoryUsage -= m.memoryUsage();
+		bool spilled = spillPieces(m.removed) && spillPieces(m.inserted);
+		m_historyMemoryUsage += m.memoryUsage();
+		if (!spilled)
+			return false;
+	}
+
+	// The file is about to change under the mapping
+	m_cache.clear();
+	m_source.unmap();
+
+	// Increase the file size if needed
+	if (m_device->size() < m_size)
+		if (!m_device->resize(m_size))
+			return false;
+
+	FileMover mover(m_device, m_counters);
+	addMoves(mover, pieces);
+
+	qDebug() << mover.moveCount() << "pieces have to be moved";
+	if (!mover.run())
+		return false;
+
+	// Write the inserted bytes, the ones that follow each other at once
+	PatchWriter patches(m_device, m_counters);
+	qint64 position = 0;
+	for (const Piece &piece : pieces) {
+		// A patch doesn't reach past the end of its block
+		for (qint64 index = 0; piece.source == Piece::Source::Added && index < piece.length;) {
+			qint64 offset = piece.offset + index;
+			int blockOffset = int(offset % addBlockSize);
+			int length = int(qMin(piece.length - index, qint64(addBlockSize - blockOffset)));
+			const QByteArray &block = m_addBlocks[int(offset / addBlockSize)];
+			patches.addPatch(position + index, QByteArray::fromRawData(block.constData() + blockOffset, length));
+			index += length;
+		}
+		position += piece.length;
+	}
+
+	qDebug() << patches.patchCount() << "inserted ranges have to be written";
+	if (!patches.run())
+		return false;
+
+	// Generate the patterns
+	position = 0;
+	for (const Piece &piece : pieces) {
+		if (piece.source == Piece::Source::Pattern) {
+			// A pattern of zeros can be a hole instead
+			const Pattern &pattern = m_patterns[piece.pattern];
+			if (isZero(pattern.block.constData(), pattern.size) && punchHole(m_device, position, piece.length)) {
+				position += piece.length;
+				continue;
+			}
+			if (!m_device->seek(position)) {
+				qCritical() << "PieceTableBackend: Failed to seek in file:" << m_device->errorString();
+				return false;
+			}
+		}
+		for (qint64 index = 0; piece.source == Piece::Source::Pattern && index < piece.length;) {
+			const Pattern &pattern = m_patterns[piece.pattern];
+			const char *data = pattern.block.constData() + pattern.blockOffset(piece.offset + index);
+			qint64 length = qMin(piece.length - index, qint64(patternBlockSize));
+			qint64 bytesWritten = m_device->write(data, length);
+			if (bytesWritten == -1) {
+				qCritical() << "PieceTableBackend: Failed to write to file:" << m_device->errorString();
+				return false;
+			}
+			Q_ASSERT(bytesWritten == length);
+			if (m_counters)
+				m_counters->addWrite(bytesWritten);
+			index += length;
+		}
+		position += piece.length;
+	}
+
+	// Copy back what undoing brought back from the spill file
+	position = 0;
+	for (const Piece &piece : pieces) {
+		if (piece.source == Piece::Source::Spill && !writeSpilled(piece, position))
+			return false;
+		position += piece.length;
+	}
+
+	if (m_device->size() > m_size)
+		if (!m_device->resize(m_size))
+			return false;
+
+	m_device->flush();
+
+	// The file now contains exactly what the pieces described. The undo
+	// history doesn't refer to the file anymore, so it stays valid
+	reset();
+	m_modificationCount = 0;
+	// The saved state has to be reachable by undoing
+	if (m_transactionLength > 0)
+		m_transactionLength = 0;
+
+	return true;
+}
+
+qint64 PieceTableBackend::shiftVolume()
+{
+	QVector<Piece> pieces;
+	collectPieces(m_root, pieces);
+	FileMover mover(m_device, m_counters);
+	addMoves(mover, pieces);
+	return mover.copyLength();
+}
+
+QVector<Snapshot::Part> PieceTableBackend::contents()
+{
+	// The parts share the blocks of the add buffer, edits made later
+	// detach the last one
+	QVector<Piece> pieces;
+	collectPieces(m_root, pieces);
+	QVector<Snapshot::Part> parts;
+	for (const Piece &piece : pieces) {
+		if (piece.source == Piece::Source::Original) {
+			Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::File, QByteArray(), piece.offset, piece.length));
+		} else if (piece.source == Piece::Source::Spill) {
+			Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::Spill, QByteArray(), piece.offset, piece.length));
+		} else if (piece.source == Piece::Source::Added) {
+			for (qint64 index = 0; index < piece.length;) {
+				qint64 offset = piece.offset + index;
+				int blockOffset = int(offset % addBlockSize);
+				qint64 length = qMin(piece.length - index, qint64(addBlockSize - blockOffset));
+				Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::Memory, m_addBlocks[int(offset / addBlockSize)],
+														blockOffset, length));
+				index += length;
+			}
+		} else {
+			const Pattern &pattern = m_patterns[piece.pattern];
+			Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::Pattern, pattern.block,
+													piece.offset, piece.length, pattern.size));
+		}
+	}
+	return parts;
+}
+
+bool PieceTableBackend::releaseFile()
+{
+	// The file is about to be replaced, so the history can't refer to it
+	for (Modification &m : m_modifications) {
+		m_historyMemoryUsage -= m.memoryUsage();
+		bool spilled = spillPieces(m.removed) && spillPieces(m.inserted);
+		m_historyMemoryUsage += m.memoryUsage();
+		if (!spilled)
+			return false;
+	}
+
+	m_cache.clear();
+	m_source.unmap();
+	return true;
+}
+
+void PieceTableBackend::setSaved()
+{
+	m_source.unmap();
+	reset();
+	m_modificationCount = 0;
+	// The saved state has to be reachable by undoing
+	if (m_transactionLength > 0)
+		m_transactionLength = 0;
+}
+
+bool PieceTableBackend::isModified() const
+{
+	return m_modificationCount != 0;
+}
+
+bool PieceTableBackend::canUndo() const
+{
+	return m_currentModificationIndex > 0;
+}
+
+bool PieceTableBackend::canRedo() const
+{
+	return m_currentModificationIndex < m_modifications.size();
+}
+
+bool PieceTableBackend::undo()
+{
+	if (!canUndo())
+		return false;
+
+	// Undo every part of the edit
+	bool joined;
+	do {
+		Modification &m = m_modifications[m_currentModificationIndex - 1];
+		joined = m.joined;
+		undoModification(m);
+		--m_currentModificationIndex;
+	} while (joined);
+	m_position = qMin(m_position, m_size);
+	return true;
+}
+
+bool PieceTableBackend::redo()
+{
+	if (!canRedo())
+		return false;
+
+	do {
+		doModification(m_modifications[m_currentModificationIndex]);
+		++m_currentModificationIndex;
+	} while (canRedo() && m_modifications[m_currentModificationIndex].joined);
+	m_position = qMin(m_position, m_size);
+	return true;
+}
+
+void PieceTableBackend::beginTransaction()
+{
+	m_transactionLength = 0;
+}
+
+void PieceTableBackend::endTransaction()
+{
+	m_transactionLength = -1;
+	trimHistory();
+}
+
+void PieceTableBackend::setHistoryLimit(qint64 bytes)
+{
+	m_historyLimit = bytes;
+	trimHistory();
+}
+
+void PieceTableBackend::setMemoryBudget(qint64 bytes)
+{
+	// Nothing of the file is kept in memory except for the
+	// read cache, so there is nothing to limit
+	Q_UNUSED(bytes);
+}
+
+void PieceTableBackend::setStoragePolicy(const StoragePolicy &policy)
+{
+	m_policy = policy;
+}
+
+PieceTableBackend::Statistics PieceTableBackend::statistics() const
+{
+	// Only the read cache holds a part of the file, the rest is what
+	// was inserted
+	Statistics statistics;
+	statistics.residentSections = m_cache.isEmpty() ? 0 : 1;
+	statistics.residentBytes = m_cache.size() + m_addSize;
+	for (const Pattern &pattern : m_patterns)
+		statistics.residentBytes += pattern.block.size();
+	statistics.undoEntries = m_modifications.size();
+	statistics.undoMemory = m_historyMemoryUsage;
+	return statistics;
+}
+
+void PieceTableBackend::reset()
+{
+	m_nodes.clear();
+	m_freeNodes.clear();
+	m_cache.clear();
+	m_cachePosition = 0;
+	m_originalSize = m_size;
+	m_root = m_size > 0 ? createNode(Piece(Piece::Source::Original, 0, m_size)) : -1;
+	m_node = -1;
+	++m_layout;
+}
+
+int PieceTableBackend::createNode(Piece piece)
+{
+	// xorshift32
+	m_seed ^= m_seed << 13;
+	m_seed ^= m_seed >> 17;
+	m_seed ^= m_seed << 5;
+
+	Node node;
+	node.piece = piece;
+	node.length = piece.length;
+	node.priority = m_seed;
+	node.left = -1;
+	node.right = -1;
+
+	if (!m_freeNodes.isEmpty()) {
+		int index = m_freeNodes.takeLast();
+		m_nodes[index] = node;
+		return index;
+	}
+
+	m_nodes.append(node);
+	return m_nodes.size() - 1;
+}
+
+void PieceTableBackend::freeNode(int node)
+{
+	m_freeNodes.append(node);
+}
+
+qint64 PieceTableBackend::subtreeLength(int node) const
+{
+	return node == -1 ? 0 : m_nodes[node].length;
+}
+
+void PieceTableBackend::update(int node)
+{
+	Node &n = m_nodes[node];
+	n.length = subtreeLength(n.left) + n.piece.length + subtreeLength(n.right);
+}
+
+int PieceTableBackend::merge(int left, int right)
+{
+	if (left == -1)
+		return right;
+	if (right == -1)
+		return left;
+
+	if (m_nodes[left].priority > m_nodes[right].priority) {
+		int r = merge(m_nodes[left].right, right);
+		m_nodes[left].right = r;
+		update(left);
+		return left;
+	} else {
+		int l = merge(left, m_nodes[right].left);
+		m_nodes[right].left = l;
+		update(right);
+		return right;
+	}
+}
+
+void PieceTableBackend::split(int node, qint64 position, int &left, int &right)
+{
+	if (node == -1) {
+		left = right = -1;
+		return;
+	}
+
+	qint64 leftLength = subtreeLength(m_nodes[node].left);
+	qint64 pieceLength = m_nodes[node].piece.length;
+
+	if (position <= leftLength) {
+		int l, r;
+		split(m_nodes[node].left, position, l, r);
+		m_nodes[node].left = r;
+		update(node);
+		left = l;
+		right = node;
+	} else if (position >= leftLength + pieceLength) {
+		int l, r;
+		split(m_nodes[node].right, position - leftLength - pieceLength, l, r);
+		m_nodes[node].right = l;
+		update(node);
+		left = node;
+		right = r;
+	} else {
+		// The split position is inside this node's piece, so cut it in two
+		qint64 offset = position - leftLength;
+		Piece tail = m_nodes[node].piece;
+		tail.offset += offset;
+		tail.length -= offset;
+		int tailNode = createNode(tail);
+
+		int r = m_nodes[node].right;
+		m_nodes[node].piece.length = offset;
+		m_nodes[node].right = -1;
+		update(node);
+		left = node;
+		right = merge(tailNode, r);
+	}
+}
+
+int PieceTableBackend::rightmostNode(int node) const
+{
+	if (node == -1)
+		return -1;
+	while (m_nodes[node].right != -1)
+		node = m_nodes[node].right;
+	return node;
+}
+
+void PieceTableBackend::extendRightmostPiece(int node, qint64 length)
+{
+	if (m_nodes[node].right != -1)
+		extendRightmostPiece(m_nodes[node].right, length);
+	else
+		m_nodes[node].piece.length += length;
+	update(node);
+}
+
+void PieceTableBackend::freeSubtree(int node)
+{
+	if (node == -1)
+		return;
+	freeSubtree(m_nodes[node].left);
+	freeSubtree(m_nodes[node].right);
+	freeNode(node);
+}
+
+int PieceTableBackend::findNode(qint64 position, qint64 &nodePosition) const
+{
+	int node = m_root;
+	qint64 start = 0;
+	while (node != -1) {
+		const Node &n = m_nodes[node];
+		qint64 leftLength = subtreeLength(n.left);
+		if (position < start + leftLength) {
+			node = n.left;
+		} else if (position < start + leftLength + n.piece.length) {
+			nodePosition = start + leftLength;
+			return node;
+		} else {
+			start += leftLength + n.piece.length;
+			node = n.right;
+		}
+	}
+	return -1;
+}
+
+void PieceTableBackend::collectPieces(int node, QVector<Piece> &pieces) const
+{
+	if (node == -1)
+		return;
+	collectPieces(m_nodes[node].left, pieces);
+	pieces.append(m_nodes[node].piece);
+	collectPieces(m_nodes[node].right, pieces);
+}
+
+// The ranges of the original file that the read cache is filled from
+// when the bytes in the range are read, except for the cached one
+QVector<QPair<qint64, qint64>> PieceTableBackend::originalRanges(qint64 position, qint64 length) const
+{
+	QVector<QPair<qint64, qint64>> ranges;
+	qint64 end = qMin(position + length, m_size);
+	while (position < end) {
+		qint64 nodePosition;
+		const Piece &piece = m_nodes[findNode(position, nodePosition)].piece;
+		qint64 pieceEnd = qMin(end, nodePosition + piece.length);
+		if (piece.source == Piece::Source::Original) {
+			qint64 offset = piece.offset + position - nodePosition;
+			qint64 offsetEnd = piece.offset + pieceEnd - nodePosition;
+			if (m_cacheSource != Piece::Source::Original || offset < m_cachePosition ||
+					offsetEnd > m_cachePosition + m_cache.size()) {
+				qint64 start = m_policy.alignDown(offset);
+				qint64 chunkEnd = qMin(m_originalSize, m_policy.alignDown(offsetEnd - 1) + m_policy.sectionSize());
+				ranges.append(qMakePair(start, chunkEnd - start));
+			}
+		}
+		position = pieceEnd;
+	}
+	return ranges;
+}
+
+// Reads a byte of the original or of the spill file through the read cache
+bool PieceTableBackend::readStored(Piece::Source source, qint64 offset, char &byte)
+{
+	if (source != m_cacheSource || offset < m_cachePosition || offset >= m_cachePosition + m_cache.size()) {
+		qint64 cachePosition = m_policy.alignDown(offset);
+		if (source == Piece::Source::Original) {
+			int length = int(qMin(qint64(m_policy.sectionSize()), m_originalSize - cachePosition));
+			if (!m_source.read(cachePosition, length, m_cache))
+				return false;
+			m_policy.recordRead(cachePosition, length);
+		} else {
+			int length = int(qMin(qint64(m_policy.sectionSize()), m_spill->size() - cachePosition));
+			if (!m_spill->read(cachePosition, length, m_cache))
+				return false;
+		}
+		m_cacheSource = source;
+		m_cachePosition = cachePosition;
+	}
+
+	byte = m_cache[int(offset - m_cachePosition)];
+	return true;
+}
+
+char PieceTableBackend::pieceByte(const Piece &piece, qint64 index)
+{
+	if (piece.source == Piece::Source::Added) {
+		qint64 offset = piece.offset + index;
+		return m_addBlocks[int(offset / addBlockSize)][int(offset % addBlockSize)];
+	}
+	if (piece.source == Piece::Source::Pattern) {
+		const Pattern &pattern = m_patterns[piece.pattern];
+		return pattern.block[pattern.blockOffset(piece.offset + index)];
+	}
+
+	char byte = 0;
+	readStored(piece.source, piece.offset + index, byte);
+	return byte;
+}
+
+PieceTableBackend::Piece PieceTableBackend::addBytes(const QByteArray &bytes)
+{
+	Piece piece(Piece::Source::Added, m_addSize, bytes.size());
+	for (int index = 0; index < bytes.size();) {
+		if (m_addBlocks.isEmpty() || m_addBlocks.last().size() == addBlockSize) {
+			m_addBlocks.append(QByteArray());
+			m_addBlocks.last().reserve(addBlockSize);
+		}
+		QByteArray &block = m_addBlocks.last();
+		int count = qMin(bytes.size() - index, addBlockSize - block.size());
+		block.append(bytes.constData() + index, count);
+		index += count;
+	}
+	m_addSize += bytes.size();
+	return piece;
+}
+
+// Patterns are never removed, so that the history can refer to them.
+// Equal patterns are only stored once
+PieceTableBackend::Piece PieceTableBackend::patternPiece(const QByteArray &pattern, qint64 length)
+{
+	int index = m_patternIndices.value(pattern, -1);
+	if (index == -1) {
+		Pattern p;
+		p.size = pattern.size();
+		p.block.reserve(pattern.size() + patternBlockSize);
+		while (p.block.size() < pattern.size() + patternBlockSize)
+			p.block.append(pattern);
+
+		index = m_patterns.size();
+		m_patterns.append(p);
+		m_patternIndices.insert(pattern, index);
+	}
+	return Piece(Piece::Source::Pattern, 0, length, index);
+}
+
+QVector<PieceTableBackend::Piece> PieceTableBackend::takePieces(qint64 position, qint64 length)
+{
+	int left, middle, right;
+	split(m_root, position, left, right);
+	split(right, length, middle, right);
+
+	QVector<Piece> pieces;
+	collectPieces(middle, pieces);
+	freeSubtree(middle);
+
+	m_root = merge(left, right);
+	m_size -= length;
+	m_node = -1;
+	++m_layout;
+	return pieces;
+}
+
+void PieceTableBackend::insertPieces(qint64 position, const QVector<Piece> &pieces)
+{
+	int left, right;
+	split(m_root, position, left, right);
+
+	for (const Piece &piece : pieces) {
+		// When typing, each byte comes right after the previous one in the
+		// add buffer, so try to extend the last piece instead of adding one
+		int last = rightmostNode(left);
+		const Piece *lastPiece = last == -1 ? nullptr : &m_nodes[last].piece;
+		if (lastPiece && lastPiece->source == piece.source && lastPiece->pattern == piece.pattern &&
+				lastPiece->offset + lastPiece->length == piece.offset) {
+			extendRightmostPiece(left, piece.length);
+		} else {
+			left = merge(left, createNode(piece));
+		}
+		m_size += piece.length;
+	}
+
+	m_root = merge(left, right);
+	m_node = -1;
+	++m_layout;
+}
+
+void PieceTableBackend::replacePieces(qint64 position, qint64 length, const QVector<Piece> &pieces)
+{
+	if (canRedo()) {
+		for (int i = m_currentModificationIndex; i < m_modifications.size(); ++i)
+			m_historyMemoryUsage -= m_modifications[i].memoryUsage();
+		m_modifications.remove(m_currentModificationIndex, m_modifications.size() - m_currentModificationIndex);
+		Q_ASSERT(!canRedo());
+	}
+
+	Modification m;
+	m.position = position;
+	m.removed = takePieces(position, length);
+	m.inserted = pieces;
+	m.joined = m_transactionLength > 0;
+	insertPieces(position, pieces);
+	m_position = qMin(m_position, m_size);
+
+	if (m.joined) {
+		Modification &previous = m_modifications.last();
+		qint64 memoryUsage = previous.memoryUsage();
+		if (coalesceModification(previous, m)) {
+			m_historyMemoryUsage += previous.memoryUsage() - memoryUsage;
+			return;
+		}
+	}
+	if (m_transactionLength >= 0)
+		++m_transactionLength;
+
+	++m_modificationCount;
+	m_historyMemoryUsage += m.memoryUsage();
+	m_modifications.append(m);
+	m_currentModificationIndex = m_modifications.size();
+	trimHistory();
+
+	Q_ASSERT(canUndo());
+}
+
+// Merges a modification of a transaction into the previous one if it
+// continues it, so that the transaction takes fewer records
+bool PieceTableBackend::coalesceModification(Modification &previous, const Modification &modification)
+{
+	// The range starts where the previous one ended
+	if (modification.position == previous.position + piecesLength(previous.inserted)) {
+		appendPieces(previous.removed, modification.removed);
+		appendPieces(previous.inserted, modification.inserted);
+		return true;
+	}
+
+	// Deleting backwards
+	if (modification.inserted.isEmpty() && previous.inserted.isEmpty() &&
+			modification.position + piecesLength(modification.removed) == previous.position) {
+		QVector<Piece> removed = modification.removed;
+		appendPieces(removed, previous.removed);
+		previous.position = modification.position;
+		previous.removed = removed;
+		return true;
+	}
+
+	return false;
+}
+
+// Forgets the oldest edits while the history uses more memory than allowed.
+// It gets trimmed well below the limit, so that this isn't done on every
+// edit. The last edit, or the transaction in progress, is always kept
+void PieceTableBackend::trimHistory()
+{
+	if (m_historyMemoryUsage <= m_historyLimit)
+		return;
+
+	int keep = m_transactionLength > 0 ? m_transactionLength : 1;
+	int limit = m_currentModificationIndex - keep;
+	qint64 target = m_historyLimit / 4 * 3;
+	int count = 0;
+	while (m_historyMemoryUsage > target) {
+		// Only whole undo steps are forgotten
+		int end = count + 1;
+		while (end < m_modifications.size() && m_modifications[end].joined)
+			++end;
+		if (end > limit)
+			break;
+		for (int i = count; i < end; ++i)
+			m_historyMemoryUsage -= m_modifications[i].memoryUsage();
+		count = end;
+	}
+
+	if (count == 0)
+		return;
+	m_modifications.remove(0, count);
+	m_currentModificationIndex -= count;
+}
+
+// Appends the pieces, joining the ones that continue each other
+void PieceTableBackend::appendPieces(QVector<Piece> &pieces, const QVector<Piece> &morePieces)
+{
+	for (const Piece &piece : morePieces) {
+		if (!pieces.isEmpty()) {
+			Piece &last = pieces.last();
+			if (last.source == piece.source && last.pattern == piece.pattern &&
+					last.offset + last.length == piece.offset) {
+				last.length += piece.length;
+				continue;
+			}
+		}
+		pieces.append(piece);
+	}
+}
+
+// The pieces of the original file never change their order, only
+// their position, which is what the mover relies on
+void PieceTableBackend::addMoves(FileMover &mover, const QVector<Piece> &pieces)
+{
+	qint64 position = 0;
+	for (const Piece &piece : pieces) {
+		if (piece.source == Piece::Source::Original)
+			mover.addMove(piece.offset, position, piece.length);
+		position += piece.length;
+	}
+}
+
+// Copies the parts of the original file that the pieces refer to into the
+// spill file, so that the pieces don't depend on the file anymore
+bool PieceTableBackend::spillPieces(QVector<Piece> &pieces)
+{
+	QVector<Piece> spilled;
+	for (const Piece &piece : pieces) {
+		if (piece.source != Piece::Source::Original) {
+			spilled.append(piece);
+			continue;
+		}
+
+		// The holes become patterns of zeros, which take no space
+		for (qint64 index = 0; index < piece.length;) {
+			qint64 hole = m_source.holeLength(piece.offset + index, piece.length - index);
+			if (hole > 0) {
+				spilled.append(patternPiece(QByteArray(1, char(0)), hole));
+				index += hole;
+				continue;
+			}
+
+			qint64 length = m_source.dataLength(piece.offset + index, piece.length - index);
+			qint64 offset = m_spill->append(piece.offset + index, length);
+			if (offset == -1)
+				return false;
+			spilled.append(Piece(Piece::Source::Spill, offset, length));
+			index += length;
+		}
+	}
+	pieces = spilled;
+	return true;
+}
+
+// Writes the bytes of a piece of the spill file at `position`
+bool PieceTableBackend::writeSpilled(const Piece &piece, qint64 position)
+{
+	if (!m_device->seek(position)) {
+		qCritical() << "PieceTableBackend: Failed to seek in file:" << m_device->errorString();
+		return false;
+	}
+
+	QByteArray buffer;
+	for (qint64 index = 0; index < piece.length;) {
+		int length = int(qMin(piece.length - index, qint64(copyBufferSize)));
+		if (!m_spill->read(piece.offset + index, length, buffer))
+			return false;
+		qint64 bytesWritten = m_device->write(buffer);
+		if (bytesWritten == -1) {
+			qCritical() << "PieceTableBackend: Failed to write to file:" << m_device->errorString();
+			return false;
+		}
+		Q_ASSERT(bytesWritten == length);
+		if (m_counters)
+			m_counters->addWrite(bytesWritten);
+		index += length;
+	}
+	return true;
+}
+
+qint64 PieceTableBackend::piecesLength(const QVector<Piece> &pieces)
+{
+	qint64 length = 0;
+	for (const Piece &piece : pieces)
+		length += piece.length;
+	return length;
+}
+
+void PieceTableBackend::doModification(Modification &modification)
+{
+	takePieces(modification.position, piecesLength(modification.removed));
+	insertPieces(modification.position, modification.inserted);
+	++m_modificationCount;
+}
+
+void PieceTableBackend::undoModification(Modification &modification)
+{
+	takePieces(modification.position, piecesLength(modification.inserted));
+	insertPieces(modification.position, modification.removed);
+	--m_modificationCount;
+}
@@ -0,0 +1,203 @@
+#ifndef PIECETABLEBACKEND_H
+#define PIECETABLEBACKEND_H
+
+#include "editorbackend.h"
+#include "filesource.h"
+#include "storagepolicy.h"
+
+#include <QVector>
+#include <QByteArray>
+#include <QHash>
+#include <QPair>
+
+class FileMover;
+class QFileDevice;
+class SpillFile;
+struct IoCounters;
+
+// Describes the edited file as a sequence of pieces, each one referring
+// either to a range of the original file, to a range of an append-only
+// buffer that holds all inserted bytes, to a repeating pattern or to a
+// range of the spill file, where the parts of the original file that the
+// history refers to go when it's saved. Nothing of the original file is
+// kept in memory except for a small read cache
+class PieceTableBackend : public EditorBackend
+{
+public:
+	PieceTableBackend(QFileDevice *device, SpillFile *spill, IoCounters *counters = nullptr);
+	bool seek(qint64 position) override;
+	qint64 position() const override;
+	qint64 size() const override;
+	void moveForward() override;
+	Byte getByte() override;
+	Span readSpan(qint64 maxLength) override;
+	CursorState cursorState() const override;
+	void setCursorState(const CursorState &state) override;
+	bool isLoaded(qint64 position, qint64 length) override;
+	void load(qint64 position, qint64 length) override;
+	void insertBytes(qint64 position, const QByteArray &bytes) override;
+	void insertPattern(qint64 position, qint64 length, const QByteArray &pattern) override;
+	void deleteRange(qint64 position, qint64 length) override;
+	void replaceRange(qint64 position, const QByteArray &bytes) override;
+	void fillRange(qint64 position, qint64 length, char value) override;
+	bool writeChanges() override;
+	qint64 shiftVolume() override;
+	QVector<Snapshot::Part> contents() override;
+	bool releaseFile() override;
+	void setSaved() override;
+	bool isModified() const override;
+	bool canUndo() const override;
+	bool canRedo() const override;
+	bool undo() override;
+	bool redo() override;
+	void beginTransaction() override;
+	void endTransaction() override;
+	void setHistoryLimit(qint64 bytes) override;
+	void setMemoryBudget(qint64 bytes) override;
+	void setStoragePolicy(const StoragePolicy &policy) override;
+	Statistics statistics() const override;
+
+private:
+	static const int copyBufferSize = 1024 * 1024;
+	// The most bytes of a pattern that are generated at once
+	static const int patternBlockSize = 64 * 1024;
+	// The add buffer is made of blocks of this size, so that it can
+	// grow past what a single array can hold
+	static const int addBlockSize = 1024 * 1024;
+
+	// For pattern pieces, the offset is the index in the endlessly
+	// repeated pattern, so they can be split like the other pieces
+	struct Piece
+	{
+		enum class Source
+		{
+			Original, Added, Pattern, Spill
+		};
+
+		Source source;
+		qint64 offset;
+		qint64 length;
+		int pattern;
+
+		Piece() : source(Source::Original), offset(0), length(0), pattern(-1) {}
+		Piece(Source source, qint64 offset, qint64 length, int pattern = -1)
+			: source(source), offset(offset), length(length), pattern(pattern) {}
+	};
+
+	// A pattern repeated at least `patternBlockSize` times over, so that
+	// that many bytes can be read from any position in the pattern
+	struct Pattern
+	{
+		QByteArray block;
+		int size;
+
+		int blockOffset(qint64 offset) const
+		{
+			return int(offset % size);
+		}
+	};
+
+	// The pieces are stored in a treap ordered by their position in the
+	// edited file. Every node knows the total length of its subtree, so
+	// finding, splitting and joining pieces all take O(log n) time
+	struct Node
+	{
+		Piece piece;
+		qint64 length;
+		quint32 priority;
+		int left, right;
+	};
+
+	// Every edit replaces the pieces of a range with some other pieces.
+	// Undoing it puts the removed pieces back in place of the inserted ones
+	struct Modification
+	{
+		qint64 position;
+		QVector<Piece> removed;
+		QVector<Piece> inserted;
+		// Whether this is a continuation of the previous modification
+		bool joined;
+
+		// The added bytes the pieces refer to count too. Once the edit is
+		// undone, or the bytes are deleted again, only the history needs
+		// them. They stay in the add buffer even after they're forgotten
+		qint64 memoryUsage() const
+		{
+			qint64 usage = qint64(sizeof(Modification)) + (removed.size() + inserted.size()) * qint64(sizeof(Piece));
+			for (const Piece &piece : removed)
+				if (piece.source == Piece::Source::Added)
+					usage += piece.length;
+			for (const Piece &piece : inserted)
+				if (piece.source == Piece::Source::Added)
+					usage += piece.length;
+			return usage;
+		}
+	};
+
+	QFileDevice *m_device;
+	SpillFile *m_spill;
+	IoCounters *m_counters;
+	FileSource m_source;
+	QVector<Node> m_nodes;
+	QVector<int> m_freeNodes;
+	int m_root;
+	quint32 m_seed;
+	// The add buffer. Only its last block is ever appended to
+	QVector<QByteArray> m_addBlocks;
+	qint64 m_addSize;
+	QVector<Pattern> m_patterns;
+	QHash<QByteArray, int> m_patternIndices;
+	qint64 m_originalSize;
+	// A section of the original or of the spill file, sized by the policy
+	QByteArray m_cache;
+	Piece::Source m_cacheSource;
+	qint64 m_cachePosition;
+	StoragePolicy m_policy;
+	// Served for the holes in the original file
+	QByteArray m_zeroBlock;
+	qint64 m_position;
+	qint64 m_size;
+	int m_node;
+	qint64 m_nodePosition;
+	// Changes whenever the pieces change
+	quint64 m_layout;
+	QVector<Modification> m_modifications;
+	int m_currentModificationIndex;
+	int m_modificationCount;
+	// The number of modifications made in the current transaction, or -1
+	int m_transactionLength;
+	qint64 m_historyMemoryUsage;
+	qint64 m_historyLimit;
+
+	void reset();
+	int createNode(Piece piece);
+	void freeNode(int node);
+	qint64 subtreeLength(int node) const;
+	void update(int node);
+	int merge(int left, int right);
+	void split(int node, qint64 position, int &left, int &right);
+	int rightmostNode(int node) const;
+	void extendRightmostPiece(int node, qint64 length);
+	void freeSubtree(int node);
+	int findNode(qint64 position, qint64 &nodePosition) const;
+	void collectPieces(int node, QVector<Piece> &pieces) const;
+	QVector<QPair<qint64, qint64>> originalRanges(qint64 position, qint64 length) const;
+	bool readStored(Piece::Source source, qint64 offset, char &byte);
+	char pieceByte(const Piece &piece, qint64 index);
+	Piece addBytes(const QByteArray &bytes);
+	Piece patternPiece(const QByteArray &pattern, qint64 length);
+	QVector<Piece> takePieces(qint64 position, qint64 length);
+	void insertPieces(qint64 position, const QVector<Piece> &pieces);
+	void replacePieces(qint64 position, qint64 length, const QVector<Piece> &pieces);
+	static void addMoves(FileMover &mover, const QVector<Piece> &pieces);
+	bool spillPieces(QVector<Piece> &pieces);
+	bool writeSpilled(const Piece &piece, qint64 position);
+	bool coalesceModification(Modification &previous, const Modification &modification);
+	void trimHistory();
+	static void appendPieces(QVector<Piece> &pieces, const QVector<Piece> &morePieces);
+	static qint64 piecesLength(const QVector<Piece> &pieces);
+	void doModification(Modification &modification);
+	void undoModification(Modification &modification);
+};
+
+#endif // PIECETABLEBACKEND_H
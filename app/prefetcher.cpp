@@ -0,0 +1,144 @@
+#include "prefetcher.h"
+#include "iocounters.h"
+
+#include <QFile>
+#include <QMutexLocker>
+
+#include <cstring>
+
+Prefetcher::Prefetcher(const QString &fileName, IoCounters *counters)
+	: m_fileName(fileName)
+	, m_counters(counters)
+	, m_readingPosition(-1)
+	, m_generation(0)
+	, m_reopen(false)
+{
+}
+
+Prefetcher::~Prefetcher()
+{
+	requestInterruption();
+	{
+		QMutexLocker locker(&m_mutex);
+		m_condition.wakeAll();
+	}
+	wait();
+}
+
+void Prefetcher::prefetch(qint64 position, qint64 length)
+{
+	if (length <= 0)
+		return;
+
+	QMutexLocker locker(&m_mutex);
+	if (!isRunning())
+		start();
+
+	for (qint64 block = position / blockSize * blockSize; block < position + length; block += blockSize) {
+		if (blockIndex(block) == -1 && block != m_readingPosition && !m_queue.contains(block))
+			m_queue.append(block);
+	}
+
+	// The access moved on, what is still queued from before is stale
+	if (m_queue.size() > maximumBlockCount)
+		m_queue.remove(0, m_queue.size() - maximumBlockCount);
+
+	m_condition.wakeAll();
+}
+
+bool Prefetcher::read(qint64 position, int length, QByteArray &data)
+{
+	if (length <= 0)
+		return false;
+
+	QMutexLocker locker(&m_mutex);
+	QByteArray buffer(length, Qt::Uninitialized);
+	qint64 end = position + length;
+	for (qint64 block = position / blockSize * blockSize; block < end; block += blockSize) {
+		int index = blockIndex(block);
+		while (index == -1 && m_readingPosition == block) {
+			m_condition.wait(&m_mutex);
+			index = blockIndex(block);
+		}
+		if (index == -1)
+			return false;
+
+		// The block is shorter at the end of the file
+		const QByteArray &blockData = m_blocks[index].data;
+		qint64 begin = qMax(position, block);
+		qint64 blockEnd = qMin(end, block + blockSize);
+		if (block + blockData.size() < blockEnd)
+			return false;
+		memcpy(buffer.data() + (begin - position), blockData.constData() + (begin - block), size_t(blockEnd - begin));
+	}
+
+	data = buffer;
+	return true;
+}
+
+bool Prefetcher::isStaged(qint64 position, qint64 length)
+{
+	QMutexLocker locker(&m_mutex);
+	for (qint64 block = position / blockSize * blockSize; block < position + length; block += blockSize)
+		if (blockIndex(block) == -1)
+			return false;
+	return true;
+}
+
+void Prefetcher::clear()
+{
+	QMutexLocker locker(&m_mutex);
+	m_queue.clear();
+	m_blocks.clear();
+	++m_generation;
+	// The file may be replaced by another one with the same name
+	m_reopen = true;
+	while (m_readingPosition != -1)
+		m_condition.wait(&m_mutex);
+}
+
+void Prefetcher::run()
+{
+	QFile file(m_fileName);
+
+	QMutexLocker locker(&m_mutex);
+	while (!isInterruptionRequested()) {
+		if (m_queue.isEmpty()) {
+			m_condition.wait(&m_mutex);
+			continue;
+		}
+
+		qint64 position = m_queue.takeFirst();
+		m_readingPosition = position;
+		int generation = m_generation;
+		bool reopen = m_reopen;
+		m_reopen = false;
+		locker.unlock();
+
+		if (reopen)
+			file.close();
+		QByteArray data;
+		if ((file.isOpen() || file.open(QIODevice::ReadOnly)) && file.seek(position)) {
+			data = file.read(blockSize);
+			if (m_counters)
+				m_counters->addRead(data.size());
+		}
+
+		locker.relock();
+		m_readingPosition = -1;
+		if (generation == m_generation) {
+			m_blocks.append({position, data});
+			if (m_blocks.size() > maximumBlockCount)
+				m_blocks.remove(0);
+		}
+		m_condition.wakeAll();
+	}
+}
+
+int Prefetcher::blockIndex(qint64 position) const
+{
+	for (int i = 0; i < m_blocks.size(); ++i)
+		if (m_blocks[i].position == position)
+			return i;
+	return -1;
+}
@@ -0,0 +1,66 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+struct IoCounters;
+
+// Reads ranges of a file on a worker thread and keeps the data around,
+// so that whoever reads them later finds them in memory. The file is
+// opened separately, so the worker never touches the editor's device
+class Prefetcher : public QThread
+{
+public:
+	explicit Prefetcher(const QString &fileName, IoCounters *counters = nullptr);
+	~Prefetcher() override;
+
+	// Queues a range to be read ahead. The parts of it that are already
+	// read or queued are skipped
+	void prefetch(qint64 position, qint64 length);
+	// Copies the range to `data` if all of it was read ahead. Waits for
+	// it when it is being read at the moment
+	bool read(qint64 position, int length, QByteArray &data);
+	// Whether every block of the range has been read. A block that
+	// couldn't be read counts too, read() leaves it to the caller
+	bool isStaged(qint64 position, qint64 length);
+	// Drops everything that was read ahead. Has to be called before the
+	// file is modified, it waits for the read in progress to finish
+	void clear();
+
+protected:
+	void run() override;
+
+private:
+	static const int blockSize = 64 * 1024;
+	// The most blocks that are kept, the oldest ones are dropped first
+	static const int maximumBlockCount = 64;
+
+	struct Block
+	{
+		qint64 position;
+		QByteArray data;
+	};
+
+	QString m_fileName;
+	IoCounters *m_counters;
+	QMutex m_mutex;
+	// Wakes the worker when there is something to read and the
+	// readers when a block has been read
+	QWaitCondition m_condition;
+	QVector<qint64> m_queue;
+	QVector<Block> m_blocks;
+	// The position of the block being read, or -1
+	qint64 m_readingPosition;
+	// Increased by clear(), so that a block read before that is dropped
+	int m_generation;
+	bool m_reopen;
+
+	int blockIndex(qint64 position) const;
+};
+
+#endif // PREFETCHER_H
@@ -0,0 +1,1712 @@
+#include "sectionbackend.h"
+#include "filemover.h"
+#include "iocounters.h"
+#include "patchwriter.h"
+#include "sparsefile.h"
+#include "spillfile.h"
+
+#include <QFileDevice>
+
+#include <QDebug>
+
+SectionBackend::SectionBackend(QFileDevice *device, SpillFile *spill, IoCounters *counters)
+	: m_device(device)
+	, m_spill(spill)
+	, m_counters(counters)
+	, m_source(device, counters)
+	, m_sectionIndex(-1)
+	, m_sectionLocalPosition(0)
+	, m_position(0)
+	, m_size(device->size())
+	, m_layout(1)
+	, m_memoryUsage(0)
+	, m_memoryBudget(0)
+	, m_clockHand(0)
+	, m_currentModificationIndex(0)
+	, m_modificationCount(0)
+	, m_transactionLength(-1)
+	, m_historyMemoryUsage(0)
+	, m_historyLimit(0)
+{
+}
+
+bool SectionBackend::seek(qint64 position)
+{
+	if (position == m_size) {
+		m_sectionIndex = -1;
+		m_sectionLocalPosition = 0;
+		m_position = m_size;
+		return true;
+	}
+
+	m_sectionIndex = getSectionIndex(position);
+	if (m_sectionIndex == -1)
+		return false;
+
+	m_position = position;
+
+	const Section &s = m_sections[m_sectionIndex];
+	m_sectionLocalPosition = s.bytePosition(position - sectionPosition(m_sectionIndex));
+
+	return true;
+}
+
+qint64 SectionBackend::position() const
+{
+	return m_position;
+}
+
+qint64 SectionBackend::size() const
+{
+	return m_size;
+}
+
+void SectionBackend::moveForward()
+{
+	if (m_position == m_size || !loadCursorSection())
+		return;
+
+	const Section &s = m_sections[m_sectionIndex];
+	int next;
+	if (s.isRun())
+		next = m_sectionLocalPosition + 1 < s.runLength ? m_sectionLocalPosition + 1 : -1;
+	else
+		next = s.present.nextSetBit(m_sectionLocalPosition + 1);
+	if (next == -1) {
+		moveToNextSection();
+		return;
+	}
+	m_sectionLocalPosition = next;
+	++m_position;
+}
+
+// Moves to the first byte of the sections after the current one. When
+// reading sequentially it's in the next section, which is then entered
+// without looking up the position
+void SectionBackend::moveToNextSection()
+{
+	if (m_position + 1 == m_size) {
+		seek(m_size);
+		return;
+	}
+
+	// Skip the sections with nothing but deleted bytes, as long as
+	// there are no bytes that aren't loaded in between
+	int index = m_sectionIndex + 1;
+	for (; index < m_sections.size() && savedGapBefore(index) == 0; ++index) {
+		Section &s = m_sections[index];
+		if (s.currentLength() == 0)
+			continue;
+		s.recentlyUsed = true;
+		m_sectionIndex = index;
+		m_sectionLocalPosition = s.isRun() ? 0 : s.present.nextSetBit(0);
+		++m_position;
+		return;
+	}
+
+	// The next byte isn't loaded. That's left for when it's read, so
+	// that stopping right before it doesn't have to wait for the file
+	m_sectionIndex = -1;
+	m_sectionLocalPosition = 0;
+	++m_position;
+}
+
+// Loads the byte at the cursor if moveToNextSection() left it unloaded,
+// along with the ones after it
+bool SectionBackend::loadCursorSection()
+{
+	if (m_sectionIndex != -1 || m_position == m_size)
+		return true;
+
+	// The bytes before the cursor are usually still loaded, so it's at
+	// the start of the bytes that aren't. A cursor that was set elsewhere
+	// may not be, its section is loaded the usual way then
+	int count = m_sectionPositions.upperBound(m_position);
+	qint64 gapStart = count > 0 ? sectionPosition(count - 1) + m_sections[count - 1].currentLength() : 0;
+	if (gapStart != m_position)
+		return seek(m_position);
+	int index = readAhead(count);
+	if (index == -1 || sectionPosition(index) != m_position)
+		return seek(m_position);
+	m_sectionIndex = index;
+	m_sectionLocalPosition = 0;
+	return true;
+}
+
+SectionBackend::Byte SectionBackend::getByte()
+{
+	if (!loadCursorSection())
+		return Byte();
+	if (m_sections[m_sectionIndex].fromFile &&
+			(m_sectionIndex = loadRunBlock(m_sectionIndex, m_sectionLocalPosition)) == -1)
+		return Byte();
+
+	Byte byte = m_sections[m_sectionIndex].byte(m_sectionLocalPosition);
+	Q_ASSERT(byte.current);
+	moveForward();
+	return byte;
+}
+
+SectionBackend::Span SectionBackend::readSpan(qint64 maxLength)
+{
+	Span span;
+	if (m_position == m_size || maxLength <= 0 || !loadCursorSection())
+		return span;
+	if (m_sections[m_sectionIndex].fromFile &&
+			(m_sectionIndex = loadRunBlock(m_sectionIndex, m_sectionLocalPosition)) == -1)
+		return span;
+
+	const Section &s = m_sections[m_sectionIndex];
+	int begin = m_sectionLocalPosition;
+	if (s.isRun()) {
+		span.block = s.runBlock;
+		span.offset = s.runBlockOffset(begin);
+		span.length = int(qMin(qint64(qMin(s.runLength - begin, int(runBlockSize))), maxLength));
+		span.modified = !s.runSaved;
+		// The bytes of a run of the file don't repeat
+		span.patternSize = s.fromFile ? 0 : s.patternSize;
+
+		m_position += span.length - 1;
+		m_sectionLocalPosition += span.length - 1;
+		moveForward();
+
+		return span;
+	}
+
+	// The span ends at the next deleted byte or where the bytes
+	// change from modified to unmodified or the other way around
+	span.modified = s.modified.test(begin);
+	int end = s.present.nextClearBit(begin);
+	if (end == -1)
+		end = s.size();
+	int change = span.modified ? s.modified.nextClearBit(begin) : s.modified.nextSetBit(begin);
+	if (change != -1)
+		end = qMin(end, change);
+	end = int(qMin(qint64(end), begin + maxLength));
+
+	span.block = s.currentData;
+	span.offset = begin;
+	span.length = end - begin;
+
+	m_position += span.length - 1;
+	m_sectionLocalPosition = end - 1;
+	moveForward();
+
+	return span;
+}
+
+SectionBackend::CursorState SectionBackend::cursorState() const
+{
+	CursorState state;
+	state.position = m_position;
+	state.index = m_sectionIndex;
+	state.offset = m_sectionLocalPosition;
+	state.layout = m_layout;
+	return state;
+}
+
+void SectionBackend::setCursorState(const CursorState &state)
+{
+	if (state.layout == m_layout) {
+		m_position = state.position;
+		m_sectionIndex = int(state.index);
+		m_sectionLocalPosition = int(state.offset);
+		return;
+	}
+
+	// Find the position among the loaded sections. If it isn't loaded,
+	// that's left for when it's read, as after moveToNextSection()
+	m_position = qMin(state.position, m_size);
+	m_sectionIndex = -1;
+	m_sectionLocalPosition = 0;
+	int count = m_sectionPositions.upperBound(m_position);
+	if (m_position == m_size || count == 0)
+		return;
+	const Section &s = m_sections[count - 1];
+	qint64 offset = m_position - sectionPosition(count - 1);
+	if (offset < s.currentLength()) {
+		m_sectionIndex = count - 1;
+		m_sectionLocalPosition = s.bytePosition(offset);
+	}
+}
+
+bool SectionBackend::isLoaded(qint64 position, qint64 length)
+{
+	for (const auto &range : unloadedRanges(position, length))
+		if (!m_source.isResident(range.first, range.second))
+			return false;
+	return true;
+}
+
+void SectionBackend::load(qint64 position, qint64 length)
+{
+	for (const auto &range : unloadedRanges(position, length))
+		m_source.prefetch(range.first, range.second);
+}
+
+void SectionBackend::insertBytes(qint64 position, const QByteArray &bytes)
+{
+	int sectionIndex, byteIndex;
+	if (!getInsertionPoint(position, sectionIndex, byteIndex))
+		return;
+	discardRedoHistory();
+
+	// Undoing deletes the bytes, so redoing is the same as restoring them
+	Modification m(Modification::Type::Insert, position, bytes.size(), false);
+	m.skipped = deletedSlotsBefore(sectionIndex, byteIndex);
+	m.deleted = Bitmap(bytes.size(), true);
+
+	Section &s = m_sections[sectionIndex];
+	s.insertBytes(byteIndex, bytes);
+	++s.modificationCount;
+	m_memoryUsage += bytes.size();
+	m_size += bytes.size();
+	updateSectionsPosition(sectionIndex + 1, bytes.size());
+
+	addModification(m);
+	seek(m_position);
+}
+
+void SectionBackend::insertPattern(qint64 position, qint64 length, const QByteArray &pattern)
+{
+	if (length < minimumRunLength) {
+		QByteArray bytes;
+		bytes.reserve(int(length));
+		while (bytes.size() < length)
+			bytes.append(pattern.constData(), int(qMin(qint64(pattern.size()), length - bytes.size())));
+		insertBytes(position, bytes);
+		return;
+	}
+	insertRun(position, length, pattern, false);
+}
+
+// Inserts runs of the pattern, as many as it takes for `length` bytes
+void SectionBackend::insertRun(qint64 position, qint64 length, const QByteArray &pattern, bool joined)
+{
+	int index = getSectionBoundary(position);
+	if (index == -1)
+		return;
+	discardRedoHistory();
+	qint64 savedPosition = index < m_sections.size() ? m_sections[index].savedPosition : m_device->size();
+
+	QByteArray runBlock;
+	runBlock.reserve(pattern.size() + runBlockSize);
+	while (runBlock.size() < pattern.size() + runBlockSize)
+		runBlock.append(pattern);
+
+	Modification m(Modification::Type::Insert, position, length, joined);
+	m.skipped = deletedSlotsBefore(index, 0);
+
+	QVector<Section> parts;
+	for (qint64 i = 0; i < length; i += maximumRunLength) {
+		Section part(savedPosition);
+		part.runBlock = runBlock;
+		part.patternSize = pattern.size();
+		part.patternOffset = int(i % pattern.size());
+		part.runLength = int(qMin(qint64(maximumRunLength), length - i));
+		part.runPresent = true;
+		part.modificationCount = 1;
+		parts.append(part);
+	}
+	for (int i = 0; i < parts.size(); ++i)
+		m_sections.insert(index + i, std::move(parts[i]));
+	if (m_clockHand >= index)
+		m_clockHand += parts.size();
+	m_size += length;
+	rebuildSectionPositions();
+
+	m.deleted = Bitmap(parts.size(), true);
+	addModification(m);
+	seek(m_position);
+}
+
+void SectionBackend::deleteRange(qint64 position, qint64 length)
+{
+	userDoModification(Modification(Modification::Type::Delete, position, length, false));
+	seek(qMin(m_position, m_size));
+}
+
+void SectionBackend::replaceRange(qint64 position, const QByteArray &bytes)
+{
+	overwriteRange(position, bytes.size(), &bytes, char(0));
+}
+
+// A long range is deleted and a run of the value put in its place, which
+// doesn't load the bytes that aren't loaded and takes no memory for the run
+void SectionBackend::fillRange(qint64 position, qint64 length, char value)
+{
+	if (length < minimumRunLength) {
+		overwriteRange(position, length, nullptr, value);
+		return;
+	}
+
+	userDoModification(Modification(Modification::Type::Delete, position, length, false));
+	insertRun(position, length, QByteArray(1, value), true);
+}
+
+bool SectionBackend::writeChanges()
+{
+	// The history may need the bytes deleted without being loaded
+	if (!spillFileRuns())
+		return false;
+
+	// The file is about to change under the mapping
+	for (Section &s : m_sections)
+		s.detachFromFile();
+	m_source.unmap();
+
+	Bitmap inPlace = sectionsModifiedInPlace();
+	FileMover mover(m_device, m_counters);
+	addMoves(mover, inPlace);
+
+	// Increase the file size if needed
+	if (m_device->size() < m_size)
+		if (!m_device->resize(m_size))
+			return false;
+
+	qDebug() << mover.moveCount() << "unchanged ranges have to be moved";
+	if (!mover.run())
+		return false;
+
+	// Of the sections that only had bytes replaced, only the modified
+	// bytes are written, all of them at once
+	PatchWriter patches(m_device, m_counters);
+	PendingPatch pending;
+	for (int i = 0; i < m_sections.size(); ++i) {
+		if (!inPlace.test(i))
+			continue;
+		// The bytes up to a section right before this one are all loaded
+		const Section *previous = i > 0 && inPlace.test(i - 1) ? &m_sections[i - 1] : nullptr;
+		bool adjacent = previous && previous->savedPosition + previous->savedLength() == m_sections[i].savedPosition;
+		addPatches(m_sections[i], adjacent ? previous : nullptr, pending, patches);
+	}
+	if (pending.section)
+		patches.addPatch(pending.position, pending.bytes);
+
+	qDebug() << patches.patchCount() << "modified ranges have to be written in place";
+	if (!patches.run())
+		return false;
+
+	// Write the other modified sections
+	for (int i = 0; i < m_sections.size(); ++i) {
+		Section &s = m_sections[i];
+		qint64 currentPosition = sectionPosition(i);
+		if (s.isModified() || s.savedPosition != currentPosition) {
+			if (inPlace.test(i)) {
+				s.markSaved(currentPosition);
+				continue;
+			}
+
+			qDebug("Writing section %d (%d)", i, m_sections.size());
+
+			// Runs are generated again rather than moved
+			if (s.isRun()) {
+				if (s.runPresent && !writeRun(s, currentPosition))
+					return false;
+				s.markSaved(currentPosition);
+				continue;
+			}
+
+			QByteArray buffer = s.currentBytes();
+
+			if (!m_device->seek(currentPosition)) {
+				qCritical() << "BufferedEditor: Failed to seek in file:" << m_device->errorString();
+				return false;
+			}
+
+			qint64 bytesWritten = m_device->write(buffer.data(), buffer.size());
+			if (bytesWritten == -1) {
+				qCritical() << "Failed to write to file:" << m_device->errorString();
+				return false;
+			}
+			Q_ASSERT(bytesWritten == buffer.size());
+			if (m_counters)
+				m_counters->addWrite(bytesWritten);
+
+			// The distances between the sections stay the same
+			s.markSaved(currentPosition);
+		}
+	}
+
+	if (m_device->size() > m_size)
+		if (!m_device->resize(m_size))
+			return false;
+
+	m_device->flush();
+
+	m_modificationCount = 0;
+	// The saved state has to be reachable by undoing
+	if (m_transactionLength > 0)
+		m_transactionLength = 0;
+
+	return true;
+}
+
+qint64 SectionBackend::shiftVolume()
+{
+	FileMover mover(m_device, m_counters);
+	addMoves(mover, sectionsModifiedInPlace());
+	return mover.copyLength();
+}
+
+QVector<Snapshot::Part> SectionBackend::contents()
+{
+	// The gaps and the unmodified sections come straight from the file,
+	// the rest shares the memory of the sections
+	QVector<Snapshot::Part> parts;
+	Section dummySection(m_device->size()); // Dummy end section
+	qint64 savedPosition = 0;
+	for (int i = 0; i <= m_sections.size(); ++i) {
+		const Section &section = i < m_sections.size() ? m_sections[i] : dummySection;
+		Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::File, QByteArray(),
+												savedPosition, section.savedPosition - savedPosition));
+		savedPosition = section.savedPosition + section.savedLength();
+		if (i == m_sections.size())
+			break;
+
+		if (section.isRun() && section.fromFile) {
+			if (section.runPresent)
+				Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::Spill, QByteArray(),
+														section.spillOffset, section.runLength));
+		} else if (section.isRun()) {
+			if (section.runPresent)
+				Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::Pattern, section.runBlock,
+														section.patternOffset, section.runLength, section.patternSize));
+		} else if (section.isPinned()) {
+			// The snapshot may be read after the file is unmapped
+			m_sections[i].detachFromFile();
+			QByteArray bytes = section.currentBytes();
+			Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::Memory, bytes, 0, bytes.size()));
+		} else {
+			Snapshot::addPart(parts, Snapshot::Part(Snapshot::Part::Source::File, QByteArray(),
+													section.savedPosition, section.savedLength()));
+		}
+	}
+	return parts;
+}
+
+bool SectionBackend::releaseFile()
+{
+	if (!spillFileRuns())
+		return false;
+	for (Section &s : m_sections)
+		s.detachFromFile();
+	m_source.unmap();
+	return true;
+}
+
+void SectionBackend::setSaved()
+{
+	m_source.unmap();
+	for (int i = 0; i < m_sections.size(); ++i)
+		m_sections[i].markSaved(sectionPosition(i));
+
+	m_modificationCount = 0;
+	// The saved state has to be reachable by undoing
+	if (m_transactionLength > 0)
+		m_transactionLength = 0;
+}
+
+bool SectionBackend::isModified() const
+{
+	return m_modificationCount != 0;
+}
+
+bool SectionBackend::canUndo() const
+{
+	return m_currentModificationIndex > 0;
+}
+
+bool SectionBackend::canRedo() const
+{
+	return m_currentModificationIndex < m_modifications.size();
+}
+
+bool SectionBackend::undo()
+{
+	if (!canUndo())
+		return false;
+
+	// Undo every part of the edit. If one can't be undone, the parts that
+	// were are made again, so that the edit is undone as a whole or not at all
+	int end = m_currentModificationIndex;
+	bool joined;
+	do {
+		joined = m_modifications[m_currentModificationIndex - 1].joined;
+		if (!stepBack()) {
+			while (m_currentModificationIndex < end && stepForward()) {}
+			seek(qMin(m_position, m_size));
+			return false;
+		}
+	} while (joined);
+
+	seek(qMin(m_position, m_size));
+	return true;
+}
+
+bool SectionBackend::redo()
+{
+	if (!canRedo())
+		return false;
+
+	int begin = m_currentModificationIndex;
+	do {
+		if (!stepForward()) {
+			while (m_currentModificationIndex > begin && stepBack()) {}
+			seek(qMin(m_position, m_size));
+			return false;
+		}
+	} while (canRedo() && m_modifications[m_currentModificationIndex].joined);
+
+	seek(qMin(m_position, m_size));
+	return true;
+}
+
+// Undoes the modification before the current one and moves the current
+// one back to it, unless it couldn't be undone
+bool SectionBackend::stepBack()
+{
+	Modification &m = m_modifications[m_currentModificationIndex - 1];
+	m_historyMemoryUsage -= m.memoryUsage();
+	bool success = undoModification(m);
+	m_historyMemoryUsage += m.memoryUsage();
+	if (!success)
+		return false;
+
+	--m_modificationCount;
+	--m_currentModificationIndex;
+	return true;
+}
+
+// Makes the current modification again and moves past it, unless it
+// couldn't be made
+bool SectionBackend::stepForward()
+{
+	Modification &m = m_modifications[m_currentModificationIndex];
+	m_historyMemoryUsage -= m.memoryUsage();
+	bool success = doModification(m);
+	m_historyMemoryUsage += m.memoryUsage();
+	if (!success)
+		return false;
+
+	++m_modificationCount;
+	++m_currentModificationIndex;
+	return true;
+}
+
+void SectionBackend::beginTransaction()
+{
+	m_transactionLength = 0;
+}
+
+void SectionBackend::endTransaction()
+{
+	m_transactionLength = -1;
+	trimHistory();
+}
+
+void SectionBackend::setHistoryLimit(qint64 bytes)
+{
+	m_historyLimit = bytes;
+	trimHistory();
+}
+
+void SectionBackend::setMemoryBudget(qint64 bytes)
+{
+	m_memoryBudget = bytes;
+	// A smaller budget is kept to right away, not on the next load
+	if (m_memoryUsage > m_memoryBudget && !m_sections.isEmpty())
+		m_sectionIndex = evictSections(m_sectionIndex);
+}
+
+void SectionBackend::setStoragePolicy(const StoragePolicy &policy)
+{
+	m_policy = policy;
+}
+
+SectionBackend::Statistics SectionBackend::statistics() const
+{
+	Statistics statistics;
+	statistics.residentSections = m_sections.size();
+	statistics.residentBytes = m_memoryUsage;
+	statistics.undoEntries = m_modifications.size();
+	statistics.undoMemory = m_historyMemoryUsage;
+	return statistics;
+}
+
+// The length of the next section read from the file. A few of them have
+// to fit in the memory budget
+int SectionBackend::sectionSize() const
+{
+	qint64 limit = qMax(m_policy.alignDown(m_memoryBudget / 8), qint64(m_policy.minimumSectionSize()));
+	return int(qMin(qint64(m_policy.sectionSize()), limit));
+}
+
+int SectionBackend::getSectionIndex(qint64 position)
+{
+	// The index of the section
+	int index = -1;
+	// The index of the next/previous section if such is loaded and the section was not found
+	int nextIndex = -1, prevIndex = -1;
+
+	// Find the last section that starts at or before `position`
+	int count = m_sectionPositions.upperBound(position);
+	if (count > 0) {
+		const Section &section = m_sections[count - 1];
+		if (position < sectionPosition(count - 1) + section.currentLength())
+			index = count - 1;
+		else
+			prevIndex = count - 1;
+	}
+	if (index == -1 && count < m_sections.size())
+		nextIndex = count;
+	if (index != -1)
+		m_sections[index].recentlyUsed = true;
+
+	if (index == -1) {
+		// Section is not loaded in memory
+		qDebug() << "BufferedEditor: Loading section for byte" << position;
+
+		// The location of `position` in the actual, unedited file
+		qint64 realPosition = position;
+		qint64 prevSectionSavedEnd = 0;
+		if (prevIndex != -1) {
+			prevSectionSavedEnd = m_sections[prevIndex].savedPosition + m_sections[prevIndex].savedLength();
+			qint64 prevSectionCurrentEnd = sectionPosition(prevIndex) + m_sections[prevIndex].currentLength();
+			realPosition = prevSectionSavedEnd + position - prevSectionCurrentEnd;
+		}
+
+		// The maximum allowed 'end' of the section that is to be loaded
+		qint64 newSectionMaxEnd;
+		if (nextIndex != -1) {
+			// Don't overlap with the next section
+			newSectionMaxEnd = m_sections[nextIndex].savedPosition;
+		} else {
+			// Don't try to read after the end of the file
+			newSectionMaxEnd = m_device->size();
+		}
+
+		// Calculate the new section start/end positions. The section
+		// starts on a block unless that would overlap the previous one
+		int size = sectionSize();
+		qint64 newSectionStart = qMax(m_policy.alignDown(realPosition), prevSectionSavedEnd);
+		qint64 newSectionEnd = newSectionMaxEnd;
+		if (newSectionMaxEnd - newSectionStart < size)
+			newSectionStart = qMax(newSectionMaxEnd - size, prevSectionSavedEnd);
+		else
+			newSectionEnd = newSectionStart + size;
+		int newSectionLength = int(newSectionEnd - newSectionStart);
+
+		// Holes are loaded as runs of zeros, the rest is read from the file
+		Section section;
+		if (loadHole(realPosition, prevSectionSavedEnd, newSectionMaxEnd, section)) {
+			newSectionLength = 0;
+		} else {
+			QByteArray buffer;
+			if (!m_source.read(newSectionStart, newSectionLength, buffer))
+				return -1;
+			m_policy.recordRead(newSectionStart, newSectionLength);
+			section = Section(newSectionStart, buffer);
+		}
+
+		// Add the new section to the list of loaded sections
+		index = nextIndex == -1 ? m_sections.size() : nextIndex;
+		m_sections.insert(index, std::move(section));
+
+		// Add it to the position index. Appending is the common case
+		// when reading the file sequentially and is cheaper than a rebuild
+		if (index == m_sections.size() - 1)
+			m_sectionPositions.append(sectionDistance(index));
+		else
+			rebuildSectionPositions();
+		++m_layout;
+
+		m_memoryUsage += newSectionLength;
+		if (m_memoryUsage > m_memoryBudget)
+			index = evictSections(index);
+	}
+
+	return index;
+}
+
+// The ranges of the saved file that are read when the bytes in the range
+// that aren't loaded get loaded. A section may start or end up to a
+// section's length away from the byte it's loaded for
+QVector<QPair<qint64, qint64>> SectionBackend::unloadedRanges(qint64 position, qint64 length)
+{
+	QVector<QPair<qint64, qint64>> ranges;
+	qint64 end = qMin(position + length, m_size);
+	while (position < end) {
+		int count = m_sectionPositions.upperBound(position);
+		qint64 prevSavedEnd = 0;
+		qint64 prevCurrentEnd = 0;
+		if (count > 0) {
+			const Section &prev = m_sections[count - 1];
+			prevCurrentEnd = sectionPosition(count - 1) + prev.currentLength();
+			if (position < prevCurrentEnd) {
+				position = prevCurrentEnd;
+				continue;
+			}
+			prevSavedEnd = prev.savedPosition + prev.savedLength();
+		}
+
+		// The bytes between two sections are the same as in the saved file
+		qint64 savedPosition = prevSavedEnd + position - prevCurrentEnd;
+		qint64 gapEnd = count < m_sections.size() ? m_sections[count].savedPosition : m_device->size();
+		if (gapEnd <= savedPosition)
+			break;
+		qint64 savedEnd = qMin(gapEnd, savedPosition + end - position);
+		qint64 rangeStart = qMax(prevSavedEnd, savedPosition - sectionSize());
+		ranges.append(qMakePair(rangeStart, qMin(gapEnd, savedEnd + sectionSize()) - rangeStart));
+		position += gapEnd - savedPosition;
+	}
+	return ranges;
+}
+
+// Loads several sections from the start of the bytes that aren't loaded
+// before the section at `index`, so that reading on doesn't have to load
+// and index them one at a time. Returns the index of the first one
+int SectionBackend::readAhead(int index)
+{
+	qint64 start = index > 0 ? m_sections[index - 1].savedPosition + m_sections[index - 1].savedLength() : 0;
+	qint64 end = start + savedGapBefore(index);
+	int size = sectionSize();
+	qint64 length = qMin(end - start, qMax(qint64(size), qMin(m_memoryBudget / 8, qint64(m_policy.readAheadLength()))));
+	if (length <= 0)
+		return -1;
+
+	QVector<Section> sections;
+	for (qint64 position = start; position < start + length;) {
+		Section run;
+		if (loadHole(position, position, end, run)) {
+			position += run.runLength;
+			sections.append(run);
+			continue;
+		}
+
+		// The sections end on blocks. Don't leave a short piece that
+		// would take a section of its own
+		qint64 sectionEnd = m_policy.alignDown(position + size);
+		if (sectionEnd <= position)
+			sectionEnd = position + size;
+		int sectionLength = int(qMin(sectionEnd, start + length) - position);
+		if (end - (position + sectionLength) < size / 2)
+			sectionLength = int(end - position);
+
+		// Only the first section is needed right away, the others are
+		// loaded only if that doesn't mean waiting for the disk
+		if (!sections.isEmpty() && !m_source.isResident(position, sectionLength))
+			break;
+
+		QByteArray buffer;
+		if (!m_source.read(position, sectionLength, buffer)) {
+			if (sections.isEmpty())
+				return -1;
+			break;
+		}
+		sections.append(Section(position, buffer));
+		m_memoryUsage += sectionLength;
+		position += sectionLength;
+	}
+	m_policy.recordRead(start, sections.last().savedPosition + sections.last().savedLength() - start);
+	qDebug() << "BufferedEditor: Loading" << sections.size() << "sections from byte" << start;
+
+	// Only their handles are shifted to make room for them
+	for (int i = 0; i < sections.size(); ++i)
+		m_sections.insert(index + i, std::move(sections[i]));
+	if (index + sections.size() == m_sections.size()) {
+		for (int i = index; i < m_sections.size(); ++i)
+			m_sectionPositions.append(sectionDistance(i));
+	} else {
+		rebuildSectionPositions();
+	}
+	++m_layout;
+
+	if (m_memoryUsage > m_memoryBudget)
+		index = evictSections(index);
+	return index;
+}
+
+// Makes a run of zeros out of the hole in the saved file around `position`,
+// as long as it's at least as long as a section. The run is kept within
+// [begin, end) and starts at a round offset, so that the holes are split
+// the same way however they're reached
+bool SectionBackend::loadHole(qint64 position, qint64 begin, qint64 end, Section &run)
+{
+	if (m_source.holeLength(position, 1) == 0)
+		return false;
+
+	qint64 start = position;
+	for (qint64 alignment = maximumRunLength; alignment >= minimumRunLength; alignment /= 2) {
+		qint64 aligned = qMax(position / alignment * alignment, begin);
+		if (m_source.holeLength(aligned, position + 1 - aligned) == position + 1 - aligned) {
+			start = aligned;
+			break;
+		}
+	}
+
+	qint64 length = qMin(m_source.holeLength(start, end - start), qint64(maximumRunLength));
+	if (length < minimumRunLength)
+		return false;
+
+	if (m_zeroBlock.isEmpty())
+		m_zeroBlock = QByteArray(runBlockSize + 1, char(0));
+	run = Section(start);
+	run.runBlock = m_zeroBlock;
+	run.patternSize = 1;
+	run.runLength = int(length);
+	run.runSaved = true;
+	run.runPresent = true;
+	return true;
+}
+
+// Makes a run of the bytes that aren't loaded from `position` on, as many
+// of them as there are in the next `length` bytes, so that they can be
+// deleted without loading them. Returns the index of the run, or -1 if
+// the byte is loaded or there are too few such bytes for a run
+int SectionBackend::getFileRun(qint64 position, qint64 length)
+{
+	if (length < minimumRunLength)
+		return -1;
+
+	int count = m_sectionPositions.upperBound(position);
+	qint64 prevSavedEnd = 0;
+	qint64 prevCurrentEnd = 0;
+	if (count > 0) {
+		const Section &prev = m_sections[count - 1];
+		prevCurrentEnd = sectionPosition(count - 1) + prev.currentLength();
+		if (position < prevCurrentEnd)
+			return -1;
+		prevSavedEnd = prev.savedPosition + prev.savedLength();
+	}
+
+	// The bytes between two sections are the same as in the saved file
+	qint64 savedPosition = prevSavedEnd + position - prevCurrentEnd;
+	qint64 gapEnd = count < m_sections.size() ? m_sections[count].savedPosition : m_device->size();
+	length = qMin(qMin(length, gapEnd - savedPosition), qint64(maximumRunLength));
+	if (length < minimumRunLength)
+		return -1;
+
+	Section run(savedPosition);
+	run.patternSize = int(length);
+	run.runLength = int(length);
+	run.runSaved = true;
+	run.runPresent = true;
+	run.fromFile = true;
+	m_sections.insert(count, std::move(run));
+	if (m_clockHand >= count)
+		++m_clockHand;
+	rebuildSectionPositions();
+	return count;
+}
+
+// Makes a run of the file that was restored read its bytes from the spill
+// file. Returns false if the saved file still has them
+bool SectionBackend::loadFileRun(Section &run)
+{
+	Q_ASSERT(run.fromFile && run.runPresent && run.runBlock.isEmpty());
+	if (run.spillOffset == -1) {
+		Q_ASSERT(run.runSaved);
+		return false;
+	}
+	run.patternSize = run.runLength;
+	run.patternOffset = 0;
+	run.blockStart = 0;
+	return true;
+}
+
+// Reads the bytes of a restored run of the file from `offset` on into its
+// block, at most a block of them, unless the block has them already.
+// Returns the index of the run, which other sections may have been
+// unloaded to make room for, or -1 if the bytes couldn't be read
+int SectionBackend::loadRunBlock(int index, int offset)
+{
+	Section &run = m_sections[index];
+	Q_ASSERT(run.fromFile && run.runPresent && run.spillOffset != -1);
+	run.recentlyUsed = true;
+	int length = qMin(run.runLength - offset, int(runBlockSize));
+	if (!run.runBlock.isEmpty() && offset >= run.blockStart && offset + length <= run.blockStart + run.runBlock.size())
+		return index;
+
+	m_memoryUsage -= run.runBlock.size();
+	run.runBlock.clear();
+	QByteArray bytes;
+	if (!m_spill->read(run.spillOffset + offset, length, bytes))
+		return -1;
+	run.runBlock = bytes;
+	run.blockStart = offset;
+	m_memoryUsage += length;
+	if (m_memoryUsage > m_memoryBudget)
+		index = evictSections(index);
+	return index;
+}
+
+// Copies the bytes of the deleted runs of the file to the spill file,
+// before the file is written over
+bool SectionBackend::spillFileRuns()
+{
+	for (Section &s : m_sections) {
+		if (!s.fromFile || s.spillOffset != -1)
+			continue;
+		Q_ASSERT(s.runSaved && !s.runPresent);
+		s.spillOffset = m_spill->append(s.savedPosition, s.runLength);
+		if (s.spillOffset == -1)
+			return false;
+	}
+	return true;
+}
+
+bool SectionBackend::getInsertionPoint(qint64 position, int &sectionIndex, int &byteIndex)
+{
+	Q_ASSERT(position >= 0 && position <= m_size);
+
+	// Bytes inserted into a run go next to a byte of the run that
+	// gets its own section for that
+	if (position < m_size) {
+		sectionIndex = getSectionIndex(position);
+		if (sectionIndex == -1)
+			return false;
+		int offset = int(position - sectionPosition(sectionIndex));
+		if (m_sections[sectionIndex].isRun()) {
+			sectionIndex = materializeRun(sectionIndex, offset, 1);
+			if (sectionIndex == -1)
+				return false;
+			offset = 0;
+		}
+		byteIndex = m_sections[sectionIndex].bytePosition(offset);
+		return true;
+	}
+
+	// Append after everything, the deleted bytes at the end included.
+	// The last byte may have been unloaded
+	if (m_size > 0 && getSectionIndex(m_size - 1) == -1)
+		return false;
+	if (!m_sections.isEmpty() && m_sections.last().isRun() && m_sections.last().runPresent &&
+			materializeRun(m_sections.size() - 1, m_sections.last().runLength - 1, 1) == -1)
+		return false;
+	if (m_sections.isEmpty() || m_sections.last().isRun()) {
+		m_sections.append(Section(m_device->size()));
+		m_sectionPositions.append(sectionDistance(m_sections.size() - 1));
+		++m_layout;
+	}
+	sectionIndex = m_sections.size() - 1;
+	byteIndex = m_sections[sectionIndex].size();
+	return true;
+}
+
+// Replaces the values of the bytes in the range with `bytes`,
+// or with `value` if `bytes` is null
+void SectionBackend::overwriteRange(qint64 position, qint64 length, const QByteArray *bytes, char value)
+{
+	// Every modification holds the bytes to swap in, so a long
+	// range is split into several of them
+	qint64 index = 0;
+	bool joined = false;
+	while (index < length) {
+		int count = int(qMin(length - index, qint64(maximumRunLength)));
+		Modification m(Modification::Type::Replace, position + index, count, joined);
+		m.bytes = bytes ? bytes->mid(int(index), count) : QByteArray(count, value);
+		userDoModification(m);
+
+		index += count;
+		joined = true;
+	}
+	seek(m_position);
+}
+
+// Both return false if a section couldn't be loaded, which leaves the
+// bytes as they were
+bool SectionBackend::doModification(Modification &modification)
+{
+	++m_layout;
+	switch (modification.type) {
+	case Modification::Type::Replace:
+		return swapBytes(modification.position, modification.bytes);
+
+	case Modification::Type::Insert:
+		return restoreBytes(modification);
+
+	case Modification::Type::Delete:
+		return removeBytes(modification);
+	}
+	return false;
+}
+
+bool SectionBackend::undoModification(Modification &modification)
+{
+	++m_layout;
+	switch (modification.type) {
+	case Modification::Type::Replace:
+		// Swapping the bytes back is the same as swapping them in
+		return swapBytes(modification.position, modification.bytes);
+
+	case Modification::Type::Insert:
+		return removeBytes(modification);
+
+	case Modification::Type::Delete:
+		return restoreBytes(modification);
+	}
+	return false;
+}
+
+void SectionBackend::userDoModification(Modification m)
+{
+	discardRedoHistory();
+	if (doModification(m))
+		addModification(m);
+}
+
+void SectionBackend::addModification(Modification modification)
+{
+	if (m_transactionLength > 0) {
+		modification.joined = true;
+		Modification &previous = m_modifications.last();
+		qint64 memoryUsage = previous.memoryUsage();
+		if (coalesceModification(previous, modification)) {
+			m_historyMemoryUsage += previous.memoryUsage() - memoryUsage;
+			return;
+		}
+	}
+	if (m_transactionLength >= 0)
+		++m_transactionLength;
+
+	m_historyMemoryUsage += modification.memoryUsage();
+	m_modifications.append(modification);
+	m_currentModificationIndex = m_modifications.size();
+	++m_modificationCount;
+	trimHistory();
+
+	Q_ASSERT(canUndo());
+}
+
+// Appends the bits of `bits` to `bitmap`
+static void appendBits(Bitmap &bitmap, const Bitmap &bits)
+{
+	int index = bitmap.size();
+	bitmap.insert(index, bits.size(), true);
+	for (int i = bits.nextClearBit(0); i != -1; i = bits.nextClearBit(i + 1))
+		bitmap.set(index + i, false);
+}
+
+// Merges a modification of a transaction into the previous one if it
+// continues it, so that the transaction takes fewer records
+bool SectionBackend::coalesceModification(Modification &previous, const Modification &modification)
+{
+	if (previous.type != modification.type)
+		return false;
+
+	switch (modification.type) {
+	case Modification::Type::Replace:
+		if (previous.position + previous.length != modification.position ||
+				previous.length + modification.length > maximumRunLength)
+			return false;
+		previous.bytes.append(modification.bytes);
+		break;
+
+	case Modification::Type::Insert:
+		// The new bytes have to be right after the previous ones
+		if (previous.position + previous.length != modification.position || modification.skipped != 0)
+			return false;
+		appendBits(previous.deleted, modification.deleted);
+		break;
+
+	case Modification::Type::Delete:
+	{
+		if (modification.position == previous.position) {
+			// Deleting forwards, the bytes are after the previously deleted ones
+			int gap = modification.skipped - previous.skipped - previous.deleted.size();
+			if (gap < 0)
+				return false;
+			previous.deleted.insert(previous.deleted.size(), gap, false);
+			appendBits(previous.deleted, modification.deleted);
+		} else if (modification.position + modification.length == previous.position) {
+			// Deleting backwards, the bytes are before them
+			Bitmap deleted = modification.deleted;
+			deleted.insert(deleted.size(), previous.skipped, false);
+			appendBits(deleted, previous.deleted);
+			previous.position = modification.position;
+			previous.skipped = modification.skipped;
+			previous.deleted = deleted;
+		} else {
+			return false;
+		}
+		break;
+	}
+	}
+
+	previous.length += modification.length;
+	return true;
+}
+
+// Forgets the oldest edits while the history uses more memory than allowed.
+// It gets trimmed well below the limit, so that this isn't done on every
+// edit. The last edit, or the transaction in progress, is always kept
+void SectionBackend::trimHistory()
+{
+	if (m_historyMemoryUsage <= m_historyLimit)
+		return;
+
+	int keep = m_transactionLength > 0 ? m_transactionLength : 1;
+	int limit = m_currentModificationIndex - keep;
+	qint64 target = m_historyLimit / 4 * 3;
+	int count = 0;
+	while (m_historyMemoryUsage > target) {
+		// Only whole undo steps are forgotten
+		int end = count + 1;
+		while (end < m_modifications.size() && m_modifications[end].joined)
+			++end;
+		if (end > limit)
+			break;
+		for (int i = count; i < end; ++i)
+			m_historyMemoryUsage -= m_modifications[i].memoryUsage();
+		count = end;
+	}
+
+	if (count == 0)
+		return;
+	m_modifications.remove(0, count);
+	m_currentModificationIndex -= count;
+}
+
+void SectionBackend::discardRedoHistory()
+{
+	if (!canRedo())
+		return;
+
+	for (int i = m_currentModificationIndex; i < m_modifications.size(); ++i)
+		m_historyMemoryUsage -= m_modifications[i].memoryUsage();
+	m_modifications.remove(m_currentModificationIndex, m_modifications.size() - m_currentModificationIndex);
+	Q_ASSERT(!canRedo());
+}
+
+// Exchanges the values of the bytes starting at `position` with `bytes`.
+// If a section can't be loaded, the ones exchanged so far are exchanged
+// back and false is returned
+bool SectionBackend::swapBytes(qint64 position, QByteArray &bytes)
+{
+	int count = swapBytes(position, bytes.data(), bytes.size(), 1);
+	if (count == bytes.size())
+		return true;
+	// Their sections are modified now, so they're still loaded
+	swapBytes(position, bytes.data(), count, -1);
+	return false;
+}
+
+// Exchanges up to `length` bytes, adding `modificationCount` to that of
+// every section they're in. Returns how many were exchanged
+int SectionBackend::swapBytes(qint64 position, char *bytes, int length, int modificationCount)
+{
+	int index = 0;
+	while (index < length) {
+		int sectionIndex = getSectionIndex(position + index);
+		if (sectionIndex == -1)
+			break;
+		int offset = int(position + index - sectionPosition(sectionIndex));
+
+		// Only the overwritten part of a run gets its own bytes
+		if (m_sections[sectionIndex].isRun()) {
+			int count = qMin(length - index, m_sections[sectionIndex].runLength - offset);
+			sectionIndex = materializeRun(sectionIndex, offset, count);
+			if (sectionIndex == -1)
+				break;
+			offset = 0;
+		}
+
+		Section &s = m_sections[sectionIndex];
+		int begin = s.bytePosition(offset);
+		int count = qMin(length - index, s.currentLength() - s.present.rank(begin));
+		s.swapBytes(begin, bytes + index, count);
+		s.modificationCount += modificationCount;
+		index += count;
+	}
+	return index;
+}
+
+// Deletes the bytes of the modification's range and records where they
+// are. If a section can't be loaded, the bytes deleted so far are restored
+// and false is returned
+bool SectionBackend::removeBytes(Modification &modification)
+{
+	Bitmap &deleted = modification.deleted;
+	deleted = Bitmap();
+
+	// The bytes after the deleted ones take their place,
+	// so every part of the range starts at the same position
+	qint64 removed = 0;
+	while (removed < modification.length) {
+		qint64 remaining = modification.length - removed;
+		int sectionIndex = getFileRun(modification.position, remaining);
+		if (sectionIndex == -1)
+			sectionIndex = getSectionIndex(modification.position);
+		if (sectionIndex == -1) {
+			// Their sections have deleted bytes now, so they're still loaded
+			if (removed > 0) {
+				Modification done = modification;
+				done.length = removed;
+				restoreBytes(done);
+			}
+			return false;
+		}
+		int offset = int(modification.position - sectionPosition(sectionIndex));
+
+		// A run is always deleted as a whole, so the deleted part gets split off
+		int begin = 0, end = 1, count;
+		if (m_sections[sectionIndex].isRun()) {
+			count = int(qMin(remaining, qint64(m_sections[sectionIndex].runLength - offset)));
+			sectionIndex = isolateRun(sectionIndex, offset, count);
+		} else {
+			// The range takes the rest of the section unless it ends in it
+			const Section &s = m_sections[sectionIndex];
+			begin = s.bytePosition(offset);
+			int rank = s.present.rank(begin);
+			count = int(qMin(remaining, qint64(s.currentLength() - rank)));
+			end = count == remaining ? s.present.select(rank + count - 1) + 1 : s.size();
+		}
+
+		// Bytes that were already deleted stay that way
+		if (removed == 0)
+			modification.skipped = deletedSlotsBefore(sectionIndex, begin);
+		else
+			deleted.insert(deleted.size(), begin, false);
+
+		Section &s = m_sections[sectionIndex];
+		Bitmap bytes = s.isRun() ? Bitmap(1, true) : s.present.mid(begin, end - begin);
+		s.deleteBytes(begin, bytes);
+		++s.modificationCount;
+		appendBits(deleted, bytes);
+
+		// The spill file still has the bytes of a run of the file
+		if (s.fromFile && !s.runBlock.isEmpty()) {
+			m_memoryUsage -= s.runBlock.size();
+			s.runBlock.clear();
+		}
+
+		m_size -= count;
+		updateSectionsPosition(sectionIndex + 1, -count);
+		removed += count;
+
+		// So do the sections in between that have nothing left
+		if (removed < modification.length) {
+			for (int i = sectionIndex + 1; i < m_sections.size() && savedGapBefore(i) == 0 &&
+				 m_sections[i].currentLength() == 0; ++i)
+				deleted.insert(deleted.size(), m_sections[i].slotCount(), false);
+		}
+	}
+	return true;
+}
+
+// Brings back the bytes deleted by removeBytes(). Only the byte before
+// them has to be loaded for that, false is returned if it can't be
+bool SectionBackend::restoreBytes(const Modification &modification)
+{
+	// Find the first slot after the byte before the range
+	int sectionIndex = 0;
+	int slot = 0;
+	if (modification.position > 0) {
+		qint64 position = modification.position - 1;
+		sectionIndex = getSectionIndex(position);
+		if (sectionIndex == -1)
+			return false;
+		const Section &s = m_sections[sectionIndex];
+		int offset = int(position - sectionPosition(sectionIndex));
+		Q_ASSERT(!s.isRun() || offset == s.runLength - 1);
+		slot = s.isRun() ? 1 : s.bytePosition(offset) + 1;
+	}
+
+	// Skip the deleted slots that aren't part of the range
+	int skipped = modification.skipped;
+	while (skipped >= m_sections[sectionIndex].slotCount() - slot) {
+		skipped -= m_sections[sectionIndex].slotCount() - slot;
+		++sectionIndex;
+		slot = 0;
+		Q_ASSERT(sectionIndex < m_sections.size());
+	}
+	slot += skipped;
+
+	// The deleted runs of the file are unloaded again, as they were before
+	// they were deleted, unless the file doesn't have their bytes anymore
+	const Bitmap &deleted = modification.deleted;
+	Bitmap unloaded(m_sections.size(), false);
+	for (int index = 0; index < deleted.size(); ++sectionIndex, slot = 0) {
+		Q_ASSERT(sectionIndex < m_sections.size());
+		Section &s = m_sections[sectionIndex];
+		int count = qMin(deleted.size() - index, s.slotCount() - slot);
+		Bitmap bytes = deleted.mid(index, count);
+		int length = s.isRun() ? (bytes.count() != 0 ? s.runLength : 0) : bytes.count();
+		if (length > 0) {
+			s.restoreBytes(slot, bytes);
+			++s.modificationCount;
+			m_size += length;
+			updateSectionsPosition(sectionIndex + 1, length);
+			if (s.fromFile && !loadFileRun(s))
+				unloaded.set(sectionIndex, true);
+		}
+		index += count;
+	}
+
+	if (unloaded.count() == 0)
+		return true;
+	m_clockHand -= unloaded.rank(qMin(m_clockHand, unloaded.size()));
+	m_sections.removeIf([&unloaded](int i) { return unloaded.test(i); });
+	rebuildSectionPositions();
+	return true;
+}
+
+// The number of deleted slots right before the given one. The deleted
+// slots at the end of the previous sections count too if there are no
+// other bytes in between
+int SectionBackend::deletedSlotsBefore(int sectionIndex, int slot) const
+{
+	int count = 0;
+	for (;;) {
+		if (sectionIndex < m_sections.size()) {
+			const Section &s = m_sections[sectionIndex];
+			if (s.isRun()) {
+				if (slot > 0 && s.runPresent)
+					return count;
+			} else {
+				int last = s.present.previousSetBit(slot);
+				if (last != -1)
+					return count + slot - 1 - last;
+			}
+			count += slot;
+		}
+
+		// The bytes that aren't loaded are never deleted
+		if (sectionIndex == 0 || savedGapBefore(sectionIndex) != 0)
+			return count;
+		--sectionIndex;
+		slot = m_sections[sectionIndex].slotCount();
+	}
+}
+
+// Returns the index at which a section that starts at `position` can be
+// inserted, splitting the section that holds the byte there if needed
+int SectionBackend::getSectionBoundary(qint64 position)
+{
+	Q_ASSERT(position >= 0 && position <= m_size);
+	if (position == m_size)
+		return m_sections.size();
+
+	int index = getSectionIndex(position);
+	if (index == -1)
+		return -1;
+
+	// The new section goes after the deleted bytes before the byte
+	int byteIndex = m_sections[index].bytePosition(position - sectionPosition(index));
+	if (byteIndex == 0)
+		return index;
+	return splitSection(index, byteIndex);
+}
+
+// Splits the section so that the byte at `byteIndex` starts a new one
+// and returns the index of the new section
+int SectionBackend::splitSection(int index, int byteIndex)
+{
+	// The block of a run of the file is read again by whichever part needs it
+	Section &s = m_sections[index];
+	if (s.fromFile && !s.runBlock.isEmpty()) {
+		m_memoryUsage -= s.runBlock.size();
+		s.runBlock.clear();
+	}
+
+	Section tail = m_sections[index].split(byteIndex);
+	m_sections.insert(index + 1, std::move(tail));
+	if (m_clockHand > index)
+		++m_clockHand;
+
+	rebuildSectionPositions();
+	return index + 1;
+}
+
+// Splits a run so that `length` of its bytes starting at `offset`
+// are a section of their own and returns its index
+int SectionBackend::isolateRun(int index, int offset, int length)
+{
+	if (offset > 0)
+		index = splitSection(index, offset);
+	if (length < m_sections[index].runLength)
+		splitSection(index, length);
+	return index;
+}
+
+// Gives the bytes of a run that are about to be edited a section of their
+// own. Returns its index, or -1 if the bytes of a run of the file couldn't
+// be read
+int SectionBackend::materializeRun(int index, int offset, int length)
+{
+	index = isolateRun(index, offset, length);
+	Section &run = m_sections[index];
+	if (run.fromFile) {
+		// The whole run is read into the block for that
+		Q_ASSERT(run.spillOffset != -1);
+		m_memoryUsage -= run.runBlock.size();
+		run.runBlock.clear();
+		QByteArray bytes;
+		if (!m_spill->read(run.spillOffset, run.runLength, bytes))
+			return -1;
+		run.runBlock = bytes;
+		run.blockStart = 0;
+	}
+	m_memoryUsage += length;
+	run.materialize();
+	++m_layout;
+	return index;
+}
+
+bool SectionBackend::writeRun(const Section &run, qint64 position)
+{
+	if (run.fromFile)
+		return writeFileRun(run, position);
+
+	// A run of zeros can be a hole instead
+	if (isZero(run.runBlock.constData(), run.patternSize) && punchHole(m_device, position, run.runLength))
+		return true;
+
+	if (!m_device->seek(position)) {
+		qCritical() << "BufferedEditor: Failed to seek in file:" << m_device->errorString();
+		return false;
+	}
+
+	for (int index = 0; index < run.runLength; index += runBlockSize) {
+		int length = qMin(run.runLength - index, int(runBlockSize));
+		qint64 bytesWritten = m_device->write(run.runBlock.constData() + run.runBlockOffset(index), length);
+		if (bytesWritten == -1) {
+			qCritical() << "Failed to write to file:" << m_device->errorString();
+			return false;
+		}
+		Q_ASSERT(bytesWritten == length);
+		if (m_counters)
+			m_counters->addWrite(bytesWritten);
+	}
+	return true;
+}
+
+// Copies a restored run of the file from the spill file, a block at a time
+bool SectionBackend::writeFileRun(const Section &run, qint64 position)
+{
+	Q_ASSERT(run.spillOffset != -1);
+	if (!m_device->seek(position)) {
+		qCritical() << "BufferedEditor: Failed to seek in file:" << m_device->errorString();
+		return false;
+	}
+
+	QByteArray bytes;
+	for (int index = 0; index < run.runLength; index += runBlockSize) {
+		int length = qMin(run.runLength - index, int(runBlockSize));
+		if (!m_spill->read(run.spillOffset + index, length, bytes))
+			return false;
+		qint64 bytesWritten = m_device->write(bytes);
+		if (bytesWritten == -1) {
+			qCritical() << "Failed to write to file:" << m_device->errorString();
+			return false;
+		}
+		Q_ASSERT(bytesWritten == length);
+		if (m_counters)
+			m_counters->addWrite(bytesWritten);
+	}
+	return true;
+}
+
+// The sections that are still where they were saved and only had bytes
+// replaced. Only their modified bytes have to be written
+Bitmap SectionBackend::sectionsModifiedInPlace() const
+{
+	Bitmap inPlace(m_sections.size(), false);
+	for (int i = 0; i < m_sections.size(); ++i) {
+		const Section &s = m_sections[i];
+		if (s.isModified() && s.savedPosition == sectionPosition(i) && s.isModifiedInPlace())
+			inPlace.set(i, true);
+	}
+	return inPlace;
+}
+
+// The gaps between the loaded sections are not modified, but have to
+// be *moved* to a different position in the file because of insertions
+// or deletions that have happened in some loaded sections. The
+// sections that aren't written again stay where they are
+void SectionBackend::addMoves(FileMover &mover, const Bitmap &inPlace) const
+{
+	Section dummySection(m_device->size()); // Dummy end section
+	qint64 savedPosition = 0;
+	qint64 currentPosition = 0;
+	for (int i = 0; i <= m_sections.size(); ++i) {
+		const Section &section = i < m_sections.size() ? m_sections[i] : dummySection;
+		Q_ASSERT(savedPosition <= section.savedPosition);
+
+		if (savedPosition != section.savedPosition) {
+			// The length of the gap shouldn't be changed
+			Q_ASSERT(section.savedPosition - savedPosition ==
+					 (i < m_sections.size() ? sectionPosition(i) : m_size) - currentPosition);
+
+			qint64 length = section.savedPosition - savedPosition;
+			mover.addMove(savedPosition, currentPosition, length);
+
+			savedPosition += length;
+			currentPosition += length;
+		}
+		if (i < m_sections.size() && savedPosition == currentPosition &&
+				(!section.isModified() || inPlace.test(i)))
+			mover.addMove(savedPosition, currentPosition, section.savedLength());
+		savedPosition += section.savedLength();
+		currentPosition += section.currentLength();
+	}
+}
+
+// Appends the current bytes in [begin, end) of the section, leaving out the deleted ones
+static void appendPresentBytes(const Bitmap &present, const QByteArray &data, int begin, int end, QByteArray &bytes)
+{
+	for (int i = present.nextSetBit(begin); i != -1 && i < end; i = present.nextSetBit(i + 1))
+		bytes.append(data[i]);
+}
+
+// Adds the modified ranges of a section that only had bytes replaced.
+// Ranges at most `patchMergeDistance` bytes apart are merged along with
+// the bytes between them, so that they take a single write. That goes
+// across the start of the section too when `previous` is the section
+// right before it in the file. The last range is left pending, since
+// the next section may continue it
+void SectionBackend::addPatches(const Section &s, const Section *previous, PendingPatch &pending, PatchWriter &patches)
+{
+	int begin = s.modified.nextSetBit(0);
+	while (begin != -1) {
+		int end = s.modified.nextClearBit(begin);
+		if (end == -1)
+			end = s.size();
+
+		// The bytes of the sections are where they are in the saved file,
+		// so the current bytes in between are the distance in the file
+		qint64 distance = -1;
+		if (pending.section == &s) {
+			distance = s.present.rank(begin) - s.present.rank(pending.end);
+		} else if (pending.section && pending.section == previous) {
+			distance = previous->present.count() - previous->present.rank(pending.end) +
+					s.present.rank(begin);
+		}
+
+		if (distance >= 0 && distance <= patchMergeDistance) {
+			if (pending.section != &s) {
+				appendPresentBytes(previous->present, previous->currentData, pending.end, previous->size(), pending.bytes);
+				pending.end = 0;
+			}
+			// Bytes that were inserted and deleted again are skipped
+			appendPresentBytes(s.present, s.currentData, pending.end, end, pending.bytes);
+		} else {
+			if (pending.section)
+				patches.addPatch(pending.position, pending.bytes);
+			pending.position = s.savedPosition + s.saved.rank(begin);
+			pending.bytes.clear();
+			appendPresentBytes(s.present, s.currentData, begin, end, pending.bytes);
+		}
+		pending.section = &s;
+		pending.end = end;
+
+		begin = end == s.size() ? -1 : s.modified.nextSetBit(end);
+	}
+}
+
+qint64 SectionBackend::sectionPosition(int index) const
+{
+	return m_sectionPositions.prefixSum(index + 1);
+}
+
+// The distance from the current position of the previous section
+// to the current position of this one
+qint64 SectionBackend::sectionDistance(int index) const
+{
+	const Section &s = m_sections[index];
+	if (index == 0)
+		return s.savedPosition;
+
+	// The bytes between two sections are never edited, so their
+	// count is the same in the saved and in the current file
+	return m_sections[index - 1].currentLength() + savedGapBefore(index);
+}
+
+// The number of bytes between the section, or the end of the
+// file, and the previous section that aren't loaded
+qint64 SectionBackend::savedGapBefore(int index) const
+{
+	qint64 savedPosition = index < m_sections.size() ? m_sections[index].savedPosition : m_device->size();
+	if (index == 0)
+		return savedPosition;
+	const Section &prev = m_sections[index - 1];
+	return savedPosition - (prev.savedPosition + prev.savedLength());
+}
+
+void SectionBackend::rebuildSectionPositions()
+{
+	QVector<qint64> distances(m_sections.size());
+	for (int i = 0; i < m_sections.size(); ++i)
+		distances[i] = sectionDistance(i);
+	m_sectionPositions.build(distances);
+	++m_layout;
+}
+
+// Unloads unpinned sections until the memory usage fits in the budget,
+// using the CLOCK approximation of LRU. Returns the new index of the
+// section at `keepIndex`, which is never unloaded, or -1 if it's -1
+int SectionBackend::evictSections(int keepIndex)
+{
+	Bitmap evicted(m_sections.size(), false);
+	int evictedCount = 0;
+
+	// Unload a bit more than needed, so that this doesn't have
+	// to be done again for every section that gets loaded
+	qint64 target = m_memoryBudget / 8 * 7;
+
+	// Two turns of the hand are enough to clear every recently used flag
+	for (int step = 0; step < 2 * m_sections.size() && m_memoryUsage > target; ++step) {
+		if (m_clockHand >= m_sections.size())
+			m_clockHand = 0;
+		Section &s = m_sections[m_clockHand];
+		if (m_clockHand != keepIndex && s.fromFile && !s.runBlock.isEmpty()) {
+			// A restored run of the file stays, only its block goes
+			if (s.recentlyUsed) {
+				s.recentlyUsed = false;
+			} else {
+				m_memoryUsage -= s.runBlock.size();
+				s.runBlock.clear();
+			}
+		} else if (m_clockHand != keepIndex && !evicted.test(m_clockHand) && !s.isPinned()) {
+			if (s.recentlyUsed) {
+				s.recentlyUsed = false;
+			} else {
+				evicted.set(m_clockHand, true);
+				m_memoryUsage -= s.size();
+				++evictedCount;
+			}
+		}
+		++m_clockHand;
+	}
+
+	if (evictedCount == 0)
+		return keepIndex;
+
+	qDebug() << "BufferedEditor: Unloading" << evictedCount << "sections";
+
+	// Remove the evicted sections and remap the indices of the rest
+	QVector<int> newIndices(m_sections.size());
+	int clockHand = 0;
+	int count = 0;
+	for (int i = 0; i < m_sections.size(); ++i) {
+		if (i == m_clockHand)
+			clockHand = count;
+		newIndices[i] = evicted.test(i) ? -1 : count++;
+	}
+	m_sections.removeIf([&evicted](int i) { return evicted.test(i); });
+	m_clockHand = m_clockHand < evicted.size() ? clockHand : count;
+
+	// The bytes of the evicted sections are the same as in the
+	// saved file, so the distances can be recalculated from there
+	rebuildSectionPositions();
+
+	return keepIndex == -1 ? -1 : newIndices[keepIndex];
+}
+
+void SectionBackend::updateSectionsPosition(int firstSectionIndex, qint64 offset)
+{
+	if (firstSectionIndex < m_sections.size())
+		m_sectionPositions.add(firstSectionIndex, offset);
+	++m_layout;
+}
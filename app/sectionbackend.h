@@ -0,0 +1,506 @@
+#ifndef SECTIONBACKEND_H
+#define SECTIONBACKEND_H
+
+#include "editorbackend.h"
+#include "bitmap.h"
+#include "fenwicktree.h"
+#include "filesource.h"
+#include "slabvector.h"
+#include "storagepolicy.h"
+
+#include <QVector>
+#include <QByteArray>
+#include <QPair>
+
+class FileMover;
+class PatchWriter;
+class QFileDevice;
+class SpillFile;
+struct IoCounters;
+
+// Keeps the loaded parts of the file in memory as sections of bytes.
+// Deleted bytes stay in their section, so that they can be restored.
+// Long ranges that aren't loaded are deleted without loading them
+class SectionBackend : public EditorBackend
+{
+public:
+	SectionBackend(QFileDevice *device, SpillFile *spill, IoCounters *counters = nullptr);
+	bool seek(qint64 position) override;
+	qint64 position() const override;
+	qint64 size() const override;
+	void moveForward() override;
+	Byte getByte() override;
+	Span readSpan(qint64 maxLength) override;
+	CursorState cursorState() const override;
+	void setCursorState(const CursorState &state) override;
+	bool isLoaded(qint64 position, qint64 length) override;
+	void load(qint64 position, qint64 length) override;
+	void insertBytes(qint64 position, const QByteArray &bytes) override;
+	void insertPattern(qint64 position, qint64 length, const QByteArray &pattern) override;
+	void deleteRange(qint64 position, qint64 length) override;
+	void replaceRange(qint64 position, const QByteArray &bytes) override;
+	void fillRange(qint64 position, qint64 length, char value) override;
+	bool writeChanges() override;
+	qint64 shiftVolume() override;
+	QVector<Snapshot::Part> contents() override;
+	bool releaseFile() override;
+	void setSaved() override;
+	bool isModified() const override;
+	bool canUndo() const override;
+	bool canRedo() const override;
+	bool undo() override;
+	bool redo() override;
+	void beginTransaction() override;
+	void endTransaction() override;
+	void setHistoryLimit(qint64 bytes) override;
+	void setMemoryBudget(qint64 bytes) override;
+	void setStoragePolicy(const StoragePolicy &policy) override;
+	Statistics statistics() const override;
+
+private:
+	// Shorter patterns are inserted as ordinary bytes
+	static const int minimumRunLength = 16 * 1024;
+	static const int maximumRunLength = 1 << 30;
+	// The most bytes of a run that are generated at once
+	static const int runBlockSize = 64 * 1024;
+	// Unmodified bytes between two modified ones are written along with
+	// them when there are at most this many
+	static const int patchMergeDistance = 256;
+
+	struct Section
+	{
+		qint64 savedPosition;
+		// The saved and the current values of the bytes. Both share
+		// the same memory until a byte of the section gets modified
+		QByteArray savedData;
+		QByteArray currentData;
+		// Which bytes exist in the saved file, which ones still exist
+		// and which ones differ from their saved values
+		Bitmap saved;
+		Bitmap present;
+		Bitmap modified;
+		int modificationCount;
+		// Cleared by the eviction clock hand, set again on every access
+		bool recentlyUsed;
+
+		// A run is a section of bytes that repeat a pattern. It has no
+		// bytes of its own, they are generated from `runBlock`, which
+		// holds the pattern repeated at least `runBlockSize` times over
+		QByteArray runBlock;
+		int patternSize;
+		// Where in the pattern the run starts
+		int patternOffset;
+		int runLength;
+		bool runSaved;
+		bool runPresent;
+		// A run can also stand for bytes of the saved file that were
+		// deleted without being loaded. The bytes are the saved ones until
+		// the file is saved without them, then they're at `spillOffset` in
+		// the spill file. Once restored from there, its block holds the
+		// bytes from `blockStart` on that were read last, if any
+		bool fromFile;
+		qint64 spillOffset;
+		int blockStart;
+
+		bool isRun() const
+		{
+			return patternSize != 0;
+		}
+
+		bool isModified() const
+		{
+			return modificationCount != 0;
+		}
+
+		// Whether the edits only replaced bytes, so that every byte is
+		// still where it is in the saved file
+		bool isModifiedInPlace() const
+		{
+			if (isRun())
+				return false;
+			for (int i = modified.nextSetBit(0); i != -1; i = modified.nextSetBit(i + 1))
+				if (saved.test(i) != present.test(i))
+					return false;
+			return true;
+		}
+
+		// Makes the current bytes the saved ones, now at `position`
+		void markSaved(qint64 position)
+		{
+			modificationCount = 0;
+			savedPosition = position;
+			if (isRun()) {
+				runSaved = runPresent;
+				return;
+			}
+			savedData = currentData;
+			saved = present;
+			modified.fill(false);
+		}
+
+		// Deleted bytes are only kept in memory
+		bool hasDeletedBytes() const
+		{
+			return isRun() ? !runPresent : present.count() != size();
+		}
+
+		// Whether the section has to stay in memory. A run takes up no
+		// memory of its own, and the undo history counts it as a single
+		// slot, which it wouldn't be anymore if it was loaded again
+		bool isPinned() const
+		{
+			return isRun() || isModified() || hasDeletedBytes();
+		}
+
+		int size() const
+		{
+			return present.size();
+		}
+
+		// The undo history counts a whole run as a single slot
+		int slotCount() const
+		{
+			return isRun() ? 1 : size();
+		}
+
+		int savedLength() const
+		{
+			if (isRun())
+				return runSaved ? runLength : 0;
+			return saved.count();
+		}
+
+		int currentLength() const
+		{
+			if (isRun())
+				return runPresent ? runLength : 0;
+			return present.count();
+		}
+
+		// The index of the byte `offset` bytes after the start of the section.
+		// In a run, that's the offset itself
+		int bytePosition(qint64 offset) const
+		{
+			if (offset < 0)
+				return -1;
+			if (isRun())
+				return int(qMin(offset, qint64(runLength)));
+			return present.select(int(qMin(offset, qint64(size()))));
+		}
+
+		Byte byte(int index) const
+		{
+			Byte b;
+			if (isRun()) {
+				char value = runByte(index);
+				if (runSaved)
+					b.saved = value;
+				if (runPresent)
+					b.current = value;
+				return b;
+			}
+			if (saved.test(index))
+				b.saved = savedData[index];
+			if (present.test(index))
+				b.current = currentData[index];
+			return b;
+		}
+
+		// Where in `runBlock` the byte at `index` of the run can be found.
+		// At least `runBlockSize` bytes follow it there, except in a run of
+		// the file, whose block only holds what loadRunBlock() read
+		int runBlockOffset(int index) const
+		{
+			if (fromFile)
+				return index - blockStart;
+			return int((qint64(patternOffset) + index) % patternSize);
+		}
+
+		char runByte(int index) const
+		{
+			return runBlock[runBlockOffset(index)];
+		}
+
+		QByteArray runBytes(int index, int length) const
+		{
+			QByteArray bytes;
+			bytes.reserve(length);
+			while (bytes.size() < length) {
+				int chunk = qMin(length - bytes.size(), runBlockSize);
+				bytes.append(runBlock.constData() + runBlockOffset(index + bytes.size()), chunk);
+			}
+			return bytes;
+		}
+
+		void updateModified(int index)
+		{
+			modified.set(index, !saved.test(index) || !present.test(index) ||
+						 savedData.at(index) != currentData.at(index));
+		}
+
+		void insertBytes(int index, const QByteArray &bytes)
+		{
+			savedData.insert(index, bytes.size(), char(0));
+			currentData.insert(index, bytes);
+			saved.insert(index, bytes.size(), false);
+			present.insert(index, bytes.size(), true);
+			modified.insert(index, bytes.size(), true);
+		}
+
+		// Exchanges the values of `count` current bytes starting at `index`
+		// with `bytes`, skipping the deleted ones in between
+		void swapBytes(int index, char *bytes, int count)
+		{
+			for (int i = index; count > 0; i = present.nextSetBit(i + 1), --count) {
+				char value = currentData.at(i);
+				currentData[i] = *bytes;
+				*bytes++ = value;
+				updateModified(i);
+			}
+		}
+
+		// Deleted bytes keep their value, so that they can be restored.
+		// A run is always deleted as a whole
+		void deleteBytes(int index, const Bitmap &bytes)
+		{
+			if (isRun()) {
+				runPresent = false;
+				return;
+			}
+			present.fill(index, bytes.size(), false);
+			modified.fill(index, bytes.size(), true);
+		}
+
+		void restoreBytes(int index, const Bitmap &bytes)
+		{
+			if (isRun()) {
+				runPresent = true;
+				return;
+			}
+			for (int i = bytes.nextSetBit(0); i != -1; i = bytes.nextSetBit(i + 1)) {
+				present.set(index + i, true);
+				updateModified(index + i);
+			}
+		}
+
+		// Moves the bytes from `index` on into a new section
+		Section split(int index)
+		{
+			Section tail(savedPosition);
+			tail.modificationCount = modificationCount;
+
+			if (isRun()) {
+				Q_ASSERT(index > 0 && index < runLength);
+				tail.savedPosition += runSaved ? index : 0;
+				tail.runBlock = runBlock;
+				tail.patternSize = patternSize;
+				tail.patternOffset = runBlockOffset(index);
+				tail.runLength = runLength - index;
+				tail.runSaved = runSaved;
+				tail.runPresent = runPresent;
+				tail.fromFile = fromFile;
+				tail.spillOffset = spillOffset == -1 ? -1 : spillOffset + index;
+				runLength = index;
+				return tail;
+			}
+
+			Q_ASSERT(index > 0 && index < size());
+			int length = size() - index;
+			tail.savedPosition += saved.rank(index);
+			bool shared = currentData.isSharedWith(savedData);
+			tail.savedData = savedData.mid(index);
+			tail.currentData = shared ? tail.savedData : currentData.mid(index);
+			savedData = savedData.left(index);
+			currentData = shared ? savedData : currentData.left(index);
+			tail.saved = saved.mid(index, length);
+			tail.present = present.mid(index, length);
+			tail.modified = modified.mid(index, length);
+			saved.remove(index, length);
+			present.remove(index, length);
+			modified.remove(index, length);
+			return tail;
+		}
+
+		// Turns a run into an ordinary section holding the same bytes
+		void materialize()
+		{
+			Q_ASSERT(isRun() && runPresent);
+			savedData = currentData = runBytes(0, runLength);
+			saved = Bitmap(runLength, runSaved);
+			present = Bitmap(runLength, true);
+			modified = Bitmap(runLength, !runSaved);
+			runBlock.clear();
+			patternSize = 0;
+			fromFile = false;
+			spillOffset = -1;
+			blockStart = 0;
+		}
+
+		// Copies the data that is still shared with the mapped file
+		void detachFromFile()
+		{
+			bool shared = currentData.isSharedWith(savedData);
+			savedData.detach();
+			if (shared)
+				currentData = savedData;
+			else
+				currentData.detach();
+		}
+
+		// The current bytes of the section with the deleted ones left out
+		QByteArray currentBytes() const
+		{
+			if (present.count() == size())
+				return currentData;
+			QByteArray bytes;
+			bytes.reserve(present.count());
+			for (int i = present.nextSetBit(0); i != -1; i = present.nextSetBit(i + 1))
+				bytes.append(currentData[i]);
+			return bytes;
+		}
+
+		Section() : Section(-1) {}
+		explicit Section(qint64 savedPosition)
+			: savedPosition(savedPosition), modificationCount(0), recentlyUsed(true)
+			, patternSize(0), patternOffset(0), runLength(0), runSaved(false), runPresent(false)
+			, fromFile(false), spillOffset(-1), blockStart(0) {}
+		Section(qint64 savedPosition, const QByteArray &data)
+			: Section(savedPosition)
+		{
+			savedData = currentData = data;
+			saved = present = Bitmap(data.size(), true);
+			modified = Bitmap(data.size(), false);
+		}
+	};
+
+	// An edit, recorded by the current position of its first byte, so
+	// that loading, splitting and unloading sections never touches the
+	// history. Deleted bytes stay in their sections, and the places of
+	// the bytes of a range while it is deleted are recorded along with it
+	struct Modification
+	{
+		enum class Type
+		{
+			Replace, Insert, Delete
+		};
+
+		Type type;
+		qint64 position;
+		qint64 length;
+		// The bytes to swap in when replacing
+		QByteArray bytes;
+		// The deleted bytes of the range start after the `skipped` deleted
+		// slots that follow the byte before it. Of the slots from there on,
+		// `deleted` tells which ones belong to the range
+		int skipped;
+		Bitmap deleted;
+		// Whether this is a continuation of the previous modification
+		bool joined;
+
+		Modification() : Modification(Type::Replace, 0, 0, false) {}
+		Modification(Type type, qint64 position, qint64 length, bool joined)
+			: type(type)
+			, position(position)
+			, length(length)
+			, skipped(0)
+			, joined(joined)
+		{
+		}
+
+		qint64 memoryUsage() const
+		{
+			return qint64(sizeof(Modification)) + bytes.size() + deleted.size() / 8;
+		}
+	};
+
+	// The last modified range found for writing in place, which the
+	// ranges that follow it may still be merged into
+	struct PendingPatch
+	{
+		qint64 position;
+		QByteArray bytes;
+		// The section the range ends in, and where in it
+		const Section *section;
+		int end;
+
+		PendingPatch() : position(0), section(nullptr), end(0) {}
+	};
+
+	QFileDevice *m_device;
+	SpillFile *m_spill;
+	IoCounters *m_counters;
+	FileSource m_source;
+	// The sections and the edits stay in place in their slabs, so loading,
+	// unloading and splitting sections and trimming the history only
+	// shift handles, and their slots are reused instead of reallocated
+	SlabVector<Section> m_sections;
+	// The distances between the current positions of consecutive sections,
+	// the first one being the current position of the first section
+	FenwickTree m_sectionPositions;
+	int m_sectionIndex;
+	int m_sectionLocalPosition;
+	qint64 m_position;
+	qint64 m_size;
+	// Changes whenever the sections are loaded, unloaded, split or edited
+	quint64 m_layout;
+	// The number of bytes held by all loaded sections
+	qint64 m_memoryUsage;
+	qint64 m_memoryBudget;
+	StoragePolicy m_policy;
+	int m_clockHand;
+	// The run block of the holes in the file
+	QByteArray m_zeroBlock;
+	SlabVector<Modification> m_modifications;
+	int m_currentModificationIndex;
+	int m_modificationCount;
+	// The number of modifications made in the current transaction, or -1
+	int m_transactionLength;
+	qint64 m_historyMemoryUsage;
+	qint64 m_historyLimit;
+
+	int sectionSize() const;
+	void moveToNextSection();
+	bool loadCursorSection();
+	QVector<QPair<qint64, qint64>> unloadedRanges(qint64 position, qint64 length);
+	int readAhead(int index);
+	bool loadHole(qint64 position, qint64 begin, qint64 end, Section &run);
+	int getFileRun(qint64 position, qint64 length);
+	bool loadFileRun(Section &run);
+	int loadRunBlock(int index, int offset);
+	bool spillFileRuns();
+	int getSectionIndex(qint64 position);
+	bool getInsertionPoint(qint64 position, int &sectionIndex, int &byteIndex);
+	int getSectionBoundary(qint64 position);
+	int splitSection(int index, int byteIndex);
+	int isolateRun(int index, int offset, int length);
+	int materializeRun(int index, int offset, int length);
+	void insertRun(qint64 position, qint64 length, const QByteArray &pattern, bool joined);
+	bool writeRun(const Section &run, qint64 position);
+	bool writeFileRun(const Section &run, qint64 position);
+	Bitmap sectionsModifiedInPlace() const;
+	void addMoves(FileMover &mover, const Bitmap &inPlace) const;
+	static void addPatches(const Section &s, const Section *previous, PendingPatch &pending, PatchWriter &patches);
+	bool swapBytes(qint64 position, QByteArray &bytes);
+	int swapBytes(qint64 position, char *bytes, int length, int modificationCount);
+	bool removeBytes(Modification &modification);
+	bool restoreBytes(const Modification &modification);
+	int deletedSlotsBefore(int sectionIndex, int slot) const;
+	void discardRedoHistory();
+	void addModification(Modification modification);
+	bool coalesceModification(Modification &previous, const Modification &modification);
+	void trimHistory();
+	void overwriteRange(qint64 position, qint64 length, const QByteArray *bytes, char value);
+	bool doModification(Modification &modification);
+	bool undoModification(Modification &modification);
+	bool stepBack();
+	bool stepForward();
+	void userDoModification(Modification m);
+	qint64 sectionPosition(int index) const;
+	qint64 sectionDistance(int index) const;
+	qint64 savedGapBefore(int index) const;
+	void rebuildSectionPositions();
+	int evictSections(int keepIndex);
+	void updateSectionsPosition(int firstSectionIndex, qint64 offset);
+};
+
+#endif // SECTIONBACKEND_H
@@ -0,0 +1,163 @@
+#ifndef SLABVECTOR_H
+#define SLABVECTOR_H
+
+#include <QVector>
+#include <QtGlobal>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+// A vector that keeps its elements in fixed-size slabs and only holds
+// handles to them, so inserting and removing shifts the handles instead
+// of the elements, and the elements never move in memory. The slot of a
+// removed element is emptied and goes to the next element that's added,
+// so once the vector has grown to its largest size nothing is allocated
+// for the elements anymore
+template<typename T>
+class SlabVector
+{
+public:
+	// How many elements are allocated at once
+	static const int slabSize = 256;
+
+	template<typename Vector, typename Value>
+	class Iterator
+	{
+	public:
+		Iterator(Vector *vector, int index) : m_vector(vector), m_index(index) {}
+		Value &operator*() const { return (*m_vector)[m_index]; }
+		Value *operator->() const { return &(*m_vector)[m_index]; }
+		Iterator &operator++() { ++m_index; return *this; }
+		bool operator==(const Iterator &other) const { return m_index == other.m_index; }
+		bool operator!=(const Iterator &other) const { return m_index != other.m_index; }
+
+	private:
+		Vector *m_vector;
+		int m_index;
+	};
+
+	typedef Iterator<SlabVector, T> iterator;
+	typedef Iterator<const SlabVector, const T> const_iterator;
+
+	SlabVector() {}
+	SlabVector(const SlabVector &) = delete;
+	SlabVector &operator=(const SlabVector &) = delete;
+
+	int size() const
+	{
+		return m_handles.size();
+	}
+
+	bool isEmpty() const
+	{
+		return m_handles.isEmpty();
+	}
+
+	// The number of elements that fit in the slabs allocated so far
+	int capacity() const
+	{
+		return int(m_slabs.size()) * slabSize;
+	}
+
+	T &operator[](int index)
+	{
+		return slot(m_handles[index]);
+	}
+
+	const T &operator[](int index) const
+	{
+		return slot(m_handles[index]);
+	}
+
+	T &last()
+	{
+		return slot(m_handles.last());
+	}
+
+	const T &last() const
+	{
+		return slot(m_handles.last());
+	}
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, size()); }
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, size()); }
+
+	void append(T value)
+	{
+		m_handles.append(allocate(std::move(value)));
+	}
+
+	void insert(int index, T value)
+	{
+		m_handles.insert(index, allocate(std::move(value)));
+	}
+
+	void remove(int index, int count = 1)
+	{
+		for (int i = index; i < index + count; ++i)
+			release(m_handles[i]);
+		m_handles.remove(index, count);
+	}
+
+	// Removes the elements at the indices for which `predicate` is true,
+	// shifting the handles of the rest only once
+	template<typename Predicate>
+	void removeIf(Predicate predicate)
+	{
+		int count = 0;
+		for (int i = 0; i < m_handles.size(); ++i) {
+			if (predicate(i))
+				release(m_handles[i]);
+			else
+				m_handles[count++] = m_handles[i];
+		}
+		m_handles.resize(count);
+	}
+
+	void clear()
+	{
+		remove(0, size());
+	}
+
+private:
+	// A handle is the index of the slot counted over all of the slabs
+	std::vector<std::unique_ptr<T[]>> m_slabs;
+	QVector<int> m_handles;
+	QVector<int> m_freeSlots;
+
+	T &slot(int handle)
+	{
+		return m_slabs[size_t(handle / slabSize)][handle % slabSize];
+	}
+
+	const T &slot(int handle) const
+	{
+		return m_slabs[size_t(handle / slabSize)][handle % slabSize];
+	}
+
+	int allocate(T &&value)
+	{
+		if (m_freeSlots.isEmpty()) {
+			// The lowest slots are handed out first
+			int first = capacity();
+			m_slabs.emplace_back(new T[slabSize]);
+			for (int handle = first + slabSize - 1; handle >= first; --handle)
+				m_freeSlots.append(handle);
+		}
+		int handle = m_freeSlots.takeLast();
+		slot(handle) = std::move(value);
+		return handle;
+	}
+
+	// The element's memory is freed with it, only the slot is kept
+	void release(int handle)
+	{
+		slot(handle) = T();
+		m_freeSlots.append(handle);
+	}
+};
+
+#endif // SLABVECTOR_H
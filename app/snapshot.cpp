@@ -0,0 +1,219 @@
+#include "snapshot.h"
+
+#include <QFile>
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cstring>
+
+Snapshot::Snapshot()
+	: m_size(0)
+	, m_version(0)
+	, m_generation(0)
+{
+}
+
+Snapshot::Snapshot(const QString &fileName, const QVector<Part> &parts, quint64 version, const FileGeneration &fileGeneration,
+				   const QString &spillFileName)
+	: m_fileName(fileName)
+	, m_parts(parts)
+	, m_size(0)
+	, m_version(version)
+	, m_fileGeneration(fileGeneration)
+	, m_generation(fileGeneration ? fileGeneration->loadAcquire() : 0)
+	, m_spillFileName(spillFileName)
+{
+	m_partPositions.reserve(m_parts.size());
+	for (const Part &part : m_parts) {
+		m_partPositions.append(m_size);
+		m_size += part.length;
+	}
+}
+
+Snapshot::Snapshot(const Snapshot &other)
+	: m_fileName(other.m_fileName)
+	, m_parts(other.m_parts)
+	, m_partPositions(other.m_partPositions)
+	, m_size(other.m_size)
+	, m_version(other.m_version)
+	, m_fileGeneration(other.m_fileGeneration)
+	, m_generation(other.m_generation)
+	, m_spillFileName(other.m_spillFileName)
+{
+}
+
+Snapshot &Snapshot::operator=(const Snapshot &other)
+{
+	if (this == &other)
+		return *this;
+	m_fileName = other.m_fileName;
+	m_parts = other.m_parts;
+	m_partPositions = other.m_partPositions;
+	m_size = other.m_size;
+	m_version = other.m_version;
+	m_fileGeneration = other.m_fileGeneration;
+	m_generation = other.m_generation;
+	m_file.reset();
+	m_spillFileName = other.m_spillFileName;
+	m_spillFile.reset();
+	m_errorString.clear();
+	return *this;
+}
+
+Snapshot::~Snapshot()
+{
+}
+
+void Snapshot::addPart(QVector<Part> &parts, const Part &part)
+{
+	if (part.length <= 0)
+		return;
+
+	if (!parts.isEmpty() && (part.source == Part::Source::File || part.source == Part::Source::Spill)) {
+		Part &last = parts.last();
+		if (last.source == part.source && last.offset + last.length == part.offset) {
+			last.length += part.length;
+			return;
+		}
+	}
+	parts.append(part);
+}
+
+QString Snapshot::fileName() const
+{
+	return m_fileName;
+}
+
+QString Snapshot::spillFileName() const
+{
+	return m_spillFileName;
+}
+
+const QVector<Snapshot::Part> &Snapshot::parts() const
+{
+	return m_parts;
+}
+
+qint64 Snapshot::size() const
+{
+	return m_size;
+}
+
+quint64 Snapshot::version() const
+{
+	return m_version;
+}
+
+bool Snapshot::isValid() const
+{
+	return !m_fileGeneration || m_fileGeneration->loadAcquire() == m_generation;
+}
+
+qint64 Snapshot::read(qint64 position, char *data, qint64 maxLength)
+{
+	Q_ASSERT(position >= 0);
+	qint64 length = qMax(qMin(maxLength, m_size - position), qint64(0));
+
+	// The last part that starts at or before the position
+	int index = int(std::upper_bound(m_partPositions.begin(), m_partPositions.end(), position) - m_partPositions.begin()) - 1;
+	for (qint64 bytesRead = 0; bytesRead < length; ++index) {
+		const Part &part = m_parts[index];
+		qint64 offset = position + bytesRead - m_partPositions[index];
+		int count = int(qMin(part.length - offset, length - bytesRead));
+		char *destination = data + bytesRead;
+
+		switch (part.source) {
+		case Part::Source::File:
+			if (!readFile(part.offset + offset, destination, count))
+				return -1;
+			break;
+
+		case Part::Source::Memory:
+			memcpy(destination, part.data.constData() + part.offset + offset, size_t(count));
+			break;
+
+		case Part::Source::Pattern:
+			// Any position in the pattern is followed by the rest of the block
+			for (int i = 0; i < count;) {
+				int chunk = qMin(count - i, part.data.size() - part.patternSize);
+				memcpy(destination + i, part.data.constData() + (part.offset + offset + i) % part.patternSize, size_t(chunk));
+				i += chunk;
+			}
+			break;
+
+		case Part::Source::Spill:
+			if (!readSpill(part.offset + offset, destination, count))
+				return -1;
+			break;
+		}
+		bytesRead += count;
+	}
+	return length;
+}
+
+QByteArray Snapshot::read(qint64 position, qint64 maxLength)
+{
+	QByteArray bytes(int(qMax(qMin(maxLength, m_size - position), qint64(0))), Qt::Uninitialized);
+	qint64 bytesRead = read(position, bytes.data(), bytes.size());
+	bytes.resize(int(qMax(bytesRead, qint64(0))));
+	return bytes;
+}
+
+QString Snapshot::errorString() const
+{
+	return m_errorString;
+}
+
+bool Snapshot::readFile(qint64 offset, char *data, int length)
+{
+	if (!isValid()) {
+		m_errorString = "The file has been saved since";
+		return false;
+	}
+
+	if (!m_file) {
+		m_file.reset(new QFile(m_fileName));
+		if (!m_file->open(QIODevice::ReadOnly)) {
+			m_errorString = m_file->errorString();
+			qCritical() << "Snapshot: Failed to open file" << m_fileName << ":" << m_errorString;
+			m_file.reset();
+			return false;
+		}
+	}
+
+	if (!m_file->seek(offset) || m_file->read(data, length) != length) {
+		m_errorString = m_file->errorString();
+		qCritical() << "Snapshot: Failed to read from file:" << m_errorString;
+		return false;
+	}
+
+	// The file may have been written over while it was being read
+	if (!isValid()) {
+		m_errorString = "The file has been saved since";
+		return false;
+	}
+	return true;
+}
+
+// The spill file is only ever appended to, so what a part refers to
+// can't change after the snapshot was taken
+bool Snapshot::readSpill(qint64 offset, char *data, int length)
+{
+	if (!m_spillFile) {
+		m_spillFile.reset(new QFile(m_spillFileName));
+		if (!m_spillFile->open(QIODevice::ReadOnly)) {
+			m_errorString = m_spillFile->errorString();
+			qCritical() << "Snapshot: Failed to open spill file" << m_spillFileName << ":" << m_errorString;
+			m_spillFile.reset();
+			return false;
+		}
+	}
+
+	if (!m_spillFile->seek(offset) || m_spillFile->read(data, length) != length) {
+		m_errorString = m_spillFile->errorString();
+		qCritical() << "Snapshot: Failed to read from spill file:" << m_errorString;
+		return false;
+	}
+	return true;
+}
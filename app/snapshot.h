@@ -0,0 +1,93 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+
+class QFile;
+
+// The contents of the editor at one point in time. A snapshot never
+// changes and shares the bytes with the editor instead of copying them,
+// so it can be read on a worker thread while the editing goes on. The
+// parts that come from the saved file can't be read anymore once the
+// file is written over, the editor counts those writes for that
+class Snapshot
+{
+public:
+	// A part of the contents: a range of the saved file, bytes held in
+	// memory, a pattern repeated over and over or a range of the spill file
+	struct Part
+	{
+		enum class Source
+		{
+			File, Memory, Pattern, Spill
+		};
+
+		Source source;
+		// The bytes of a memory part, or the pattern repeated several
+		// times over for a pattern part
+		QByteArray data;
+		// Where the part starts in the saved file, in `data`, in the
+		// pattern or in the spill file
+		qint64 offset;
+		qint64 length;
+		int patternSize;
+
+		Part() : source(Source::File), offset(0), length(0), patternSize(0) {}
+		Part(Source source, const QByteArray &data, qint64 offset, qint64 length, int patternSize = 0)
+			: source(source), data(data), offset(offset), length(length), patternSize(patternSize) {}
+	};
+
+	// How many times the saved file has been written over
+	typedef std::shared_ptr<const QAtomicInteger<quint64>> FileGeneration;
+
+	Snapshot();
+	Snapshot(const QString &fileName, const QVector<Part> &parts, quint64 version, const FileGeneration &fileGeneration,
+			 const QString &spillFileName = QString());
+	// Every copy reads the file on its own, so the copies can be read on
+	// different threads
+	Snapshot(const Snapshot &other);
+	Snapshot &operator=(const Snapshot &other);
+	~Snapshot();
+
+	// Appends a part, merging the ranges of the saved or the spill file that follow each other
+	static void addPart(QVector<Part> &parts, const Part &part);
+
+	QString fileName() const;
+	// The file that the undo history keeps overwritten bytes in
+	QString spillFileName() const;
+	const QVector<Part> &parts() const;
+	qint64 size() const;
+	// The editor's version of the contents, which changes with every edit
+	quint64 version() const;
+	// Whether the saved file is still the one the snapshot refers to
+	bool isValid() const;
+	// Copies up to `maxLength` bytes starting at `position` into `data`.
+	// Returns how many were copied, or -1 if they couldn't be read
+	qint64 read(qint64 position, char *data, qint64 maxLength);
+	QByteArray read(qint64 position, qint64 maxLength);
+	QString errorString() const;
+
+private:
+	QString m_fileName;
+	QVector<Part> m_parts;
+	// Where each part starts in the contents
+	QVector<qint64> m_partPositions;
+	qint64 m_size;
+	quint64 m_version;
+	FileGeneration m_fileGeneration;
+	quint64 m_generation;
+	std::unique_ptr<QFile> m_file;
+	QString m_spillFileName;
+	std::unique_ptr<QFile> m_spillFile;
+	QString m_errorString;
+
+	bool readFile(qint64 offset, char *data, int length);
+	bool readSpill(qint64 offset, char *data, int length);
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,90 @@
+#include "sparsefile.h"
+
+#include <QFileDevice>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <linux/falloc.h>
+#endif
+
+#include <cstring>
+
+bool findHole(QFileDevice *device, qint64 position, qint64 &holeStart, qint64 &holeEnd)
+{
+#if defined(Q_OS_UNIX) && defined(SEEK_HOLE)
+	int fd = device->handle();
+	if (fd == -1)
+		return false;
+
+	// Every file ends with a hole, so only seeking past the end fails
+	off_t start = lseek(fd, position, SEEK_HOLE);
+	if (start == -1)
+		return false;
+	off_t end = lseek(fd, start, SEEK_DATA);
+	if (end == -1) {
+		// There's no data after the hole
+		if (errno != ENXIO)
+			return false;
+		end = lseek(fd, 0, SEEK_END);
+		if (end == -1)
+			return false;
+	}
+	holeStart = start;
+	holeEnd = qMax(end, start);
+	return true;
+#else
+	Q_UNUSED(device)
+	Q_UNUSED(position)
+	Q_UNUSED(holeStart)
+	Q_UNUSED(holeEnd)
+	return false;
+#endif
+}
+
+qint64 holeLength(QFileDevice *device, qint64 position, qint64 length)
+{
+	qint64 holeStart, holeEnd;
+	if (!findHole(device, position, holeStart, holeEnd) || holeStart != position)
+		return 0;
+	return qMin(holeEnd - holeStart, length);
+}
+
+bool punchHole(QFileDevice *device, qint64 position, qint64 length)
+{
+#ifdef Q_OS_LINUX
+	int fd = device->handle();
+	if (fd == -1 || length <= 0)
+		return false;
+	// Whatever the device buffered would land on top of the hole later
+	if (!device->flush())
+		return false;
+
+	// Like a write, the hole extends the file, and the part of it past
+	// the old end is a hole already
+	qint64 size = device->size();
+	if (position + length > size) {
+		if (!device->resize(position + length))
+			return false;
+		length = size - position;
+		if (length <= 0)
+			return true;
+	}
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, position, length) == 0;
+#else
+	Q_UNUSED(device)
+	Q_UNUSED(position)
+	Q_UNUSED(length)
+	return false;
+#endif
+}
+
+bool isZero(const char *data, qint64 length)
+{
+	// Compare the bytes with the ones shifted by one, after checking the first
+	return length <= 0 || (data[0] == 0 && std::memcmp(data, data + 1, size_t(length - 1)) == 0);
+}
@@ -0,0 +1,22 @@
+#ifndef SPARSEFILE_H
+#define SPARSEFILE_H
+
+#include <QtGlobal>
+
+class QFileDevice;
+
+// Holes are ranges of a file that take no space on disk and read as
+// zeros. None of these fail when the file system doesn't support them,
+// the file is treated as if it had no holes instead
+
+// Finds the first hole at or after `position`, which may be an empty one
+// at the end of the file. Returns false when the holes can't be found
+bool findHole(QFileDevice *device, qint64 position, qint64 &holeStart, qint64 &holeEnd);
+// The length of the hole at `position`, at most `length`
+qint64 holeLength(QFileDevice *device, qint64 position, qint64 length);
+// Turns the range into a hole, extending the file if it ends before the
+// range does. The blocks that are only partly in the range are zeroed
+bool punchHole(QFileDevice *device, qint64 position, qint64 length);
+bool isZero(const char *data, qint64 length);
+
+#endif // SPARSEFILE_H
@@ -0,0 +1,101 @@
+#include "spillfile.h"
+#include "iocounters.h"
+
+#include <QDir>
+#include <QFileDevice>
+#include <QFileInfo>
+#include <QTemporaryFile>
+
+#include <QDebug>
+
+SpillFile::SpillFile(QFileDevice *device, IoCounters *counters)
+	: m_device(device)
+	, m_counters(counters)
+	, m_size(0)
+{
+}
+
+SpillFile::~SpillFile()
+{
+}
+
+qint64 SpillFile::append(qint64 position, qint64 length)
+{
+	if (!m_file && !open())
+		return -1;
+
+	if (!m_device->seek(position) || !m_file->seek(m_size)) {
+		qCritical() << "SpillFile: Failed to seek:" << m_device->errorString() << m_file->errorString();
+		return -1;
+	}
+
+	QByteArray buffer;
+	for (qint64 index = 0; index < length;) {
+		int count = int(qMin(length - index, qint64(copyBufferSize)));
+		buffer.resize(count);
+		if (m_device->read(buffer.data(), count) != count) {
+			qCritical() << "SpillFile: Failed to read from file:" << m_device->errorString();
+			return -1;
+		}
+		if (m_counters)
+			m_counters->addRead(count);
+		if (m_file->write(buffer) != count) {
+			qCritical() << "SpillFile: Failed to write to" << m_file->fileName() << ":" << m_file->errorString();
+			return -1;
+		}
+		index += count;
+	}
+
+	// The snapshots read the bytes through a file of their own
+	if (!m_file->flush()) {
+		qCritical() << "SpillFile: Failed to write to" << m_file->fileName() << ":" << m_file->errorString();
+		return -1;
+	}
+
+	qint64 offset = m_size;
+	m_size += length;
+	return offset;
+}
+
+bool SpillFile::read(qint64 offset, int length, QByteArray &data)
+{
+	Q_ASSERT(m_file && offset >= 0 && offset + length <= m_size);
+	data.resize(length);
+	if (!m_file->seek(offset) || m_file->read(data.data(), length) != length) {
+		qCritical() << "SpillFile: Failed to read from" << m_file->fileName() << ":" << m_file->errorString();
+		data.clear();
+		return false;
+	}
+	return true;
+}
+
+qint64 SpillFile::size() const
+{
+	return m_size;
+}
+
+QString SpillFile::fileName() const
+{
+	return m_file ? m_file->fileName() : QString();
+}
+
+// The spill file goes next to the edited one, which is where there's room
+// for its bytes, or to the temporary directory if that can't be written to
+bool SpillFile::open()
+{
+	QFileInfo info(m_device->fileName());
+	QStringList templates;
+	if (!m_device->fileName().isEmpty())
+		templates.append(info.absolutePath() + "/." + info.fileName() + ".hexed-spill-XXXXXX");
+	templates.append(QDir::tempPath() + "/hexed-spill-XXXXXX");
+
+	for (const QString &name : templates) {
+		std::unique_ptr<QTemporaryFile> file(new QTemporaryFile(name));
+		if (file->open()) {
+			m_file = std::move(file);
+			return true;
+		}
+		qWarning() << "SpillFile: Failed to create" << name << ":" << file->errorString();
+	}
+	return false;
+}
@@ -0,0 +1,45 @@
+#ifndef SPILLFILE_H
+#define SPILLFILE_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <memory>
+
+class QFileDevice;
+class QTemporaryFile;
+struct IoCounters;
+
+// Keeps the bytes of the saved file that the undo history still refers to
+// once the file is written over. They're copied to a temporary file next
+// to it, so that undoing a large deletion takes disk space rather than
+// memory. The spill file only grows, so whatever was copied to it stays
+// where it is and can be read by the snapshots on other threads too
+class SpillFile
+{
+public:
+	explicit SpillFile(QFileDevice *device, IoCounters *counters = nullptr);
+	~SpillFile();
+
+	// Copies [position, position + length) of the device's file to the end
+	// of the spill file. Returns where it starts there, or -1 on failure
+	qint64 append(qint64 position, qint64 length);
+	// Sets `data` to the bytes in [offset, offset + length)
+	bool read(qint64 offset, int length, QByteArray &data);
+	qint64 size() const;
+	// Empty until something has been copied
+	QString fileName() const;
+
+private:
+	// The most bytes that are copied at once
+	static const int copyBufferSize = 1024 * 1024;
+
+	QFileDevice *m_device;
+	IoCounters *m_counters;
+	std::unique_ptr<QTemporaryFile> m_file;
+	qint64 m_size;
+
+	bool open();
+};
+
+#endif // SPILLFILE_H
@@ -0,0 +1,97 @@
+#include "storagepolicy.h"
+
+#include <QFileDevice>
+
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+StoragePolicy::StoragePolicy()
+	: m_blockSize(4096)
+	, m_minimumSectionSize(defaultMinimumSectionSize)
+	, m_maximumSectionSize(defaultMaximumSectionSize)
+	, m_readAheadLength(defaultReadAheadLength)
+	, m_sectionSize(defaultSectionSize)
+	, m_lastReadStart(-1)
+	, m_lastReadEnd(-1)
+{
+}
+
+StoragePolicy::StoragePolicy(QFileDevice *device)
+	: StoragePolicy()
+{
+	int blockSize = m_blockSize;
+#ifdef Q_OS_UNIX
+	blockSize = int(sysconf(_SC_PAGESIZE));
+	struct stat status;
+	if (device->handle() != -1 && fstat(device->handle(), &status) == 0)
+		blockSize = qMax(blockSize, int(qMin(status.st_blksize, blksize_t(maximumBlockSize))));
+#else
+	Q_UNUSED(device);
+#endif
+	setBlockSize(blockSize);
+}
+
+int StoragePolicy::blockSize() const
+{
+	return m_blockSize;
+}
+
+void StoragePolicy::setBlockSize(int bytes)
+{
+	Q_ASSERT(bytes > 0);
+	m_blockSize = bytes;
+	setSectionSizeLimits(m_minimumSectionSize, m_maximumSectionSize);
+}
+
+int StoragePolicy::minimumSectionSize() const
+{
+	return m_minimumSectionSize;
+}
+
+int StoragePolicy::maximumSectionSize() const
+{
+	return m_maximumSectionSize;
+}
+
+void StoragePolicy::setSectionSizeLimits(int minimum, int maximum)
+{
+	m_minimumSectionSize = qMax(int(alignDown(minimum)), m_blockSize);
+	m_maximumSectionSize = qMax(int(alignDown(maximum)), m_minimumSectionSize);
+	m_sectionSize = qBound(m_minimumSectionSize, int(alignDown(m_sectionSize)), m_maximumSectionSize);
+}
+
+int StoragePolicy::readAheadLength() const
+{
+	return m_readAheadLength;
+}
+
+void StoragePolicy::setReadAheadLength(int bytes)
+{
+	m_readAheadLength = bytes;
+}
+
+int StoragePolicy::sectionSize() const
+{
+	return m_sectionSize;
+}
+
+qint64 StoragePolicy::alignDown(qint64 position) const
+{
+	return position - position % m_blockSize;
+}
+
+void StoragePolicy::recordRead(qint64 position, qint64 length)
+{
+	// Reading on from the previous read, in either direction, means
+	// that the bytes around it will be needed too
+	bool sequential = position == m_lastReadEnd || position + length == m_lastReadStart;
+	m_lastReadStart = position;
+	m_lastReadEnd = position + length;
+
+	if (sequential)
+		m_sectionSize = qMin(m_sectionSize * 2, m_maximumSectionSize);
+	else
+		m_sectionSize = qMax(int(alignDown(m_sectionSize / 2)), m_minimumSectionSize);
+}
@@ -0,0 +1,54 @@
+#ifndef STORAGEPOLICY_H
+#define STORAGEPOLICY_H
+
+#include <QtGlobal>
+
+class QFileDevice;
+
+// Decides how much of the file is read at once. The sections grow while
+// the file is read in one direction and shrink while it's read all over
+// the place, staying within the limits. They start and end on multiples
+// of the block size, which comes from the file system
+class StoragePolicy
+{
+public:
+	static const int defaultMinimumSectionSize = 4 * 1024;
+	static const int defaultSectionSize = 16 * 1024;
+	static const int defaultMaximumSectionSize = 256 * 1024;
+	static const int defaultReadAheadLength = 1024 * 1024;
+	// Larger blocks, as some network file systems report, aren't worth
+	// reading whole for a single byte
+	static const int maximumBlockSize = 64 * 1024;
+
+	StoragePolicy();
+	// Uses the block size of the file system the file is on
+	explicit StoragePolicy(QFileDevice *device);
+
+	int blockSize() const;
+	void setBlockSize(int bytes);
+	int minimumSectionSize() const;
+	int maximumSectionSize() const;
+	// The limits are rounded to the block size. The sections are always
+	// the same size when they're equal
+	void setSectionSizeLimits(int minimum, int maximum);
+	// How much is loaded at once when reading the file sequentially
+	int readAheadLength() const;
+	void setReadAheadLength(int bytes);
+
+	// How much to read for the next section
+	int sectionSize() const;
+	qint64 alignDown(qint64 position) const;
+	// Adapts the section size to a read of the range
+	void recordRead(qint64 position, qint64 length);
+
+private:
+	int m_blockSize;
+	int m_minimumSectionSize;
+	int m_maximumSectionSize;
+	int m_readAheadLength;
+	int m_sectionSize;
+	qint64 m_lastReadStart;
+	qint64 m_lastReadEnd;
+};
+
+#endif // STORAGEPOLICY_H
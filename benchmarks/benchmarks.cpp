@@ -0,0 +1,331 @@
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+#include <QTemporaryFile>
+
+#include "bufferededitor.h"
+
+class BenchmarkObject : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void benchmarkRandomSeek_data();
+	void benchmarkRandomSeek();
+	void benchmarkInsertDelete_data();
+	void benchmarkInsertDelete();
+	void benchmarkBrowseAfterEdits_data();
+	void benchmarkBrowseAfterEdits();
+	void benchmarkSequentialRead_data();
+	void benchmarkSequentialRead();
+	void benchmarkSaveAfterInsert_data();
+	void benchmarkSaveAfterInsert();
+	void benchmarkSaveStrategies_data();
+	void benchmarkSaveStrategies();
+	void benchmarkSectionSizes_data();
+	void benchmarkSectionSizes();
+
+private:
+	static const qint64 sectionSize = 16 * 1024;
+
+	// Sections of `sectionSize` bytes, so that there are as many as asked for
+	static void useFixedSectionSize(BufferedEditor &editor);
+
+	static void addSectionCounts();
+	static void loadSections(BufferedEditor &editor, int sectionCount);
+};
+
+void BenchmarkObject::addSectionCounts()
+{
+	QTest::addColumn<int>("sectionCount");
+
+	QTest::newRow("1k sections") << 1000;
+	QTest::newRow("10k sections") << 10000;
+	QTest::newRow("100k sections") << 100000;
+}
+
+void BenchmarkObject::useFixedSectionSize(BufferedEditor &editor)
+{
+	StoragePolicy policy = editor.storagePolicy();
+	policy.setSectionSizeLimits(sectionSize, sectionSize);
+	editor.setStoragePolicy(policy);
+}
+
+// Loads every section of the file and makes an edit in the first
+// one so that the positions of all the others are shifted
+void BenchmarkObject::loadSections(BufferedEditor &editor, int sectionCount)
+{
+	useFixedSectionSize(editor);
+	for (int i = 0; i < sectionCount; ++i)
+		QVERIFY(editor.seek(i * sectionSize));
+	QVERIFY(editor.seek(0));
+	editor.insertByte(char(0xff));
+}
+
+void BenchmarkObject::benchmarkRandomSeek_data()
+{
+	addSectionCounts();
+}
+
+void BenchmarkObject::benchmarkRandomSeek()
+{
+	QFETCH(int, sectionCount);
+
+	// A sparse file, so only the loaded sections take up memory
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QVERIFY(file.resize(sectionCount * sectionSize));
+
+	BufferedEditor editor(&file, BufferedEditor::Backend::Sections);
+	loadSections(editor, sectionCount);
+
+	quint32 seed = 1;
+	QBENCHMARK {
+		for (int i = 0; i < 100000; ++i) {
+			seed = seed * 1103515245 + 12345;
+			editor.seek(qint64(seed) % editor.size());
+		}
+	}
+}
+
+void BenchmarkObject::benchmarkInsertDelete_data()
+{
+	addSectionCounts();
+}
+
+void BenchmarkObject::benchmarkInsertDelete()
+{
+	QFETCH(int, sectionCount);
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QVERIFY(file.resize(sectionCount * sectionSize));
+
+	BufferedEditor editor(&file, BufferedEditor::Backend::Sections);
+	loadSections(editor, sectionCount);
+
+	// Every edit shifts all of the following sections
+	QBENCHMARK {
+		for (int i = 0; i < 10000; ++i) {
+			editor.seek(sectionSize / 2);
+			editor.insertByte(char(0));
+			editor.seek(sectionSize / 2);
+			editor.deleteByte();
+		}
+	}
+}
+
+void BenchmarkObject::benchmarkBrowseAfterEdits_data()
+{
+	QTest::addColumn<int>("editCount");
+
+	QTest::newRow("no edits") << 0;
+	QTest::newRow("1M edits") << 1000000;
+}
+
+void BenchmarkObject::benchmarkBrowseAfterEdits()
+{
+	QFETCH(int, editCount);
+
+	const int sectionCount = 10000;
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QVERIFY(file.resize(sectionCount * sectionSize));
+
+	// Only a few sections fit, so browsing keeps loading and unloading them
+	BufferedEditor editor(&file, BufferedEditor::Backend::Sections);
+	useFixedSectionSize(editor);
+	editor.setMemoryBudget(64 * sectionSize);
+
+	// The edits all go to the first section, the rest stays unmodified
+	quint32 seed = 1;
+	for (int i = 0; i < editCount; ++i) {
+		seed = seed * 1103515245 + 12345;
+		editor.seek(qint64(seed) % sectionSize);
+		editor.replaceByte(char(i));
+	}
+
+	QBENCHMARK {
+		for (int i = 0; i < 10000; ++i) {
+			seed = seed * 1103515245 + 12345;
+			editor.seek(qint64(seed) % editor.size());
+		}
+	}
+}
+
+void BenchmarkObject::benchmarkSequentialRead_data()
+{
+	addSectionCounts();
+}
+
+void BenchmarkObject::benchmarkSequentialRead()
+{
+	QFETCH(int, sectionCount);
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QVERIFY(file.resize(sectionCount * sectionSize));
+
+	BufferedEditor editor(&file, BufferedEditor::Backend::Sections);
+	loadSections(editor, sectionCount);
+
+	// Reading in short spans, like the finder does, crosses into
+	// the next section every few reads
+	QBENCHMARK {
+		QVERIFY(editor.seek(0));
+		while (!editor.atEnd())
+			editor.readSpan(1024);
+	}
+}
+
+void BenchmarkObject::benchmarkSaveAfterInsert_data()
+{
+	QTest::addColumn<int>("backend");
+	QTest::addColumn<qint64>("fileSize");
+	QTest::addColumn<int>("insertLength");
+
+	const int sections = int(BufferedEditor::Backend::Sections);
+	const int pieceTable = int(BufferedEditor::Backend::PieceTable);
+	const qint64 mebibyte = 1024 * 1024;
+	QTest::newRow("sections 64 MiB, 1 byte") << sections << 64 * mebibyte << 1;
+	QTest::newRow("sections 256 MiB, 1 byte") << sections << 256 * mebibyte << 1;
+	QTest::newRow("sections 256 MiB, 4 KiB") << sections << 256 * mebibyte << 4096;
+	QTest::newRow("piece table 64 MiB, 1 byte") << pieceTable << 64 * mebibyte << 1;
+	QTest::newRow("piece table 256 MiB, 1 byte") << pieceTable << 256 * mebibyte << 1;
+	QTest::newRow("piece table 256 MiB, 4 KiB") << pieceTable << 256 * mebibyte << 4096;
+}
+
+void BenchmarkObject::benchmarkSaveAfterInsert()
+{
+	QFETCH(int, backend);
+	QFETCH(qint64, fileSize);
+	QFETCH(int, insertLength);
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QVERIFY(file.resize(fileSize));
+
+	// Every save moves the whole file after the start, alternating
+	// between moving it towards the end and towards the beginning. A
+	// whole block may be shifted by the file system instead
+	BufferedEditor editor(&file, BufferedEditor::Backend(backend));
+	bool inserted = false;
+	QBENCHMARK {
+		if (inserted)
+			editor.deleteRange(0, insertLength);
+		else
+			editor.insertBytes(0, QByteArray(insertLength, char(0xff)));
+		inserted = !inserted;
+		QVERIFY(editor.writeChanges());
+	}
+}
+
+void BenchmarkObject::benchmarkSaveStrategies_data()
+{
+	QTest::addColumn<int>("backend");
+	QTest::addColumn<int>("strategy");
+
+	const int sections = int(BufferedEditor::Backend::Sections);
+	const int pieceTable = int(BufferedEditor::Backend::PieceTable);
+	const int inPlace = int(BufferedEditor::SaveStrategy::InPlace);
+	const int newFile = int(BufferedEditor::SaveStrategy::NewFile);
+	QTest::newRow("sections in place") << sections << inPlace;
+	QTest::newRow("sections new file") << sections << newFile;
+	QTest::newRow("piece table in place") << pieceTable << inPlace;
+	QTest::newRow("piece table new file") << pieceTable << newFile;
+}
+
+void BenchmarkObject::benchmarkSaveStrategies()
+{
+	QFETCH(int, backend);
+	QFETCH(int, strategy);
+
+	// The file is replaced when saving to a new file, so it has to be
+	// opened by name
+	const qint64 fileSize = 256 * 1024 * 1024;
+	QTemporaryFile temporaryFile;
+	QVERIFY(temporaryFile.open());
+	QFile file(temporaryFile.fileName());
+	QVERIFY(file.open(QIODevice::ReadWrite));
+	QVERIFY(file.resize(fileSize));
+
+	// Insertions all over the file, so nearly all of it has to move
+	BufferedEditor editor(&file, BufferedEditor::Backend(backend));
+	editor.setSaveStrategy(BufferedEditor::SaveStrategy(strategy));
+	QBENCHMARK {
+		for (qint64 position = 0; position < fileSize; position += fileSize / 1000)
+			editor.insertBytes(position, QByteArray(1, char(0xff)));
+		QVERIFY(editor.writeChanges());
+	}
+}
+
+void BenchmarkObject::benchmarkSectionSizes_data()
+{
+	QTest::addColumn<int>("backend");
+	QTest::addColumn<int>("minimumSectionSize");
+	QTest::addColumn<int>("maximumSectionSize");
+	QTest::addColumn<bool>("sequential");
+
+	const int sections = int(BufferedEditor::Backend::Sections);
+	const int pieceTable = int(BufferedEditor::Backend::PieceTable);
+	const int adaptiveMinimum = StoragePolicy::defaultMinimumSectionSize;
+	const int adaptiveMaximum = StoragePolicy::defaultMaximumSectionSize;
+	for (int backend : {sections, pieceTable}) {
+		for (bool sequential : {true, false}) {
+			QString name = QString(backend == sections ? "sections" : "piece table") +
+					(sequential ? ", sequential" : ", random");
+			for (int size : {4096, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024})
+				QTest::newRow(qPrintable(name + QString(", %1 KiB").arg(size / 1024)))
+						<< backend << size << size << sequential;
+			QTest::newRow(qPrintable(name + ", adaptive"))
+					<< backend << adaptiveMinimum << adaptiveMaximum << sequential;
+		}
+	}
+}
+
+// Reads a file with different section sizes. The file is created in
+// HEXED_BENCHMARK_DIR if it's set, so that the sizes can be tuned for
+// the storage there. The page cache is only cold on the first run
+void BenchmarkObject::benchmarkSectionSizes()
+{
+	QFETCH(int, backend);
+	QFETCH(int, minimumSectionSize);
+	QFETCH(int, maximumSectionSize);
+	QFETCH(bool, sequential);
+
+	const qint64 fileSize = 256 * 1024 * 1024;
+	QString directory = qEnvironmentVariable("HEXED_BENCHMARK_DIR", QDir::tempPath());
+	QTemporaryFile file(QDir(directory).filePath("hexed-benchmark-XXXXXX"));
+	QVERIFY(file.open());
+	QByteArray block(1024 * 1024, char(0));
+	for (int i = 0; i < block.size(); ++i)
+		block[i] = char(i * 7 + i / 4096);
+	for (qint64 position = 0; position < fileSize; position += block.size())
+		QVERIFY(file.write(block) == block.size());
+	QVERIFY(file.flush());
+
+	BufferedEditor editor(&file, BufferedEditor::Backend(backend));
+	StoragePolicy policy = editor.storagePolicy();
+	policy.setSectionSizeLimits(minimumSectionSize, maximumSectionSize);
+	editor.setStoragePolicy(policy);
+
+	quint32 seed = 1;
+	QBENCHMARK {
+		if (sequential) {
+			QVERIFY(editor.seek(0));
+			while (!editor.atEnd())
+				editor.readSpan(64 * 1024);
+		} else {
+			// Short reads all over the file, like jumping to addresses
+			for (int i = 0; i < 10000; ++i) {
+				seed = seed * 1103515245 + 12345;
+				QVERIFY(editor.seek(qint64(seed) % (fileSize - 16)));
+				editor.read(16);
+			}
+		}
+	}
+}
+
+QTEST_MAIN(BenchmarkObject)
+
+#include "benchmarks.moc"
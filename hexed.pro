@@ -1,2 +1,2 @@
 TEMPLATE = subdirs
-SUBDIRS += app tests
+SUBDIRS += app tests benchmarks
@@ -4,14 +4,26 @@
 #include <QTemporaryFile>
 
 #include <algorithm>
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
 
 #include "bufferededitor.h"
+#include "editjournal.h"
 #include "finder.h"
+#include "memorygovernor.h"
+#include "slabvector.h"
+#include "sparsefile.h"
+#include "storagepolicy.h"
 
 class TestObject : public QObject
 {
 	Q_OBJECT
 
+public:
+	explicit TestObject(BufferedEditor::Backend backend)
+		: m_backend(backend) {}
+
 private slots:
 	void testReading();
 	void testDeleting();
@@ -19,8 +31,32 @@ private slots:
 	void testReadingInsertingAndDeleting();
 	void testUndoRedo();
 	void testFindNext();
+	void testMemoryBudget();
+	void testEditingAfterSaving();
+	void testReadingSpans();
+	void testRangeOperations();
+	void testInsertingPatterns();
+	void testTransactions();
+	void testReadingAhead();
+	void testLoadingInBackground();
+	void testPatchingInPlace();
+	void testShiftingBlocks();
+	void testSavingToNewFile();
+	void testSavingInBackground();
+	void testSparseFiles();
+	void testCursors();
+	void testSnapshots();
+	void testSectionSizes();
+	void testStatistics();
+	void testMemoryGovernor();
+	void testSlabVector();
+	void testJournal();
+	void testSpillingDeletedBytes();
+	void testFillingLargeRanges();
 
 private:
+	BufferedEditor::Backend m_backend;
+
 	struct Indices4
 	{
 		int r, i, d;
@@ -219,13 +255,1420 @@ void TestObject::testFindNext()
 					   {{0, createByteArray(10, [](int i) { return 100 + i; })}});
 }
 
+void TestObject::testMemoryBudget()
+{
+	QByteArray data = createByteArray(1'000'000, [](int i) { return i * 7 + 5; });
+	QByteArray expectedData = data;
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+	{
+		// Only a few sections fit in the budget
+		BufferedEditor e(&file, m_backend);
+		e.setMemoryBudget(64 * 1024);
+		QCOMPARE(e.memoryBudget(), qint64(64 * 1024));
+
+		for (int i = 0; i < 10'000; ++i) {
+			int r = (i * 7919 + 13) % expectedData.size();
+			e.seek(r);
+			auto b = e.getByte();
+			Q_ASSERT(b.current);
+			QCOMPARE(*b.current, expectedData[r]);
+
+			// Edit near the beginning from time to time, so that the
+			// evicted sections have to be found after a shift
+			if (i % 100 == 0) {
+				int d = (i * 31 + 7) % 100'000;
+				e.seek(d);
+				e.deleteByte();
+				expectedData.remove(d, 1);
+				e.seek(d / 2);
+				e.insertByte(char(i));
+				expectedData.insert(d / 2, char(i));
+			}
+		}
+
+		// Undo some of the edits after their sections have been evicted and reloaded
+		for (int i = 0; i < 20; ++i)
+			e.undo();
+		for (int i = 0; i < 20; ++i)
+			e.redo();
+
+		// Read the whole file a couple of times
+		for (int pass = 0; pass < 2; ++pass) {
+			QVERIFY(e.seek(0));
+			for (int i = 0; i < expectedData.size(); ++i)
+				QCOMPARE(*e.getByte().current, expectedData[i]);
+		}
+		QVERIFY(e.writeChanges());
+	}
+	QVERIFY(file.seek(0));
+	QByteArray actualData = file.readAll();
+	QCOMPARE(actualData, expectedData);
+}
+
+void TestObject::testEditingAfterSaving()
+{
+	QByteArray expectedData = createByteArray(200'000, [](int i) { return i * 13 + 1; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(expectedData);
+	{
+		BufferedEditor e(&file, m_backend);
+		for (int round = 0; round < 4; ++round) {
+			// Grow the file in some rounds and shrink it in others
+			for (int i = 0; i < 1000; ++i) {
+				int position = (i * 193 + round * 7) % (expectedData.size() - 1);
+				e.seek(position);
+				if ((round + i) % 3 == 0) {
+					e.insertByte(char(i));
+					expectedData.insert(position, char(i));
+				} else if (round % 2 == 0) {
+					e.deleteByte();
+					expectedData.remove(position, 1);
+				} else {
+					e.replaceByte(char(i + 1));
+					expectedData[position] = char(i + 1);
+				}
+			}
+			QVERIFY(e.writeChanges());
+			QCOMPARE(e.size(), qint64(expectedData.size()));
+
+			QVERIFY(e.seek(0));
+			for (int i = 0; i < expectedData.size(); ++i)
+				QCOMPARE(*e.getByte().current, expectedData[i]);
+		}
+	}
+	QVERIFY(file.seek(0));
+	QByteArray actualData = file.readAll();
+	QCOMPARE(actualData, expectedData);
+}
+
+void TestObject::testReadingSpans()
+{
+	QByteArray data = createByteArray(300'000, [](int i) { return i * 11 + 3; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	BufferedEditor e(&file, m_backend);
+	for (int i = 0; i < 2000; ++i) {
+		e.seek((i * 149 + 17) % (e.size() - 1));
+		switch (i % 3) {
+		case 0: e.insertByte(char(i)); break;
+		case 1: e.deleteByte(); break;
+		case 2: e.replaceByte(char(i)); break;
+		}
+	}
+
+	// Collect the expected bytes one at a time
+	QByteArray expectedData;
+	QVector<bool> expectedModified;
+	e.seek(0);
+	while (!e.atEnd()) {
+		auto b = e.getByte();
+		expectedData.append(*b.current);
+		expectedModified.append(b.isModified());
+	}
+
+	// Read the same bytes in spans of different lengths
+	for (qint64 maxLength : {1, 7, 4096, 1'000'000}) {
+		QVERIFY(e.seek(0));
+		int position = 0;
+		while (!e.atEnd()) {
+			BufferedEditor::Span span = e.readSpan(maxLength);
+			QVERIFY(span.length > 0 && span.length <= maxLength);
+			QCOMPARE(QByteArray(span.data(), span.length), expectedData.mid(position, span.length));
+			for (int i = 0; i < span.length; ++i)
+				QCOMPARE(span.modified, bool(expectedModified[position + i]));
+			position += span.length;
+			QCOMPARE(e.position(), qint64(position));
+		}
+		QCOMPARE(position, expectedData.size());
+	}
+
+	QVERIFY(e.seek(1000));
+	QCOMPARE(e.read(100'000), expectedData.mid(1000, 100'000));
+	QCOMPARE(e.position(), qint64(101'000));
+	QVERIFY(e.seek(e.size() - 10));
+	QCOMPARE(e.read(100), expectedData.right(10));
+}
+
+void TestObject::testRangeOperations()
+{
+	QByteArray data = createByteArray(50'000, [](int i) { return i * 7 + 3; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	// Sections get unloaded and loaded again between the edits
+	BufferedEditor e(&file, m_backend);
+	e.setMemoryBudget(32 * 1024);
+	auto compare = [&e](const QByteArray &expected) {
+		QCOMPARE(e.size(), qint64(expected.size()));
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(expected.size()), expected);
+	};
+
+	// Each state is the data after one more edit
+	QVector<QByteArray> states = {data};
+	for (int i = 0; i < 60; ++i) {
+		int position = (i * 7919) % (data.size() - 1);
+		int length = qMin((i * 131) % 5000 + 1, data.size() - position);
+		switch (i % 5) {
+		case 0:
+			e.insertBytes(position, QByteArray(length, char(i)));
+			data.insert(position, QByteArray(length, char(i)));
+			break;
+		case 1:
+			e.insertBytes(position, length, char(i));
+			data.insert(position, QByteArray(length, char(i)));
+			break;
+		case 2:
+			e.deleteRange(position, length);
+			data.remove(position, length);
+			break;
+		case 3:
+			e.replaceRange(position, QByteArray(length, char(i)));
+			data.replace(position, length, QByteArray(length, char(i)));
+			break;
+		case 4:
+			e.fillRange(position, length, char(i));
+			data.replace(position, length, QByteArray(length, char(i)));
+			break;
+		}
+		states.append(data);
+		compare(data);
+
+		// The edits made before saving have to stay undoable too
+		if (i == 30) {
+			QVERIFY(e.writeChanges());
+			compare(data);
+		}
+	}
+
+	for (int i = states.size() - 2; i >= 0; --i) {
+		QVERIFY(e.canUndo());
+		e.undo();
+		compare(states[i]);
+	}
+	QVERIFY(!e.canUndo());
+
+	for (int i = 1; i < states.size(); ++i) {
+		QVERIFY(e.canRedo());
+		e.redo();
+		compare(states[i]);
+	}
+	QVERIFY(!e.canRedo());
+}
+
+void TestObject::testInsertingPatterns()
+{
+	QByteArray data = createByteArray(100'000, [](int i) { return i * 11 + 5; });
+	QByteArray pattern("\x01\x02\x03", 3);
+	auto repeat = [&pattern](int offset, int length) {
+		QByteArray bytes;
+		for (int i = 0; i < length; ++i)
+			bytes.append(pattern[(offset + i) % pattern.size()]);
+		return bytes;
+	};
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	{
+		BufferedEditor e(&file, m_backend);
+		auto compare = [&e](const QByteArray &expected) {
+			QCOMPARE(e.size(), qint64(expected.size()));
+			QVERIFY(e.seek(0));
+			QCOMPARE(e.read(expected.size()), expected);
+		};
+
+		// Nothing of a huge run is stored
+		e.insertPattern(1000, 8ll << 30, pattern);
+		QCOMPARE(e.size(), data.size() + (8ll << 30));
+		for (qint64 position : {1000ll, 5ll << 30, (8ll << 30) + 999}) {
+			QVERIFY(e.seek(position));
+			QCOMPARE(*e.getByte().current, pattern[int((position - 1000) % pattern.size())]);
+		}
+		QVERIFY(e.seek((8ll << 30) + 1000));
+		QCOMPARE(*e.getByte().current, data[1000]);
+		e.undo();
+		compare(data);
+
+		// Edit a smaller one in every possible way
+		QVector<QByteArray> states = {data};
+		e.insertPattern(50'000, 1'000'000, pattern);
+		data.insert(50'000, repeat(0, 1'000'000));
+		states.append(data);
+		e.replaceRange(20'000, QByteArray(10, 'd'));
+		data.replace(20'000, 10, QByteArray(10, 'd'));
+		states.append(data);
+		e.insertBytes(20'003, QByteArray(4, 'e'));
+		data.insert(20'003, QByteArray(4, 'e'));
+		states.append(data);
+		// Splits the section with the last two edits
+		e.insertPattern(20'005, 30'000, pattern);
+		data.insert(20'005, repeat(0, 30'000));
+		states.append(data);
+		e.replaceRange(60'000, QByteArray(100, 'a'));
+		data.replace(60'000, 100, QByteArray(100, 'a'));
+		states.append(data);
+		e.deleteRange(40'000, 20'000);
+		data.remove(40'000, 20'000);
+		states.append(data);
+		e.insertBytes(500'000, QByteArray(10, 'b'));
+		data.insert(500'000, QByteArray(10, 'b'));
+		states.append(data);
+		e.deleteRange(700'000, 100'000);
+		data.remove(700'000, 100'000);
+		states.append(data);
+		e.insertPattern(800'000, 50'000, pattern);
+		data.insert(800'000, repeat(0, 50'000));
+		states.append(data);
+		e.fillRange(600'000, 300'000, 'c');
+		data.replace(600'000, 300'000, QByteArray(300'000, 'c'));
+		states.append(data);
+		compare(data);
+
+		for (int i = states.size() - 2; i >= 0; --i) {
+			e.undo();
+			compare(states[i]);
+		}
+		for (int i = 1; i < states.size(); ++i) {
+			e.redo();
+			compare(states[i]);
+		}
+
+		QVERIFY(e.writeChanges());
+		compare(data);
+	}
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), data);
+}
+
+void TestObject::testTransactions()
+{
+	QByteArray data = createByteArray(100'000, [](int i) { return i * 7 + 3; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	{
+		BufferedEditor e(&file, m_backend);
+		auto compare = [&e](const QByteArray &expected) {
+			QCOMPARE(e.size(), qint64(expected.size()));
+			QVERIFY(e.seek(0));
+			QCOMPARE(e.read(expected.size()), expected);
+		};
+
+		// Typing, overwriting and deleting in both directions is a single step
+		QByteArray original = data;
+		QSignalSpy sizeSpy(&e, &BufferedEditor::sizeChanged);
+		e.beginTransaction();
+		for (int i = 0; i < 1000; ++i) {
+			e.insertBytes(30'000 + i, QByteArray(1, 'a'));
+			data.insert(30'000 + i, 'a');
+			e.replaceRange(60'000 + i, QByteArray(1, 'b'));
+			data[60'000 + i] = 'b';
+			e.deleteRange(70'000, 1);
+			data.remove(70'000, 1);
+			e.deleteRange(20'000 - i - 1, 1);
+			data.remove(20'000 - i - 1, 1);
+		}
+		// Nested transactions are part of the outer one
+		e.beginTransaction();
+		e.insertBytes(0, "xyz");
+		e.endTransaction();
+		QCOMPARE(sizeSpy.count(), 0);
+		e.endTransaction();
+		QCOMPARE(sizeSpy.count(), 1);
+		data.insert(0, "xyz");
+		compare(data);
+
+		e.undo();
+		QVERIFY(!e.canUndo());
+		compare(original);
+		e.redo();
+		QVERIFY(!e.canRedo());
+		compare(data);
+
+		// Within the limit every step is kept
+		QVector<QByteArray> states = {data};
+		for (int i = 0; i < 100; ++i) {
+			e.replaceRange(i * 900, QByteArray(800, char(i)));
+			data.replace(i * 900, 800, QByteArray(800, char(i)));
+			states.append(data);
+		}
+		for (int i = 99; i >= 0; --i) {
+			e.undo();
+			compare(states[i]);
+		}
+		QVERIFY(e.canUndo());
+		while (e.canRedo())
+			e.redo();
+		compare(data);
+
+		// Beyond it the oldest steps are forgotten, but never the last one
+		e.setHistoryLimit(0);
+		QVERIFY(e.canUndo());
+		e.replaceRange(0, QByteArray(4096, 'c'));
+		e.undo();
+		QVERIFY(!e.canUndo());
+		compare(data);
+		e.redo();
+		data.replace(0, 4096, QByteArray(4096, 'c'));
+
+		QVERIFY(e.writeChanges());
+	}
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), data);
+}
+
+void TestObject::testReadingAhead()
+{
+	QByteArray data = createByteArray(3'000'000, [](int i) { return i * 13 + i / 1000; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	{
+		BufferedEditor e(&file, m_backend);
+		e.setMemoryBudget(256 * 1024);
+		auto readForward = [&e](const QByteArray &expected) {
+			QVERIFY(e.seek(0));
+			QByteArray bytes;
+			while (!e.atEnd()) {
+				BufferedEditor::Span span = e.readSpan(4096);
+				bytes.append(span.data(), span.length);
+			}
+			QCOMPARE(bytes, expected);
+		};
+
+		readForward(data);
+
+		// Backwards, one byte at a time every few hundred bytes
+		for (int i = data.size() - 1; i >= 0; i -= 333) {
+			QVERIFY(e.seek(i));
+			QCOMPARE(*e.getByte().current, data[i]);
+		}
+
+		// What was read ahead must not outlive a save
+		for (int i = 0; i < data.size(); i += 100'000) {
+			e.seek(i);
+			e.replaceByte(char(i / 100'000));
+			data[i] = char(i / 100'000);
+		}
+		QVERIFY(e.writeChanges());
+		readForward(data);
+	}
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), data);
+}
+
+void TestObject::testLoadingInBackground()
+{
+	QByteArray data = createByteArray(3'000'000, [](int i) { return i * 17 + i / 777; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	BufferedEditor e(&file, m_backend);
+	e.setMemoryBudget(256 * 1024);
+
+	// Shift the bytes after the first section, so that the saved
+	// positions of the ones that get loaded differ from the current ones
+	e.seek(100);
+	e.insertByte('a');
+	data.insert(100, 'a');
+	e.seek(5000);
+	e.deleteByte();
+	data.remove(5000, 1);
+
+	for (qint64 position : QVector<qint64>{2'500'000, 1'000'000, 60'000, data.size() - 100}) {
+		e.load(position, 4096);
+		QTRY_VERIFY(e.isLoaded(position, 4096));
+		QVERIFY(e.seek(position));
+		int length = qMin(4096, data.size() - int(position));
+		QCOMPARE(e.read(length), data.mid(int(position), length));
+	}
+}
+
+void TestObject::testPatchingInPlace()
+{
+	QByteArray data = createByteArray(1'000'000, [](int i) { return i * 7 + i / 300; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	{
+		BufferedEditor e(&file, m_backend);
+
+		// Scattered single bytes, bytes close enough to be written together
+		// and a whole range
+		for (int i = 0; i < data.size(); i += 9'999) {
+			e.seek(i);
+			e.replaceByte(char(i));
+			data[i] = char(i);
+		}
+		for (int i = 500'000; i < 501'000; i += 50) {
+			e.seek(i);
+			e.replaceByte(char(~i));
+			data[i] = char(~i);
+		}
+		QByteArray bytes(40'000, char(0x5a));
+		e.replaceRange(700'000, bytes);
+		data.replace(700'000, bytes.size(), bytes);
+
+		// Bytes that were inserted and deleted again leave the rest in place
+		e.insertBytes(300'000, QByteArray("abc"));
+		e.deleteRange(300'000, 3);
+		e.seek(299'999);
+		e.replaceByte('a');
+		data[299'999] = 'a';
+		e.seek(300'001);
+		e.replaceByte('a');
+		data[300'001] = 'a';
+
+		QVERIFY(e.writeChanges());
+		QVERIFY(!e.isModified());
+
+		// And again on top of the saved state
+		e.seek(300'000);
+		e.replaceByte('b');
+		data[300'000] = 'b';
+		e.seek(data.size() - 1);
+		e.replaceByte('c');
+		data[data.size() - 1] = 'c';
+		QVERIFY(e.writeChanges());
+
+		QVERIFY(e.seek(0));
+		QByteArray current;
+		while (!e.atEnd()) {
+			BufferedEditor::Span span = e.readSpan(4096);
+			current.append(span.data(), span.length);
+		}
+		QCOMPARE(current, data);
+	}
+
+	// Close bytes on both sides of a section boundary take a single write
+	if (m_backend == BufferedEditor::Backend::Sections) {
+		BufferedEditor e(&file, m_backend);
+		StoragePolicy policy;
+		policy.setBlockSize(4096);
+		policy.setSectionSizeLimits(4096, 4096);
+		e.setStoragePolicy(policy);
+		for (int i : {10 * 4096 - 10, 10 * 4096 + 10}) {
+			e.seek(i);
+			e.replaceByte('d');
+			data[i] = 'd';
+		}
+		qint64 writeCount = e.statistics().writeCount;
+		QVERIFY(e.writeChanges());
+		QCOMPARE(e.statistics().writeCount, writeCount + 1);
+	}
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), data);
+}
+
+void TestObject::testShiftingBlocks()
+{
+	QByteArray data = createByteArray(2'000'000, [](int i) { return i * 11 + i / 500; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+
+	{
+		BufferedEditor e(&file, m_backend);
+		auto save = [&e, &file](const QByteArray &expected) {
+			QVERIFY(e.writeChanges());
+			QVERIFY(file.seek(0));
+			QCOMPARE(file.readAll(), expected);
+		};
+
+		// Whole blocks, where the file system supports shifting them,
+		// at an unaligned position and with other edits before them
+		QByteArray bytes = createByteArray(4096, [](int i) { return i * 3; });
+		e.insertBytes(1000, bytes);
+		data.insert(1000, bytes);
+		save(data);
+
+		e.seek(10);
+		e.replaceByte('x');
+		data[10] = 'x';
+		e.deleteRange(300'000, 8192);
+		data.remove(300'000, 8192);
+		save(data);
+
+		e.insertBytes(0, QByteArray(100, 'y'));
+		data.insert(0, QByteArray(100, 'y'));
+		e.insertBytes(900'000, QByteArray(3 * 4096 - 100, 'z'));
+		data.insert(900'000, QByteArray(3 * 4096 - 100, 'z'));
+		save(data);
+
+		e.deleteRange(50, 100);
+		data.remove(50, 100);
+		e.deleteRange(1'000'000, 4096 - 100);
+		data.remove(1'000'000, 4096 - 100);
+		save(data);
+
+		// Not a whole block
+		e.insertBytes(5, QByteArray(5, 'w'));
+		data.insert(5, QByteArray(5, 'w'));
+		save(data);
+	}
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), data);
+}
+
+void TestObject::testSavingToNewFile()
+{
+	QByteArray data = createByteArray(1'000'000, [](int i) { return i * 5 + i / 700; });
+
+	// The file is replaced, so it has to be opened by name
+	QTemporaryFile temporaryFile;
+	QVERIFY(temporaryFile.open());
+	QFile file(temporaryFile.fileName());
+	QVERIFY(file.open(QIODevice::ReadWrite));
+	file.write(data);
+	QVERIFY(file.flush());
+
+	{
+		BufferedEditor e(&file, m_backend);
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::NewFile);
+		e.setMemoryBudget(128 * 1024);
+		auto save = [&e, &file](const QByteArray &expected) {
+			QVERIFY(e.writeChanges());
+			QVERIFY(!e.isModified());
+			QCOMPARE(e.size(), qint64(expected.size()));
+			QVERIFY(file.seek(0));
+			QCOMPARE(file.readAll(), expected);
+			QVERIFY(e.seek(0));
+			QCOMPARE(e.read(expected.size()), expected);
+		};
+
+		// Read a part, so that some of the file is loaded
+		QVERIFY(e.seek(400'000));
+		QCOMPARE(e.read(100'000), data.mid(400'000, 100'000));
+
+		e.insertBytes(10, QByteArray("inserted"));
+		data.insert(10, QByteArray("inserted"));
+		e.deleteRange(500'000, 30'000);
+		data.remove(500'000, 30'000);
+		e.insertPattern(700'000, 100'000, QByteArray("ab"));
+		data.insert(700'000, QByteArray(100'000 / 2 * 2, 'a'));
+		for (int i = 700'001; i < 800'000; i += 2)
+			data[i] = 'b';
+		e.replaceRange(900'000, QByteArray(5, 'r'));
+		data.replace(900'000, 5, QByteArray(5, 'r'));
+		QByteArray beforeEdits = data;
+		save(data);
+
+		// Editing and undoing go on from the new file
+		e.insertBytes(0, QByteArray(3, 'x'));
+		data.insert(0, QByteArray(3, 'x'));
+		save(data);
+		e.undo();
+		data.remove(0, 3);
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::InPlace);
+		save(data);
+		QCOMPARE(data, beforeEdits);
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::NewFile);
+		while (e.canUndo())
+			e.undo();
+		save(createByteArray(1'000'000, [](int i) { return i * 5 + i / 700; }));
+	}
+
+#ifdef Q_OS_UNIX
+	// The other name of a hard-linked file would keep the old contents
+	QString linkName = file.fileName() + ".link";
+	QCOMPARE(::link(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(linkName).constData()), 0);
+	{
+		BufferedEditor e(&file, m_backend);
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::NewFile);
+		e.insertBytes(0, QByteArray("linked"));
+		QVERIFY(!e.startSaving());
+		QVERIFY(!e.writeChanges());
+		QVERIFY(e.isModified());
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::Automatic);
+		QVERIFY(e.writeChanges());
+	}
+	QFile link(linkName);
+	QVERIFY(link.open(QIODevice::ReadOnly));
+	QVERIFY(link.read(6) == "linked");
+	link.close();
+	QVERIFY(QFile::remove(linkName));
+#endif
+}
+
+void TestObject::testSavingInBackground()
+{
+	QByteArray data = createByteArray(3'000'000, [](int i) { return i * 3 + i / 900; });
+
+	QTemporaryFile temporaryFile;
+	QVERIFY(temporaryFile.open());
+	QFile file(temporaryFile.fileName());
+	QVERIFY(file.open(QIODevice::ReadWrite));
+	file.write(data);
+	QVERIFY(file.flush());
+
+	{
+		BufferedEditor e(&file, m_backend);
+		e.setMemoryBudget(128 * 1024);
+		QSignalSpy finishedSpy(&e, &BufferedEditor::saveFinished);
+		// Only the saves to a new file are done in the background
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::InPlace);
+		QVERIFY(!e.startSaving());
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::NewFile);
+
+		QVERIFY(e.seek(1'200'000));
+		QCOMPARE(e.read(100'000), data.mid(1'200'000, 100'000));
+		e.insertBytes(10, QByteArray("inserted"));
+		data.insert(10, QByteArray("inserted"));
+		e.deleteRange(1'000'000, 30'000);
+		data.remove(1'000'000, 30'000);
+		e.insertPattern(2'000'000, 100'000, QByteArray("ab"));
+		data.insert(2'000'000, QByteArray(100'000 / 2 * 2, 'a'));
+		for (int i = 2'000'001; i < 2'100'000; i += 2)
+			data[i] = 'b';
+		QByteArray saved = data;
+
+		QVERIFY(e.startSaving());
+		QVERIFY(e.isSaving());
+		QVERIFY(!e.startSaving());
+		// The saved contents can't be undone while they're being saved
+		QVERIFY(!e.canUndo());
+
+		// Edits made in the meantime stay on top of the saved contents
+		e.insertBytes(0, QByteArray(3, 'x'));
+		data.insert(0, QByteArray(3, 'x'));
+		e.deleteRange(1'500'000, 200'000);
+		data.remove(1'500'000, 200'000);
+		e.replaceRange(2'500'000, QByteArray(5, 'r'));
+		e.undo();
+		e.redo();
+		data.replace(2'500'000, 5, QByteArray(5, 'r'));
+		QVERIFY(e.canUndo());
+
+		QVERIFY(e.waitForSaving());
+		QVERIFY(!e.isSaving());
+		QCOMPARE(finishedSpy.count(), 1);
+		QVERIFY(file.seek(0));
+		QCOMPARE(file.readAll(), saved);
+		QVERIFY(e.isModified());
+		QCOMPARE(e.size(), qint64(data.size()));
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(data.size()), data);
+
+		// Undoing them gets back to what was saved
+		for (int i = 0; i < 3; ++i)
+			e.undo();
+		QVERIFY(!e.isModified());
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(saved.size()), saved);
+
+		// A cancelled save leaves the file as it was
+		e.deleteRange(0, 100'000);
+		QVERIFY(e.startSaving());
+		e.cancelSaving();
+		QVERIFY(!e.isSaving());
+		QCOMPARE(finishedSpy.count(), 2);
+		QVERIFY(e.isModified());
+		QVERIFY(file.seek(0));
+		QCOMPARE(file.readAll(), saved);
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(saved.size() - 100'000), saved.mid(100'000));
+
+		// Saving waits for the save in the background
+		QVERIFY(e.startSaving());
+		e.insertBytes(0, QByteArray("more"));
+		QVERIFY(e.writeChanges());
+		QVERIFY(!e.isModified());
+		QVERIFY(file.seek(0));
+		QCOMPARE(file.readAll(), QByteArray("more") + saved.mid(100'000));
+
+		// A save that is done during a transaction is finished when it ends
+		saved = QByteArray("during") + QByteArray("more") + saved.mid(100'000);
+		e.insertBytes(0, QByteArray("during"));
+		QSignalSpy progressSpy(&e, &BufferedEditor::saveProgress);
+		QVERIFY(e.startSaving());
+		e.beginTransaction();
+		e.insertBytes(0, QByteArray("ab"));
+		QTRY_VERIFY(progressSpy.last().at(0) == progressSpy.last().at(1));
+		QTest::qWait(200);
+		QVERIFY(e.isSaving());
+		e.insertBytes(2, QByteArray("cd"));
+		e.endTransaction();
+		QVERIFY(!e.isSaving());
+		QCOMPARE(finishedSpy.count(), 4);
+		QVERIFY(file.seek(0));
+		QCOMPARE(file.readAll(), saved);
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(saved.size() + 4), QByteArray("abcd") + saved);
+		e.undo();
+		QVERIFY(!e.isModified());
+	}
+}
+
+void TestObject::testSparseFiles()
+{
+	const int holeStart = 64 * 1024;
+	const int dataStart = 4 * 1024 * 1024;
+	QByteArray head = createByteArray(holeStart, [](int i) { return i * 7 + 1; });
+	QByteArray tail = createByteArray(64 * 1024, [](int i) { return i * 13 + 5; });
+
+	// Data, a hole, more data and a hole up to the end
+	QTemporaryFile temporaryFile;
+	QVERIFY(temporaryFile.open());
+	QFile file(temporaryFile.fileName());
+	QVERIFY(file.open(QIODevice::ReadWrite));
+	file.write(head);
+	QVERIFY(file.seek(dataStart));
+	file.write(tail);
+	QVERIFY(file.resize(2 * dataStart));
+	QVERIFY(file.flush());
+
+	QByteArray data(2 * dataStart, char(0));
+	data.replace(0, head.size(), head);
+	data.replace(dataStart, tail.size(), tail);
+
+	// Not every file system has holes, the contents have to be right either way
+	bool sparse = holeLength(&file, holeStart, 1) == 1;
+	auto isHole = [&file](qint64 position, qint64 length) {
+		return holeLength(&file, position, length) == length;
+	};
+
+	{
+		BufferedEditor e(&file, m_backend);
+		e.setMemoryBudget(256 * 1024);
+		auto save = [&e, &file](const QByteArray &expected) {
+			QVERIFY(e.writeChanges());
+			QVERIFY(file.seek(0));
+			QCOMPARE(file.readAll(), expected);
+			QVERIFY(e.seek(0));
+			QCOMPARE(e.read(expected.size()), expected);
+		};
+
+		// The holes read as zeros
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(data.size()), data);
+
+		Finder finder(&e);
+		finder.search(0, QByteArray(3, char(0)) + tail.left(5));
+		finder.findNext();
+		QCOMPARE(finder.searchResultPosition(), qint64(dataStart - 3));
+
+		// Moving the holes keeps them
+		e.insertBytes(10, QByteArray("abc"));
+		data.insert(10, QByteArray("abc"));
+		save(data);
+		if (sparse) {
+			QVERIFY(isHole(2 * 1024 * 1024, 1024 * 1024));
+			QVERIFY(isHole(data.size() - 1024 * 1024, 1024 * 1024));
+		}
+
+		// Zeros inserted as a pattern are saved as a hole
+		e.insertPattern(20'000, 1024 * 1024, QByteArray(1, char(0)));
+		data.insert(20'000, QByteArray(1024 * 1024, char(0)));
+		save(data);
+		if (sparse)
+			QVERIFY(isHole(512 * 1024, 256 * 1024));
+
+		// And so does a copy of the file
+		e.setSaveStrategy(BufferedEditor::SaveStrategy::NewFile);
+		e.deleteRange(0, 5);
+		data.remove(0, 5);
+		save(data);
+		if (sparse) {
+			QVERIFY(isHole(512 * 1024, 256 * 1024));
+			QVERIFY(isHole(3 * 1024 * 1024, 1024 * 1024));
+			QVERIFY(isHole(data.size() - 1024 * 1024, 1024 * 1024));
+		}
+	}
+}
+
+void TestObject::testCursors()
+{
+	QByteArray data = createByteArray(1'000'000, [](int i) { return i * 11 + i / 1000; });
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+	QVERIFY(file.flush());
+
+	BufferedEditor e(&file, m_backend);
+	e.setMemoryBudget(128 * 1024);
+	QVERIFY(e.seek(500'000));
+
+	// Reading through the cursors in turn leaves the others where they are
+	BufferedEditor::Cursor first(&e);
+	BufferedEditor::Cursor second(&e, 700'000);
+	for (int i = 0; i < 200; ++i) {
+		QCOMPARE(first.read(1000), data.mid(i * 1000, 1000));
+		QCOMPARE(second.read(1000), data.mid(700'000 + i * 1000, 1000));
+	}
+	QCOMPARE(first.position(), qint64(200'000));
+	QCOMPARE(second.position(), qint64(900'000));
+	QCOMPARE(e.position(), qint64(500'000));
+	QCOMPARE(*e.getByte().current, data[500'000]);
+
+	// A cursor stays at the same position when the bytes change around it
+	e.insertBytes(100, QByteArray("inserted"));
+	data.insert(100, QByteArray("inserted"));
+	e.insertPattern(50'000, 100'000, QByteArray(1, 'p'));
+	data.insert(50'000, QByteArray(100'000, 'p'));
+	QCOMPARE(first.read(10'000), data.mid(200'000, 10'000));
+	first.seek(49'990);
+	QCOMPARE(*first.getByte().current, data[49'990]);
+	QCOMPARE(first.read(20), data.mid(49'991, 20));
+	QCOMPARE(first.readSpan(1000).patternSize, 1);
+
+	// and reads nothing once they are gone
+	e.deleteRange(600'000, e.size() - 600'000);
+	data.truncate(600'000);
+	QVERIFY(second.atEnd());
+	QVERIFY(second.read(10).isEmpty());
+	e.undo();
+	QCOMPARE(e.size(), qint64(1'100'008));
+	QVERIFY(!second.atEnd());
+	second.seek(599'990);
+	QCOMPARE(second.read(20).left(10), data.right(10));
+	QCOMPARE(BufferedEditor::Cursor(&e, 0).read(data.size()), data);
+}
+
+void TestObject::testSnapshots()
+{
+	QByteArray data = createByteArray(2'000'000, [](int i) { return i * 5 + i / 300; });
+
+	QTemporaryFile temporaryFile;
+	QVERIFY(temporaryFile.open());
+	QFile file(temporaryFile.fileName());
+	QVERIFY(file.open(QIODevice::ReadWrite));
+	file.write(data);
+	QVERIFY(file.flush());
+
+	BufferedEditor e(&file, m_backend);
+	e.setMemoryBudget(256 * 1024);
+	e.setSaveStrategy(BufferedEditor::SaveStrategy::InPlace);
+	e.insertBytes(1000, QByteArray("inserted"));
+	data.insert(1000, QByteArray("inserted"));
+	e.insertPattern(500'000, 100'000, QByteArray("xyz"));
+	QByteArray pattern;
+	while (pattern.size() < 100'000)
+		pattern.append("xyz");
+	data.insert(500'000, pattern.left(100'000));
+	e.deleteRange(1'500'000, 1000);
+	data.remove(1'500'000, 1000);
+
+	// The snapshot keeps the contents as they were
+	Snapshot snapshot = e.snapshot();
+	QCOMPARE(snapshot.size(), qint64(data.size()));
+	QCOMPARE(snapshot.version(), e.version());
+	QByteArray snapshotData = data;
+	e.replaceRange(0, QByteArray(2000, 'r'));
+	e.deleteRange(400'000, 300'000);
+	QVERIFY(snapshot.version() != e.version());
+	QCOMPARE(snapshot.read(0, snapshot.size()), snapshotData);
+	QCOMPARE(snapshot.read(499'990, 30), snapshotData.mid(499'990, 30));
+
+	// Copies of it can be read on other threads while the editing goes on
+	QVector<QByteArray> results(4);
+	QVector<QThread *> threads;
+	for (int i = 0; i < results.size(); ++i) {
+		threads.append(QThread::create([snapshot, &results, i]() mutable {
+			for (qint64 position = i * 1000; position < snapshot.size(); position += 64 * 1024)
+				results[i].append(snapshot.read(position, 1000));
+		}));
+		threads.last()->start();
+	}
+	e.insertBytes(10, QByteArray(100, 'i'));
+	QVERIFY(e.seek(0));
+	QCOMPARE(e.read(20), QByteArray(10, 'r') + QByteArray(10, 'i'));
+	for (int i = 0; i < results.size(); ++i) {
+		threads[i]->wait();
+		delete threads[i];
+		QByteArray expected;
+		for (qint64 position = i * 1000; position < snapshotData.size(); position += 64 * 1024)
+			expected.append(snapshotData.mid(int(position), 1000));
+		QCOMPARE(results[i], expected);
+	}
+
+	// Writing over the file leaves the snapshot without the saved bytes
+	QVERIFY(snapshot.isValid());
+	QVERIFY(e.writeChanges());
+	QVERIFY(!snapshot.isValid());
+	QCOMPARE(snapshot.read(1'800'000, 100), QByteArray());
+	QVERIFY(!snapshot.errorString().isEmpty());
+	QVERIFY(e.snapshot().isValid());
+
+	// The bytes held in memory outlive the mapping of the saved file,
+	// also those of a section that only had bytes deleted
+	QCOMPARE(snapshot.read(1'499'990, 20), snapshotData.mid(1'499'990, 20));
+	QCOMPARE(snapshot.read(1000, 8), QByteArray("inserted"));
+}
+
+void TestObject::testSectionSizes()
+{
+	// The sections grow while the file is read on and shrink otherwise
+	StoragePolicy policy;
+	policy.setBlockSize(4096);
+	policy.setSectionSizeLimits(5000, 64 * 1024);
+	QCOMPARE(policy.minimumSectionSize(), 4096);
+	QCOMPARE(policy.sectionSize(), int(StoragePolicy::defaultSectionSize));
+	qint64 position = policy.sectionSize();
+	policy.recordRead(0, position);
+	QCOMPARE(policy.sectionSize(), int(StoragePolicy::defaultSectionSize) / 2);
+	for (int i = 0; i < 10; ++i) {
+		int length = policy.sectionSize();
+		policy.recordRead(position, length);
+		position += length;
+	}
+	QCOMPARE(policy.sectionSize(), 64 * 1024);
+	policy.recordRead(position - 200'000, 4096);
+	QCOMPARE(policy.sectionSize(), 32 * 1024);
+	QCOMPARE(policy.alignDown(10'000), qint64(8192));
+
+	QByteArray data = createByteArray(3'000'000, [](int i) { return i * 3 + i / 5000; });
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+	QVERIFY(file.flush());
+
+	// The contents are the same whatever the sizes
+	for (int size : {4096, 12'288, 1024 * 1024}) {
+		BufferedEditor e(&file, m_backend);
+		StoragePolicy fixed = e.storagePolicy();
+		fixed.setSectionSizeLimits(size, size);
+		e.setStoragePolicy(fixed);
+		QCOMPARE(e.storagePolicy().sectionSize(), e.storagePolicy().maximumSectionSize());
+
+		QVERIFY(e.seek(1'234'567));
+		QCOMPARE(e.read(100), data.mid(1'234'567, 100));
+		e.insertBytes(1'000'000, QByteArray("inserted"));
+		data.insert(1'000'000, QByteArray("inserted"));
+		for (int i = 0; i < 100; ++i) {
+			qint64 p = qint64(i) * 29'989 % data.size();
+			QVERIFY(e.seek(p));
+			QCOMPARE(e.read(50), data.mid(int(p), 50));
+		}
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(data.size()), data);
+		QVERIFY(e.writeChanges());
+		QVERIFY(file.seek(0));
+		QCOMPARE(file.readAll(), data);
+	}
+}
+
+void TestObject::testStatistics()
+{
+	QByteArray data = createByteArray(3'000'000, [](int i) { return i * 7 + i / 1000; });
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+	QVERIFY(file.flush());
+
+	BufferedEditor e(&file, m_backend);
+	e.setSaveStrategy(BufferedEditor::SaveStrategy::InPlace);
+	BufferedEditor::Statistics statistics = e.statistics();
+	QCOMPARE(statistics.bytesRead, qint64(0));
+	QCOMPARE(statistics.readCount, qint64(0));
+	QCOMPARE(statistics.bytesWritten, qint64(0));
+	QCOMPARE(statistics.undoEntries, qint64(0));
+
+	// Reading loads a part of the file
+	QVERIFY(e.seek(1'000'000));
+	QCOMPARE(e.read(100), data.mid(1'000'000, 100));
+	statistics = e.statistics();
+	QVERIFY(statistics.residentSections >= 1);
+	QVERIFY(statistics.residentBytes >= 100);
+	QVERIFY(statistics.bytesRead >= 100);
+	QVERIFY(statistics.readCount >= 1);
+	QCOMPARE(statistics.writeCount, qint64(0));
+
+	// The undo history grows with the edits
+	e.insertBytes(2'000'000, QByteArray("inserted"));
+	data.insert(2'000'000, QByteArray("inserted"));
+	e.replaceRange(10, QByteArray("replaced"));
+	data.replace(10, 8, QByteArray("replaced"));
+	statistics = e.statistics();
+	QCOMPARE(statistics.undoEntries, qint64(2));
+	QVERIFY(statistics.undoMemory > 0);
+
+	// Saving counts the bytes written, moved ones included
+	qint64 bytesRead = statistics.bytesRead;
+	QVERIFY(e.writeChanges());
+	statistics = e.statistics();
+	QVERIFY(statistics.bytesWritten >= 16);
+	QVERIFY(statistics.writeCount >= 1);
+	QVERIFY(statistics.bytesRead >= bytesRead);
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), data);
+}
+
+void TestObject::testMemoryGovernor()
+{
+	const qint64 mebibyte = 1024 * 1024;
+	const qint64 minimum = MemoryGovernor::minimumEditorBudget;
+	QByteArray data = createByteArray(10'000'000, [](int i) { return i * 11 + i / 777; });
+	QTemporaryFile files[3];
+	std::unique_ptr<BufferedEditor> editors[3];
+	for (int i = 0; i < 3; ++i) {
+		QVERIFY(files[i].open());
+		files[i].write(data);
+		QVERIFY(files[i].flush());
+		editors[i].reset(new BufferedEditor(&files[i], m_backend));
+	}
+	BufferedEditor &a = *editors[0], &b = *editors[1], &c = *editors[2];
+
+	// The one in front gets what the others don't use
+	MemoryGovernor governor(24 * mebibyte);
+	governor.addEditor(&a);
+	QCOMPARE(governor.foreground(), &a);
+	QCOMPARE(a.memoryBudget(), 24 * mebibyte);
+	QVERIFY(a.seek(0));
+	QCOMPARE(a.read(data.size()), data);
+	governor.addEditor(&b);
+	QCOMPARE(governor.foreground(), &b);
+	QVERIFY(b.seek(0));
+	QCOMPARE(b.read(data.size()), data);
+	governor.rebalance();
+	QCOMPARE(governor.pressure(), MemoryGovernor::Pressure::Normal);
+	QVERIFY(governor.usage() <= governor.budget());
+
+	// The ones in the background give up their sections for a new one,
+	// the one that was in front longest ago first
+	governor.addEditor(&c);
+	QVERIFY(a.statistics().residentBytes <= minimum);
+	QVERIFY(b.statistics().residentBytes <= minimum);
+	QCOMPARE(a.memoryBudget(), minimum);
+	QCOMPARE(c.memoryBudget(), 24 * mebibyte - 2 * minimum);
+	QVERIFY(c.seek(0));
+	QCOMPARE(c.read(data.size()), data);
+	QVERIFY(a.seek(5'000'000));
+	QCOMPARE(a.read(1000), data.mid(5'000'000, 1000));
+
+	// Modified bytes are kept, which leaves less for the one in front
+	governor.setForeground(&a);
+	QCOMPARE(governor.foreground(), &a);
+	a.insertBytes(0, QByteArray(int(14 * mebibyte), 'a'));
+	governor.setForeground(&b);
+	QCOMPARE(governor.pressure(), MemoryGovernor::Pressure::High);
+	QVERIFY(b.memoryBudget() < 12 * mebibyte);
+	QVERIFY(a.seek(14 * mebibyte));
+	QCOMPARE(a.read(100), data.left(100));
+	governor.setBudget(8 * mebibyte);
+	QCOMPARE(governor.pressure(), MemoryGovernor::Pressure::Critical);
+
+	// Saved bytes can be given up again
+	QVERIFY(a.writeChanges());
+	governor.setBudget(24 * mebibyte);
+	QVERIFY(governor.pressure() != MemoryGovernor::Pressure::Critical);
+	QVERIFY(governor.usage() <= governor.budget());
+	for (BufferedEditor *editor : {&a, &b, &c})
+		governor.removeEditor(editor);
+	QCOMPARE(governor.usage(), qint64(0));
+	QVERIFY(!governor.foreground());
+}
+
+void TestObject::testSlabVector()
+{
+	SlabVector<QByteArray> v;
+	QVERIFY(v.isEmpty());
+	for (int i = 0; i < 1000; ++i)
+		v.append(QByteArray::number(i));
+	QCOMPARE(v.size(), 1000);
+	QCOMPARE(v.capacity(), 1000 / SlabVector<QByteArray>::slabSize * SlabVector<QByteArray>::slabSize +
+			 SlabVector<QByteArray>::slabSize);
+
+	// The elements stay where they are while others are inserted and removed
+	const QByteArray *element = &v[500];
+	v.insert(0, QByteArray("first"));
+	v.remove(1, 10);
+	v.removeIf([](int i) { return i > 0 && i % 2 == 0; });
+	QVERIFY(&v[(500 - 10 + 1) / 2 + 1] == element);
+	QCOMPARE(v[0], QByteArray("first"));
+	int i = 0;
+	for (const QByteArray &bytes : v) {
+		if (i > 0)
+			QCOMPARE(bytes, QByteArray::number(2 * i + 8));
+		++i;
+	}
+	QCOMPARE(i, v.size());
+
+	// The slots of the removed elements are reused
+	int capacity = v.capacity();
+	while (v.size() < 1000)
+		v.append(QByteArray("again"));
+	QCOMPARE(v.capacity(), capacity);
+	v.clear();
+	QVERIFY(v.isEmpty());
+	QCOMPARE(v.capacity(), capacity);
+}
+
+void TestObject::testJournal()
+{
+	QByteArray data = createByteArray(1'000'000, [](int i) { return i * 13 + i / 100; });
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+	QVERIFY(file.flush());
+	QString journalFileName = EditJournal::journalFileName(file.fileName());
+
+	auto compare = [](BufferedEditor &e, const QByteArray &expected) {
+		QCOMPARE(e.size(), qint64(expected.size()));
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(expected.size()), expected);
+	};
+
+	// The editor going away with the journal on leaves it behind, like a crash
+	QByteArray redone;
+	{
+		BufferedEditor e(&file, m_backend);
+		QVERIFY(!e.hasJournal());
+		e.setJournaling(true);
+		QVERIFY(e.isJournaling());
+		// It's only written with the first edit
+		QVERIFY(!QFile::exists(journalFileName));
+		QVERIFY(!e.hasJournal());
+
+		e.insertBytes(500'000, QByteArray("inserted"));
+		data.insert(500'000, QByteArray("inserted"));
+		QVERIFY(QFile::exists(journalFileName));
+		e.deleteRange(1000, 5000);
+		data.remove(1000, 5000);
+		e.replaceRange(10, QByteArray("replaced"));
+		data.replace(10, 8, QByteArray("replaced"));
+		e.fillRange(100'000, 1000, 'f');
+		data.replace(100'000, 1000, QByteArray(1000, 'f'));
+		e.insertPattern(200'000, 100'000, QByteArray("abc"));
+		data.insert(200'000, QByteArray("abc").repeated(33'334).left(100'000));
+		e.beginTransaction();
+		e.insertBytes(0, QByteArray("x"));
+		e.insertBytes(1, QByteArray("y"));
+		e.endTransaction();
+		redone = QByteArray("xy") + data;
+		e.undo();
+		e.redo();
+		e.undo();
+		compare(e, data);
+	}
+
+	// A record that wasn't written completely is left out
+	{
+		QFile journal(journalFileName);
+		QVERIFY(journal.open(QIODevice::Append));
+		journal.write(QByteArray("\x40\0\0\0torn", 8));
+	}
+
+	{
+		BufferedEditor e(&file, m_backend);
+		QVERIFY(e.hasJournal());
+		QVERIFY(e.restoreJournal() > 0);
+		QVERIFY(e.isJournaling());
+		QVERIFY(e.isModified());
+		compare(e, data);
+		QVERIFY(e.canRedo());
+		e.redo();
+		compare(e, redone);
+		e.undo();
+		compare(e, data);
+
+		// Saving starts the journal over from the saved file
+		QVERIFY(e.writeChanges());
+		QVERIFY(!QFile::exists(journalFileName));
+		QVERIFY(!e.hasJournal());
+		e.insertBytes(0, QByteArray("after saving"));
+		data.insert(0, QByteArray("after saving"));
+	}
+
+	{
+		BufferedEditor e(&file, m_backend);
+		QVERIFY(e.hasJournal());
+		QCOMPARE(e.restoreJournal(), 1);
+		compare(e, data);
+
+		// Turning it off removes it
+		e.setJournaling(false);
+		QVERIFY(!QFile::exists(journalFileName));
+		e.setJournaling(true);
+		QVERIFY(!QFile::exists(journalFileName));
+		QVERIFY(e.writeChanges());
+		QVERIFY(!QFile::exists(journalFileName));
+		e.deleteRange(0, 100);
+		data.remove(0, 100);
+		QVERIFY(QFile::exists(journalFileName));
+	}
+
+	// Undoing or redoing past the start of the journal compacts it to the
+	// changes made to the file, however many steps it took to get there
+	{
+		BufferedEditor e(&file, m_backend);
+		QCOMPARE(e.restoreJournal(), 1);
+		compare(e, data);
+		e.replaceRange(1000, QByteArray("replaced"));
+		data.replace(1000, 8, QByteArray("replaced"));
+		QByteArray replaced = data;
+		e.insertPattern(300'000, 100'000, QByteArray("xyz"));
+		QVERIFY(e.writeChanges());
+		for (int i = 0; i < 50; ++i) {
+			e.undo();
+			e.redo();
+		}
+		e.undo();
+		e.deleteRange(500'000, 10);
+		data = replaced;
+		data.remove(500'000, 10);
+		compare(e, data);
+	}
+
+	{
+		BufferedEditor e(&file, m_backend);
+		QVERIFY(e.hasJournal());
+		int count = e.restoreJournal();
+		QVERIFY(count > 0 && count < 10);
+		compare(e, data);
+	}
+
+	// A journal of a file that changed since isn't replayed
+	QVERIFY(file.seek(file.size()));
+	file.write("changed");
+	QVERIFY(file.flush());
+	{
+		BufferedEditor e(&file, m_backend);
+		QVERIFY(!e.hasJournal());
+		QCOMPARE(e.restoreJournal(), -1);
+		e.setJournaling(true);
+		e.setJournaling(false);
+	}
+	QVERIFY(!QFile::exists(journalFileName));
+}
+
+void TestObject::testSpillingDeletedBytes()
+{
+	const qint64 budget = 256 * 1024;
+	QByteArray data = createByteArray(8'000'000, [](int i) { return i * 13 + i / 4099; });
+	QByteArray deleted = data;
+	deleted.remove(1'000'000, 6'000'000);
+
+	// The file is replaced, so it has to be opened by name
+	QTemporaryFile temporaryFile;
+	QVERIFY(temporaryFile.open());
+	QFile file(temporaryFile.fileName());
+	QVERIFY(file.open(QIODevice::ReadWrite));
+	file.write(data);
+	QVERIFY(file.flush());
+
+	BufferedEditor e(&file, m_backend);
+	e.setSaveStrategy(BufferedEditor::SaveStrategy::InPlace);
+	e.setMemoryBudget(budget);
+	auto compare = [&e, &file](const QByteArray &expected) {
+		QCOMPARE(e.size(), qint64(expected.size()));
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(expected.size()), expected);
+		QVERIFY(file.seek(0));
+		QCOMPARE(file.readAll(), expected);
+	};
+
+	// Far more is deleted than fits in the budget. The history keeps
+	// the deleted bytes on disk once the file doesn't have them anymore
+	e.deleteRange(1'000'000, 6'000'000);
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	QVERIFY(e.writeChanges());
+	compare(deleted);
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+
+	// Undoing brings them back from there, for a snapshot too, and they
+	// are read from there without being held in memory
+	QVERIFY(e.canUndo());
+	e.undo();
+	QCOMPARE(e.size(), qint64(data.size()));
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	QVERIFY(e.seek(0));
+	QCOMPARE(e.read(data.size()), data);
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	Snapshot snapshot = e.snapshot();
+	QCOMPARE(snapshot.read(0, data.size()), data);
+
+	// And saving writes them again, in place or to a new file
+	QVERIFY(e.writeChanges());
+	compare(data);
+	e.redo();
+	QVERIFY(e.writeChanges());
+	compare(deleted);
+	e.undo();
+	e.setSaveStrategy(BufferedEditor::SaveStrategy::NewFile);
+	QVERIFY(e.writeChanges());
+	compare(data);
+}
+
+void TestObject::testFillingLargeRanges()
+{
+	const qint64 budget = 256 * 1024;
+	QByteArray data = createByteArray(8'000'000, [](int i) { return i * 17 + i / 3001; });
+	QByteArray filled = data;
+	filled.replace(500'000, 7'000'000, QByteArray(7'000'000, 'f'));
+
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	file.write(data);
+	QVERIFY(file.flush());
+
+	BufferedEditor e(&file, m_backend);
+	e.setSaveStrategy(BufferedEditor::SaveStrategy::InPlace);
+	e.setMemoryBudget(budget);
+	auto compare = [&e](const QByteArray &expected) {
+		QCOMPARE(e.size(), qint64(expected.size()));
+		QVERIFY(e.seek(0));
+		QCOMPARE(e.read(expected.size()), expected);
+	};
+
+	// Neither the filled bytes nor the ones they replace are held in memory,
+	// and undoing the fill doesn't load them either
+	e.fillRange(100'000, 7'000'000, 'g');
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	e.undo();
+	QVERIFY(!e.canUndo());
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	compare(data);
+
+	e.fillRange(500'000, 7'000'000, 'f');
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	compare(filled);
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	QVERIFY(e.writeChanges());
+	QVERIFY(e.statistics().residentBytes <= 4 * budget);
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), filled);
+
+	// The fill is undone and redone as a single edit
+	QVERIFY(e.canUndo());
+	e.undo();
+	compare(data);
+	e.redo();
+	compare(filled);
+	e.undo();
+	QVERIFY(e.writeChanges());
+	QVERIFY(file.seek(0));
+	QCOMPARE(file.readAll(), data);
+}
+
 void TestObject::testReadingHelper(const QByteArray &data, const QVector<int> &indicesToRead)
 {
 	QTemporaryFile file;
 	QVERIFY(file.open());
 	file.write(data);
 	{
-		BufferedEditor e(&file);
+		BufferedEditor e(&file, m_backend);
 		for (int index : indicesToRead) {
 			e.seek(index);
 			auto byte = e.getByte();
@@ -245,7 +1688,7 @@ void TestObject::testDeletingHelper(const QByteArray &data, const QVector<int> &
 	QVERIFY(file.open());
 	file.write(data);
 	{
-		BufferedEditor e(&file);
+		BufferedEditor e(&file, m_backend);
 		for (int index : indicesToDelete) {
 			e.seek(index);
 			e.deleteByte();
@@ -265,7 +1708,7 @@ void TestObject::testReadingAndDeletingHelper(const QByteArray &data, const QVec
 	QVERIFY(file.open());
 	file.write(data);
 	{
-		BufferedEditor e(&file);
+		BufferedEditor e(&file, m_backend);
 		for (auto index : indicesToDeleteAndRead) {
 			e.seek(index.first);
 			e.deleteByte();
@@ -290,7 +1733,7 @@ void TestObject::testReadingInsertingAndDeletingHelper(const QByteArray &data, c
 	QVERIFY(file.open());
 	file.write(data);
 	{
-		BufferedEditor e(&file);
+		BufferedEditor e(&file, m_backend);
 		for (auto index : indices) {
 			e.seek(index.r);
 			auto b = e.getByte();
@@ -334,7 +1777,7 @@ void TestObject::testUndoRedoHelper(const QByteArray &data, const QVector<Indice
 	QVERIFY(file.open());
 	file.write(data);
 	{
-		BufferedEditor e(&file);
+		BufferedEditor e(&file, m_backend);
 		for (auto index : indices) {
 			e.seek(index.r);
 			auto b = e.getByte();
@@ -408,7 +1851,7 @@ void TestObject::testFindNextHelper(const QByteArray &data, const QVector<QPair<
 	QTemporaryFile file;
 	QVERIFY(file.open());
 	file.write(data);
-	BufferedEditor e(&file);
+	BufferedEditor e(&file, m_backend);
 	for (auto q : queries) {
 		Finder *finder = new Finder(&e);
 		finder->search(q.first, q.second);
@@ -437,5 +1880,17 @@ void TestObject::testFindNextHelper(const QByteArray &data, const QVector<QPair<
 	}
 }
 
-QTEST_MAIN(TestObject)
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	// Run all tests against each of the editor backends
+	int status = 0;
+	for (auto backend : {BufferedEditor::Backend::Sections, BufferedEditor::Backend::PieceTable}) {
+		TestObject test(backend);
+		status |= QTest::qExec(&test, argc, argv);
+	}
+	return status;
+}
+
 #include "tests.moc"
@@ -4,13 +4,49 @@ TARGET = tests
 TEMPLATE = app
 CONFIG = c++17 qt warn_on depend_includepath testcase no_testcase_installs
 
+# The atomic counters use QAtomicInteger::loadRelaxed()
+!versionAtLeast(QT_VERSION, 5.14.0): error("Hexed requires Qt 5.14 or newer")
+
 SRCDIR = ../app
 INCLUDEPATH += $$SRCDIR
 
-HEADERS += $$SRCDIR/bufferededitor.h \
-           $$SRCDIR/finder.h
+HEADERS += $$SRCDIR/bitmap.h \
+           $$SRCDIR/bufferededitor.h \
+           $$SRCDIR/editjournal.h \
+           $$SRCDIR/editorbackend.h \
+           $$SRCDIR/fenwicktree.h \
+           $$SRCDIR/filecopier.h \
+           $$SRCDIR/filemover.h \
+           $$SRCDIR/filesource.h \
+           $$SRCDIR/finder.h \
+           $$SRCDIR/iocounters.h \
+           $$SRCDIR/memorygovernor.h \
+           $$SRCDIR/patchwriter.h \
+           $$SRCDIR/piecetablebackend.h \
+           $$SRCDIR/prefetcher.h \
+           $$SRCDIR/sectionbackend.h \
+           $$SRCDIR/slabvector.h \
+           $$SRCDIR/snapshot.h \
+           $$SRCDIR/sparsefile.h \
+           $$SRCDIR/spillfile.h \
+           $$SRCDIR/storagepolicy.h
 
-SOURCES += $$SRCDIR/bufferededitor.cpp \
-           $$SRCDIR/finder.cpp
+SOURCES += $$SRCDIR/bitmap.cpp \
+           $$SRCDIR/bufferededitor.cpp \
+           $$SRCDIR/editjournal.cpp \
+           $$SRCDIR/fenwicktree.cpp \
+           $$SRCDIR/filecopier.cpp \
+           $$SRCDIR/filemover.cpp \
+           $$SRCDIR/filesource.cpp \
+           $$SRCDIR/finder.cpp \
+           $$SRCDIR/memorygovernor.cpp \
+           $$SRCDIR/patchwriter.cpp \
+           $$SRCDIR/piecetablebackend.cpp \
+           $$SRCDIR/prefetcher.cpp \
+           $$SRCDIR/sectionbackend.cpp \
+           $$SRCDIR/snapshot.cpp \
+           $$SRCDIR/sparsefile.cpp \
+           $$SRCDIR/spillfile.cpp \
+           $$SRCDIR/storagepolicy.cpp
 
 SOURCES += tests.cpp